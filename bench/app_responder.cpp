@@ -0,0 +1,259 @@
+// Stand-in servers for application checks
+// Listens on consecutive ports of one address, each port answers like a healthy or a broken service:
+//   base + 0  HTTP 200              base + 1  HTTP 503
+//   base + 2  Redis +PONG           base + 3  Redis -LOADING
+//   base + 4  MySQL greeting, login accepted, session closed on COM_QUIT
+//   base + 5  MySQL error packet instead of a greeting, as with too many connections
+//   base + 6  MySQL greeting, login denied
+//   base + 7  accepts and never answers
+// Sessions of the MySQL ports closed by the client before a login or COM_QUIT are counted as aborted connects,
+// which mysqld counts against max_connect_errors of the client host.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define ROLE_NUM     8
+#define BUF_SIZE     1024
+#define MAX_EVENTS   256
+
+enum { HTTP_OK = 0, HTTP_FAIL, REDIS_OK, REDIS_FAIL, MYSQL_OK, MYSQL_BUSY, MYSQL_DENY, HANG };
+
+static const char *role_names[ROLE_NUM] = {
+    "http_ok", "http_fail", "redis_ok", "redis_fail", "mysql_ok", "mysql_busy", "mysql_deny", "hang"
+};
+
+struct conn {
+    int     role;
+    bool    login;      // login received
+    bool    quit;       // COM_QUIT received
+    size_t  len;
+    char    buf[BUF_SIZE];
+};
+
+struct role_stat {
+    unsigned long accepted;
+    unsigned long logins;
+    unsigned long quits;
+    unsigned long aborted;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal(int) {
+    running = 0;
+}
+
+static void send_all(int fd, const void *data, size_t len) {
+    // answers are a few dozen bytes into a fresh socket buffer
+    if (send(fd, data, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        fprintf(stderr, "WARNING: Short send on fd %d\n", fd);
+    }
+}
+
+// MySQL packet of payload len with sequence seq
+static void send_mysql(int fd, uint8_t seq, const char *payload, size_t len) {
+    char pkt[BUF_SIZE];
+    pkt[0] = len & 0xff;
+    pkt[1] = (len >> 8) & 0xff;
+    pkt[2] = (len >> 16) & 0xff;
+    pkt[3] = seq;
+    memcpy(pkt + 4, payload, len);
+    send_all(fd, pkt, 4 + len);
+}
+
+static void send_greeting(int fd) {
+    // protocol 10, version, thread id, 8 bytes of scramble, filler, capabilities and the rest of a 5.7 greeting
+    static const char greeting[] =
+        "\x0a" "5.7.0-stand-in\0"
+        "\x01\x00\x00\x00"
+        "abcdefgh\0"
+        "\xff\xf7" "\x21" "\x02\x00" "\xff\x81" "\x15"
+        "\0\0\0\0\0\0\0\0\0\0"
+        "ijklmnopqrst\0"
+        "mysql_native_password";
+    send_mysql(fd, 0, greeting, sizeof(greeting));
+}
+
+// Handle the bytes read so far, return false once the connection is to be closed
+static bool serve(int fd, conn &c, role_stat &st) {
+    switch (c.role) {
+        case HTTP_OK:
+        case HTTP_FAIL: {
+            c.buf[c.len < BUF_SIZE ? c.len : BUF_SIZE - 1] = '\0';
+            if (!strstr(c.buf, "\r\n\r\n")) return c.len < BUF_SIZE - 1;
+            const char *answer = c.role == HTTP_OK ? "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok"
+                : "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            send_all(fd, answer, strlen(answer));
+            return false;
+        }
+        case REDIS_OK:
+        case REDIS_FAIL: {
+            if (!memchr(c.buf, '\n', c.len)) return c.len < BUF_SIZE;
+            const char *answer = c.role == REDIS_OK ? "+PONG\r\n" : "-LOADING Redis is loading the dataset in memory\r\n";
+            send_all(fd, answer, strlen(answer));
+            return false;
+        }
+        case MYSQL_OK:
+        case MYSQL_DENY: {
+            // the login, then COM_QUIT, each a packet of its own
+            size_t off = 0;
+            while (c.len - off >= 4) {
+                size_t plen = (uint8_t)c.buf[off] | ((uint8_t)c.buf[off + 1] << 8) | ((uint8_t)c.buf[off + 2] << 16);
+                if (c.len - off < 4 + plen) break;
+                uint8_t seq = (uint8_t)c.buf[off + 3];
+                const char *payload = c.buf + off + 4;
+                off += 4 + plen;
+                if (seq == 0 && plen == 1 && payload[0] == 0x01) {
+                    c.quit = true;
+                    ++st.quits;
+                    return false;
+                }
+                if (seq != 1 || plen < 4 + 4 + 1 + 23 + 1) {
+                    fprintf(stderr, "WARNING: Unexpected mysql packet, seq %u, length %zu\n", seq, plen);
+                    return false;
+                }
+                c.login = true;
+                ++st.logins;
+                if (c.role == MYSQL_OK) {
+                    static const char ok[] = { 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00 };
+                    send_mysql(fd, seq + 1, ok, sizeof(ok));
+                } else {
+                    static const char denied[] = "\xff\x15\x04#28000Access denied for user";
+                    send_mysql(fd, seq + 1, denied, sizeof(denied) - 1);
+                    return false;
+                }
+            }
+            memmove(c.buf, c.buf + off, c.len - off);
+            c.len -= off;
+            return c.len < BUF_SIZE;
+        }
+        default:
+            return true;
+    }
+}
+
+static int listen_on(const char *addr, uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port   = htons(port);
+    if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0
+        || listen(fd, 4096) < 0) {
+        fprintf(stderr, "ERROR: Listen on %s:%u failed, %s\n", addr, port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char* argv[]) {
+    const char *addr = "127.0.0.1";
+    int base = 9000;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "a:p:h")) != -1) {
+        switch(opt) {
+            case 'a':
+                addr = optarg;
+                break;
+            case 'p':
+                base = atoi(optarg);
+                break;
+            case 'h':
+            case '?':
+            default:
+                fprintf(stderr, "Usage: %s [-a addr] [-p base_port]\n", argv[0]);
+                exit(0);
+        }
+    }
+
+    int epoll_fd = epoll_create1(0);
+    int listen_fds[ROLE_NUM];
+    for (int role = 0; role < ROLE_NUM; ++role) {
+        listen_fds[role] = listen_on(addr, (uint16_t)(base + role));
+        if (listen_fds[role] < 0) exit(1);
+        struct epoll_event event;
+        event.events  = EPOLLIN;
+        event.data.fd = listen_fds[role];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fds[role], &event);
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    std::vector<conn *> conns;
+    role_stat stats[ROLE_NUM];
+    memset(stats, 0, sizeof(stats));
+
+    struct epoll_event events[MAX_EVENTS];
+    while (running) {
+        int cnt = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < cnt; ++i) {
+            int fd = events[i].data.fd;
+            int role = -1;
+            for (int r = 0; r < ROLE_NUM; ++r) {
+                if (listen_fds[r] == fd) role = r;
+            }
+            if (role >= 0) {
+                int cfd = 0;
+                while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    ++stats[role].accepted;
+                    if (role == MYSQL_BUSY) {
+                        static const char busy[] = "\xff\x10\x04Too many connections";
+                        send_mysql(cfd, 0, busy, sizeof(busy) - 1);
+                        close(cfd);
+                        continue;
+                    }
+                    if ((size_t)cfd >= conns.size()) conns.resize(cfd + 1, NULL);
+                    conns[cfd] = new conn();
+                    conns[cfd]->role = role;
+                    struct epoll_event event;
+                    event.events  = EPOLLIN;
+                    event.data.fd = cfd;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cfd, &event);
+                    if (role == MYSQL_OK || role == MYSQL_DENY) {
+                        send_greeting(cfd);
+                    }
+                }
+                continue;
+            }
+
+            conn &c = *conns[fd];
+            bool keep = true;
+            while (keep) {
+                ssize_t got = recv(fd, c.buf + c.len, BUF_SIZE - c.len, 0);
+                if (got > 0) {
+                    c.len += got;
+                    keep = serve(fd, c, stats[c.role]);
+                } else if (got < 0 && errno == EINTR) {
+                    continue;
+                } else {
+                    keep = got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+                    break;
+                }
+            }
+            if (keep) continue;
+            if ((c.role == MYSQL_OK || c.role == MYSQL_DENY) && !c.login && !c.quit) ++stats[c.role].aborted;
+            close(fd);
+            delete conns[fd];
+            conns[fd] = NULL;
+        }
+    }
+
+    for (int role = 0; role < ROLE_NUM; ++role) {
+        fprintf(stderr, "NOTICE: Stand-in %s port %d accepted: %lu, logins: %lu, quits: %lu, aborted: %lu\n",
+            role_names[role], base + role, stats[role].accepted, stats[role].logins, stats[role].quits, stats[role].aborted);
+    }
+    return 0;
+}
@@ -0,0 +1,159 @@
+// Microbenchmarks of the hot functions of the probe engine
+// Needs root and a default route, like nurse itself, since host_prob opens its capture socket
+#include "host_prob.hpp"
+#include "health_table.hpp"
+#include "target_table.hpp"
+
+#include <cstdio>
+#include <vector>
+
+#define BENCH_TARGETS 4096
+#define HEALTH_TARGETS 1000000
+
+static long int get_cur_ns() {
+    struct timespec _cur_ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &_cur_ts);
+    return _cur_ts.tv_sec*1000000000L + _cur_ts.tv_nsec;
+}
+
+// keeps results alive so the compiler can't drop the measured calls
+static volatile unsigned long sink;
+
+static void report(const char *name, long int ns, long int ops) {
+    printf("%-24s %12ld ops %10.1f ns/op %10.2f Mops/s\n", name, ops, (double)ns / ops, ops * 1000.0 / ns);
+}
+
+// host_prob keeps these functions protected, the bench times them from a subclass
+class host_prob_bench : public host_prob {
+    public:
+        host_prob_bench() : host_prob(1, LOCAL_PORT, CAPTURE_RECV) {}
+
+        void time_calc_tcp_csum(long int ops) {
+            syn_packet pkt;
+            memset(&pkt, 0x5a, sizeof(pkt));
+            unsigned long acc = 0;
+            long int begin = get_cur_ns();
+            for (long int i = 0; i < ops; ++i) {
+                pkt.tcp.seq = (uint32_t)i;
+                acc += calc_tcp_csum((uint16_t *)&pkt, sizeof(pkt));
+            }
+            report("calc_tcp_csum", get_cur_ns() - begin, ops);
+            sink = acc;
+        }
+
+        void time_prep_tcp_packet(long int ops) {
+            struct sockaddr_in dst;
+            memset(&dst, 0, sizeof(dst));
+            dst.sin_family = AF_INET;
+            dst.sin_port   = htons(80);
+            unsigned long acc = 0;
+            long int begin = get_cur_ns();
+            for (long int i = 0; i < ops; ++i) {
+                dst.sin_addr.s_addr = htonl(0x0a000000 + (uint32_t)i);
+                char *packet = prep_tcp_packet(dst, get_local_addr(), (uint32_t)i);
+                acc += ((struct tcphdr *)(packet + sizeof(struct iphdr)))->check;
+                free(packet);
+            }
+            report("prep_tcp_packet", get_cur_ns() - begin, ops);
+            sink = acc;
+        }
+
+        void time_patch_template(long int ops) {
+            long int begin = get_cur_ns();
+            for (long int i = 0; i < ops; ++i) {
+                patch_template((uint32_t)(i % BENCH_TARGETS));
+            }
+            report("patch_template", get_cur_ns() - begin, ops);
+        }
+
+        // SYN-ACK frames answering the latest probe of every target, as the capture path hands them to parse_frame
+        void time_parse_frame(long int ops) {
+            std::vector<std::vector<char> > frames(BENCH_TARGETS);
+            for (uint32_t id = 0; id < BENCH_TARGETS; ++id) {
+                patch_template(id);
+                const syn_packet &syn = get_template(id);
+                std::vector<char> &frame = frames[id];
+                frame.assign(sizeof(struct ethhdr) + sizeof(syn_packet), 0);
+                struct iphdr  *iph  = (struct iphdr *)(frame.data() + sizeof(struct ethhdr));
+                struct tcphdr *tcph = (struct tcphdr *)(iph + 1);
+                iph->ihl      = 5;
+                iph->version  = 4;
+                iph->protocol = IPPROTO_TCP;
+                iph->saddr    = syn.ip.daddr;
+                iph->daddr    = syn.ip.saddr;
+                tcph->source  = syn.tcp.dest;
+                tcph->dest    = syn.tcp.source;
+                tcph->ack_seq = htonl(ntohl(syn.tcp.seq) + 1);
+                tcph->syn     = 1;
+                tcph->ack     = 1;
+            }
+
+            long int matched = 0;
+            long int begin = get_cur_ns();
+            for (long int i = 0; i < ops; ++i) {
+                const std::vector<char> &frame = frames[i % BENCH_TARGETS];
+                matched += (parse_frame(frame.data(), frame.size()) >= 0);
+            }
+            report("capture parse_frame", get_cur_ns() - begin, ops);
+            if (matched != ops) {
+                fprintf(stderr, "WARNING: Only %ld of %ld frames matched\n", matched, ops);
+            }
+        }
+};
+
+// One probe cycle of HEALTH_TARGETS targets recorded and applied per op, every 100th target fails
+// in every 4th cycle, mixing the clean fast path with both transitions
+static void health_table(long int ops) {
+    HealthTable table(3, 2);
+    for (uint32_t id = 0; id < HEALTH_TARGETS; ++id) {
+        table.reset(id, 5);
+    }
+    std::vector<health_change> changes;
+    long int applied_ns = 0;
+    unsigned long flips = 0;
+    long int begin = get_cur_ns();
+    for (long int i = 0; i < ops; ++i) {
+        bool fail_round = (i % 4 == 3);
+        for (uint32_t id = 0; id < HEALTH_TARGETS; ++id) {
+            if (fail_round && id % 100 == 0) {
+                table.on_fail(id);
+            } else {
+                table.on_success(id);
+            }
+        }
+        long int apply_begin = get_cur_ns();
+        flips += table.apply(changes);
+        applied_ns += get_cur_ns() - apply_begin;
+        changes.clear();
+    }
+    report("HealthTable 1M cycle", get_cur_ns() - begin, ops);
+    report("HealthTable 1M apply", applied_ns, ops);
+    sink = flips;
+}
+
+int main(int argc, char* argv[]) {
+    long int ops = (argc > 1) ? atol(argv[1]) : 10000000;
+
+    host_prob_bench *bench = nullptr;
+    try {
+        bench = new host_prob_bench();
+    } catch (std::exception &e) {
+        fprintf(stderr, "ERROR: Init host prob failed, %s\n", e.what());
+        exit(1);
+    }
+
+    TargetTable targets(BENCH_TARGETS);
+    for (uint32_t i = 0; i < BENCH_TARGETS; ++i) {
+        targets.add(htonl(0x0a000000 + i), htons(80), "bench");
+    }
+    bench->load_targets(targets);
+
+    bench->time_calc_tcp_csum(ops);
+    bench->time_prep_tcp_packet(ops / 10);
+    bench->time_patch_template(ops);
+    bench->time_parse_frame(ops);
+    health_table(ops / 100000 > 0 ? ops / 100000 : 1);
+
+    delete bench;
+    return 0;
+}
@@ -0,0 +1,236 @@
+// Check of alert delivery against a stand-in robot
+// The Notifier of nurse posts to a webhook served by a thread of this program on 127.0.0.1, which answers each
+// post with the next status of a script and can hold its answers back. Three runs check the behaviour of
+// notifier.hpp: a post failed with 5xx is retried after 0.5 s doubled each time and delivered once it gets 2xx,
+// a message is dropped after NOTIFY_MAX_TRIES failed tries, and with the webhook stalled the queue holds
+// NOTIFY_QUEUE_SIZE messages, drops and counts the rest, and delivers every queued one once the webhook answers.
+// Needs no root, the notifier's own log goes to stderr.
+#include "notifier.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define ROBOT_BUF_SIZE   65536
+#define ROBOT_MAX_CONNS  16
+
+static long int get_cur_ms() {
+    struct timespec _cur_ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &_cur_ts);
+    return _cur_ts.tv_sec*1000 + _cur_ts.tv_nsec/1000000;
+}
+
+// Webhook answering posts with a script of statuses, the last status of the script answers every post beyond it
+class StandInRobot {
+    public:
+        StandInRobot() : listen_fd(-1), port(0), stalled(false), stop(false) {}
+
+        ~StandInRobot() {
+            stop = true;
+            if (worker.joinable()) worker.join();
+            for (conn &c : conns) close(c.fd);
+            if (listen_fd >= 0) close(listen_fd);
+        }
+
+        bool start() {
+            listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            struct sockaddr_in sin;
+            memset(&sin, 0, sizeof(sin));
+            sin.sin_family      = AF_INET;
+            sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t len = sizeof(sin);
+            if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(listen_fd, 64) < 0
+                || getsockname(listen_fd, (struct sockaddr *)&sin, &len) < 0) {
+                fprintf(stderr, "ERROR: Stand-in robot can't listen, %s\n", strerror(errno));
+                return false;
+            }
+            port = ntohs(sin.sin_port);
+            worker = std::thread([this] { this->run(); });
+            return true;
+        }
+
+        std::string url() const { return "http://127.0.0.1:" + std::to_string(port) + "/robot"; }
+
+        // statuses of the next posts, and whether posts are answered at all
+        void script(const std::vector<int> &codes) {
+            std::lock_guard<std::mutex> lock(mtx);
+            statuses = codes;
+            posts.clear();
+        }
+        void stall(bool on) { stalled = on; }
+
+        struct post {
+            long int     at_ms;
+            int          status;
+            std::string  body;
+        };
+
+        std::vector<post> received() {
+            std::lock_guard<std::mutex> lock(mtx);
+            return posts;
+        }
+
+    private:
+        struct conn {
+            int          fd;
+            std::string  in;
+        };
+
+        void run() {
+            while (!stop) {
+                std::vector<struct pollfd> fds(1 + conns.size());
+                fds[0].fd     = listen_fd;
+                fds[0].events = POLLIN;
+                for (size_t i = 0; i < conns.size(); ++i) {
+                    fds[i + 1].fd     = conns[i].fd;
+                    fds[i + 1].events = POLLIN;
+                }
+                poll(fds.data(), fds.size(), 10);
+
+                int fd = -1;
+                while (conns.size() < ROBOT_MAX_CONNS && (fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    conn c;
+                    c.fd = fd;
+                    conns.push_back(c);
+                }
+                for (size_t i = 0; i < conns.size(); ) {
+                    if (serve(conns[i])) {
+                        ++i;
+                        continue;
+                    }
+                    close(conns[i].fd);
+                    conns.erase(conns.begin() + i);
+                }
+            }
+        }
+
+        // read what arrived and answer complete posts, return false once the connection is closed
+        bool serve(conn &c) {
+            char buf[ROBOT_BUF_SIZE];
+            ssize_t got = 0;
+            while ((got = recv(c.fd, buf, sizeof(buf), 0)) > 0) c.in.append(buf, got);
+            bool open = got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+
+            while (!stalled) {
+                size_t head = c.in.find("\r\n\r\n");
+                if (head == std::string::npos) break;
+                size_t body_len = 0;
+                const char *cl = strcasestr(c.in.c_str(), "Content-Length:");
+                if (cl && (size_t)(cl - c.in.c_str()) < head) body_len = strtoul(cl + 15, NULL, 10);
+                if (c.in.size() < head + 4 + body_len) break;
+
+                post p;
+                p.at_ms = get_cur_ms();
+                p.body  = c.in.substr(head + 4, body_len);
+                c.in.erase(0, head + 4 + body_len);
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    size_t n = posts.size();
+                    p.status = statuses.empty() ? 200 : statuses[n < statuses.size() ? n : statuses.size() - 1];
+                    posts.push_back(p);
+                }
+                char answer[128];
+                int len = snprintf(answer, sizeof(answer), "HTTP/1.1 %d Stand-in\r\nContent-Length: 0\r\n\r\n", p.status);
+                if (send(c.fd, answer, len, MSG_NOSIGNAL) != len) return false;
+            }
+            return open;
+        }
+
+    private:
+        int                  listen_fd;
+        uint16_t             port;
+        std::vector<conn>    conns;     // owned by the worker thread
+
+        std::mutex           mtx;
+        std::vector<int>     statuses;
+        std::vector<post>    posts;
+
+        std::atomic<bool>    stalled;
+        std::atomic<bool>    stop;
+        std::thread          worker;
+};
+
+static int failed = 0;
+
+static void expect(bool ok, const char *what) {
+    printf("%-64s %s\n", what, ok ? "ok" : "FAIL");
+    if (!ok) failed = 1;
+}
+
+// wait until every message is delivered or dropped
+static bool drain(Notifier &n, long int limit_ms) {
+    long int end_ms = get_cur_ms() + limit_ms;
+    while (n.depth() > 0 && get_cur_ms() < end_ms) usleep(10000);
+    return n.depth() == 0;
+}
+
+// gap before retry k (from 1) is the backoff of NOTIFY_BACKOFF_MS << (k - 1), jittered over its upper half
+static bool backoff_ok(const std::vector<StandInRobot::post> &posts) {
+    for (size_t k = 1; k < posts.size(); ++k) {
+        long int backoff = (long int)NOTIFY_BACKOFF_MS << (k - 1);
+        if (backoff > NOTIFY_BACKOFF_MAX_MS) backoff = NOTIFY_BACKOFF_MAX_MS;
+        long int gap = posts[k].at_ms - posts[k - 1].at_ms;
+        printf("    retry %zu after %ld ms, backoff %ld-%ld ms\n", k, gap, backoff / 2, backoff);
+        if (gap < backoff / 2 - 10 || gap > backoff + 250) return false;
+    }
+    return true;
+}
+
+int main() {
+    curl_global_init(CURL_GLOBAL_ALL);
+    StandInRobot robot;
+    if (!robot.start()) return 1;
+    Notifier notifier(robot.url());
+    if (!notifier.start()) return 1;
+
+    // 5xx, then 2xx: retried with backoff and delivered once
+    robot.script(std::vector<int>{ 503, 502, 500, 200 });
+    uint64_t retries = metrics().get(M_ALERT_RETRIES);
+    notifier.post("{\"msg\":\"retry\"}");
+    expect(drain(notifier, 10000), "5xx then 2xx: delivered");
+    std::vector<StandInRobot::post> posts = robot.received();
+    expect(posts.size() == 4, "5xx then 2xx: posted 4 times");
+    expect(backoff_ok(posts), "5xx then 2xx: retries back off from 0.5 s, doubled each time");
+    expect(metrics().get(M_ALERT_RETRIES) - retries == 3, "5xx then 2xx: 3 retries counted");
+
+    // 5xx only: dropped after the last try
+    robot.script(std::vector<int>{ 500 });
+    uint64_t drops = metrics().get(M_ALERT_DROPS_FAILED);
+    notifier.post("{\"msg\":\"give up\"}");
+    expect(drain(notifier, 15000), "5xx only: given up");
+    posts = robot.received();
+    expect(posts.size() == NOTIFY_MAX_TRIES, "5xx only: posted NOTIFY_MAX_TRIES times");
+    expect(backoff_ok(posts), "5xx only: retries back off from 0.5 s, doubled each time");
+    expect(metrics().get(M_ALERT_DROPS_FAILED) - drops == 1, "5xx only: 1 drop counted");
+
+    // webhook stalled: the queue is bounded, the overflow is dropped and counted, the rest delivered in the end
+    robot.script(std::vector<int>{ 200 });
+    robot.stall(true);
+    uint64_t full = metrics().get(M_ALERT_DROPS_FULL);
+    int extra = 10, rejected = 0;
+    for (int i = 0; i < NOTIFY_QUEUE_SIZE + extra; ++i) {
+        if (!notifier.post("{\"msg\":\"" + std::to_string(i) + "\"}")) ++rejected;
+    }
+    expect(notifier.depth() == NOTIFY_QUEUE_SIZE, "stalled: queue holds NOTIFY_QUEUE_SIZE messages");
+    expect(rejected == extra && metrics().get(M_ALERT_DROPS_FULL) - full == (uint64_t)extra,
+        "stalled: overflow rejected and counted");
+    robot.stall(false);
+    expect(drain(notifier, 10000), "stalled: queue drained once the webhook answers");
+    posts = robot.received();
+    std::set<std::string> bodies;
+    for (const StandInRobot::post &p : posts) bodies.insert(p.body);
+    expect(bodies.size() == NOTIFY_QUEUE_SIZE && posts.size() == NOTIFY_QUEUE_SIZE, "stalled: every queued message delivered once");
+
+    printf("== alert delivery %s\n", failed ? "FAILED" : "passed");
+    return failed;
+}
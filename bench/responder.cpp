@@ -0,0 +1,267 @@
+// Userspace SYN-ACK responder for benchmarks
+// Answers every SYN seen on an interface with a SYN-ACK, whatever the destination address is,
+// so one veth peer can stand in for millions of targets. Loss and latency are simulated.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+
+#define BATCH_SIZE 64
+#define FRAME_LEN  (sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct tcphdr))
+
+struct delayed_frame {
+    long int due_us;
+    char     data[FRAME_LEN];
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal(int) {
+    running = 0;
+}
+
+static long int get_cur_us() {
+    struct timespec _cur_ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &_cur_ts);
+    return _cur_ts.tv_sec*1000000 + _cur_ts.tv_nsec/1000;
+}
+
+static unsigned short csum(const uint16_t *ptr, int len, uint32_t sum = 0) {
+    while (len > 1) {
+        sum += *ptr++;
+        len -= 2;
+    }
+    if (len == 1) sum += *(const uint8_t *)ptr;
+    sum = (sum>>16) + (sum & 0xffff);
+    sum = sum + (sum>>16);
+    return (unsigned short)~sum;
+}
+
+// Build the SYN-ACK answering syn into out, return false if syn is not an IPv4 TCP SYN
+static bool make_reply(const char *syn, size_t len, char *out) {
+    if (len < sizeof(struct ethhdr) + sizeof(struct iphdr)) return false;
+    const struct ethhdr *eth = (const struct ethhdr *)syn;
+    const struct iphdr  *iph = (const struct iphdr *)(syn + sizeof(struct ethhdr));
+    size_t iph_len = iph->ihl * 4;
+    if (iph->protocol != IPPROTO_TCP || iph_len < 20 || len < sizeof(struct ethhdr) + iph_len + sizeof(struct tcphdr)) return false;
+    const struct tcphdr *tcph = (const struct tcphdr *)(syn + sizeof(struct ethhdr) + iph_len);
+
+    memset(out, 0, FRAME_LEN);
+    struct ethhdr *r_eth = (struct ethhdr *)out;
+    struct iphdr  *r_iph = (struct iphdr *)(out + sizeof(struct ethhdr));
+    struct tcphdr *r_tcp = (struct tcphdr *)(out + sizeof(struct ethhdr) + sizeof(struct iphdr));
+
+    memcpy(r_eth->h_dest, eth->h_source, ETH_ALEN);
+    memcpy(r_eth->h_source, eth->h_dest, ETH_ALEN);
+    r_eth->h_proto = htons(ETH_P_IP);
+
+    r_iph->ihl      = 5;
+    r_iph->version  = 4;
+    r_iph->tot_len  = htons(sizeof(struct iphdr) + sizeof(struct tcphdr));
+    r_iph->ttl      = 64;
+    r_iph->protocol = IPPROTO_TCP;
+    r_iph->saddr    = iph->daddr;
+    r_iph->daddr    = iph->saddr;
+    r_iph->check    = csum((uint16_t *)r_iph, sizeof(struct iphdr));
+
+    r_tcp->source  = tcph->dest;
+    r_tcp->dest    = tcph->source;
+    r_tcp->seq     = htonl(ntohl(iph->daddr) ^ 0x5bd1e995);
+    r_tcp->ack_seq = htonl(ntohl(tcph->seq) + 1);
+    r_tcp->doff    = sizeof(struct tcphdr) / 4;
+    r_tcp->syn     = 1;
+    r_tcp->ack     = 1;
+    r_tcp->window  = htons(65535);
+
+    // pseudo header sum, then the tcp header
+    uint32_t sum = (r_iph->saddr & 0xffff) + (r_iph->saddr >> 16) + (r_iph->daddr & 0xffff) + (r_iph->daddr >> 16)
+        + htons(IPPROTO_TCP) + htons(sizeof(struct tcphdr));
+    r_tcp->check = csum((uint16_t *)r_tcp, sizeof(struct tcphdr), sum);
+    return true;
+}
+
+static int create_socket(const char *iface) {
+    // accept ipv4 tcp frames with only the syn flag, ethernet header assumed
+    struct sock_filter code[] = {
+        { 0x28, 0, 0, 0x0000000c },
+        { 0x15, 0, 8, 0x00000800 },
+        { 0x30, 0, 0, 0x00000017 },
+        { 0x15, 0, 6, 0x00000006 },
+        { 0x28, 0, 0, 0x00000014 },
+        { 0x45, 4, 0, 0x00001fff },
+        { 0xb1, 0, 0, 0x0000000e },
+        { 0x50, 0, 0, 0x0000001b },
+        { 0x15, 0, 1, 0x00000002 },
+        { 0x6, 0, 0, 0x0000ffff },
+        { 0x6, 0, 0, 0x00000000 },
+    };
+
+    int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Create packet socket failed, %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sock_fprog filter;
+    filter.len    = sizeof(code) / sizeof(struct sock_filter);
+    filter.filter = code;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) < 0) {
+        fprintf(stderr, "ERROR: Attach filter failed, %s\n", strerror(errno));
+        return -1;
+    }
+
+    int rcvbuf = 32 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex  = if_nametoindex(iface);
+    if (sll.sll_ifindex == 0 || bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        fprintf(stderr, "ERROR: Bind to %s failed, %s\n", iface, strerror(errno));
+        return -1;
+    }
+    return fd;
+}
+
+static int send_frames(int fd, char (*frames)[FRAME_LEN], unsigned int num) {
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec   iovs[BATCH_SIZE];
+    memset(msgs, 0, sizeof(msgs));
+    for (unsigned int i = 0; i < num; ++i) {
+        iovs[i].iov_base           = frames[i];
+        iovs[i].iov_len            = FRAME_LEN;
+        msgs[i].msg_hdr.msg_iov    = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    unsigned int off = 0;
+    while (off < num) {
+        int sent = sendmmsg(fd, msgs + off, num - off, 0);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += sent;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    const char *iface = NULL;
+    double loss = 0.0;
+    long int delay_us = 0;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "i:l:d:h")) != -1) {
+        switch(opt) {
+            case 'i':
+                iface = optarg;
+                break;
+            case 'l':
+                loss = atof(optarg) / 100.0;
+                break;
+            case 'd':
+                delay_us = (long int)(atof(optarg) * 1000);
+                break;
+            case 'h':
+            case '?':
+            default:
+                fprintf(stderr, "Usage: %s -i iface [-l loss_percent] [-d delay_ms]\n", argv[0]);
+                exit(0);
+        }
+    }
+    if (!iface) {
+        fprintf(stderr, "Error: no interface given\n");
+        exit(1);
+    }
+
+    int fd = create_socket(iface);
+    if (fd < 0) exit(1);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    char rx_bufs[BATCH_SIZE][ETH_FRAME_LEN];
+    char tx_bufs[BATCH_SIZE][FRAME_LEN];
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec   iovs[BATCH_SIZE];
+    std::deque<delayed_frame> delayed;
+    unsigned int seed = (unsigned int)get_cur_us();
+    unsigned long syns = 0, replies = 0, dropped = 0;
+
+    while (running) {
+        int timeout = 100;
+        if (!delayed.empty()) {
+            long int wait_us = delayed.front().due_us - get_cur_us();
+            timeout = wait_us <= 0 ? 0 : (int)((wait_us + 999) / 1000);
+        }
+        struct pollfd pfd;
+        pfd.fd      = fd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, timeout);
+
+        // release delayed replies which are due
+        long int now_us = get_cur_us();
+        unsigned int cnt = 0;
+        while (!delayed.empty() && delayed.front().due_us <= now_us) {
+            memcpy(tx_bufs[cnt++], delayed.front().data, FRAME_LEN);
+            delayed.pop_front();
+            if (cnt == BATCH_SIZE) {
+                send_frames(fd, tx_bufs, cnt);
+                cnt = 0;
+            }
+        }
+        if (cnt) send_frames(fd, tx_bufs, cnt);
+
+        if (!(pfd.revents & POLLIN)) continue;
+        for (int i = 0; i < BATCH_SIZE; ++i) {
+            iovs[i].iov_base = rx_bufs[i];
+            iovs[i].iov_len  = ETH_FRAME_LEN;
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_iov    = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int num = recvmmsg(fd, msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
+        if (num <= 0) continue;
+
+        cnt = 0;
+        for (int i = 0; i < num; ++i) {
+            ++syns;
+            if (loss > 0 && rand_r(&seed) < loss * RAND_MAX) {
+                ++dropped;
+                continue;
+            }
+            if (delay_us > 0) {
+                delayed.emplace_back();
+                if (!make_reply(rx_bufs[i], msgs[i].msg_len, delayed.back().data)) {
+                    delayed.pop_back();
+                    continue;
+                }
+                delayed.back().due_us = now_us + delay_us;
+            } else if (make_reply(rx_bufs[i], msgs[i].msg_len, tx_bufs[cnt])) {
+                ++cnt;
+            }
+            ++replies;
+        }
+        if (cnt) send_frames(fd, tx_bufs, cnt);
+    }
+
+    fprintf(stderr, "NOTICE: Responder stat. syns: %lu, replies: %lu, dropped: %lu\n", syns, replies, dropped);
+    close(fd);
+    return 0;
+}
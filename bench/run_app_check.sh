@@ -0,0 +1,116 @@
+#!/bin/sh
+# Application checks of nurse against stand-in servers, no external network needed
+# nurse runs in netns nurse_app_a, bench/app_responder in nurse_app_b, linked by a veth pair.
+# Every port of the responder plays a healthy or a broken service, the check passes when nurse
+# refuses exactly the broken ones with the expected cause, and its mysql logins end with COM_QUIT.
+#
+# Environment:
+#   CHECK_SECONDS      seconds nurse runs, default 6
+
+CHECK_SECONDS=${CHECK_SECONDS:-6}
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+NURSE=$DIR/../nurse
+NS_A=nurse_app_a
+NS_B=nurse_app_b
+WORK=$(mktemp -d /tmp/nurse_app.XXXXXX)
+ADDR=10.79.0.2
+BASE=9000
+
+if [ "$(id -u)" != "0" ]; then
+    echo "Error: check needs root for network namespaces and raw sockets" >&2
+    exit 1
+fi
+
+cleanup() {
+    [ -n "$NURSE_PID" ] && kill "$NURSE_PID" 2>/dev/null
+    [ -n "$RESP_PID" ] && kill "$RESP_PID" 2>/dev/null
+    wait 2>/dev/null
+    ip netns del $NS_A 2>/dev/null
+    ip netns del $NS_B 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+ip netns del $NS_A 2>/dev/null
+ip netns del $NS_B 2>/dev/null
+ip netns add $NS_A || exit 1
+ip netns add $NS_B || exit 1
+ip link add na_veth_a type veth peer name na_veth_b || exit 1
+ip link set na_veth_a netns $NS_A
+ip link set na_veth_b netns $NS_B
+ip -n $NS_A addr add 10.79.0.1/24 dev na_veth_a
+ip -n $NS_B addr add $ADDR/24 dev na_veth_b
+ip -n $NS_A link set lo up
+ip -n $NS_B link set lo up
+ip -n $NS_A link set na_veth_a up
+ip -n $NS_B link set na_veth_b up
+ip -n $NS_A route add default via $ADDR
+
+ip netns exec $NS_B "$DIR/app_responder" -a $ADDR -p $BASE 2>"$WORK/responder.log" &
+RESP_PID=$!
+
+# service, kind of its check and the cause nurse must refuse it with, in port order of the responder
+cat > "$WORK/roles" <<EOF
+http_ok     http:/health    -
+http_fail   http:/health    failed
+redis_ok    redis           -
+redis_fail  redis           failed
+mysql_ok    mysql:nurse     -
+mysql_busy  mysql:nurse     failed
+mysql_deny  mysql:nurse     failed
+hang        http            timeout
+EOF
+
+port=$BASE
+while read serv kind cause; do
+    echo "@check $kind $serv timeout=300" >> "$WORK/targets.txt"
+    printf "$ADDR:$port\t$serv\n" >> "$WORK/targets.txt"
+    port=$((port + 1))
+done < "$WORK/roles"
+
+# alerts go nowhere, the verdicts are read from the log
+ip netns exec $NS_A "$NURSE" -f "$WORK/targets.txt" -r http://127.0.0.1:9/ -w 500 2>"$WORK/nurse.log" &
+NURSE_PID=$!
+sleep "$CHECK_SECONDS"
+kill "$NURSE_PID" "$RESP_PID" 2>/dev/null
+wait "$NURSE_PID" "$RESP_PID" 2>/dev/null
+NURSE_PID=
+RESP_PID=
+
+failed=0
+port=$BASE
+printf "%-12s %-14s %8s %10s %10s %8s\n" service check expect refused cause result
+while read serv kind cause; do
+    refused=$(grep -c "On Refused Host $ADDR:$port (" "$WORK/nurse.log")
+    got=$(grep "On Refused Host $ADDR:$port (" "$WORK/nurse.log" | sed 's/.*(app check \(.*\))/\1/' | sort -u | tr '\n' ' ')
+    got=${got% }
+    result=ok
+    if [ "$cause" = "-" ]; then
+        [ "$refused" -eq 0 ] || result=FAIL
+        got=${got:--}
+    else
+        [ "$refused" -gt 0 ] && [ "$got" = "$cause" ] || result=FAIL
+    fi
+    [ "$result" = "ok" ] || failed=1
+    printf "%-12s %-14s %8s %10s %10s %8s\n" "$serv" "$kind" "$cause" "$refused" "$got" "$result"
+    port=$((port + 1))
+done < "$WORK/roles"
+
+# a login must end with COM_QUIT, a session closed before it counts against max_connect_errors of the host
+cat "$WORK/responder.log"
+if grep -E "mysql_(ok|deny)" "$WORK/responder.log" | grep -qv "aborted: 0$"; then
+    echo "FAIL: mysql sessions aborted"
+    failed=1
+fi
+if ! grep "mysql_ok" "$WORK/responder.log" | grep -qv "quits: 0,"; then
+    echo "FAIL: no mysql session ended with COM_QUIT"
+    failed=1
+fi
+
+if [ "$failed" -ne 0 ]; then
+    echo "== application checks FAILED, nurse log:"
+    grep -E "ERROR|WARNING|App" "$WORK/nurse.log" | head -20
+    exit 1
+fi
+echo "== application checks passed"
@@ -0,0 +1,147 @@
+#!/bin/sh
+# Throughput benchmark of nurse on one box, no external network needed
+# nurse runs in netns nurse_bench_a, the SYN-ACK responder in nurse_bench_b, linked by a veth pair.
+# Synthetic targets live in 10.78.0.0/16 routed to the responder, which answers any address.
+#
+# Environment:
+#   BENCH_SIZES        target counts to run, default "1000 10000 100000 1000000"
+#   BENCH_SECONDS      measured seconds per size, default 10
+#   BENCH_LOSS         reply loss in percent, default 0
+#   BENCH_DELAY_MS     reply latency in ms, default 0
+#   BENCH_INTERVAL_MS  probe interval of every target, default 1000
+#   BENCH_MAX_PPS      nurse -p, default 0(unlimited)
+#   BENCH_CAPTURE_THREADS  nurse -t, default 1
+
+BENCH_SIZES=${BENCH_SIZES:-"1000 10000 100000 1000000"}
+BENCH_SECONDS=${BENCH_SECONDS:-10}
+BENCH_LOSS=${BENCH_LOSS:-0}
+BENCH_DELAY_MS=${BENCH_DELAY_MS:-0}
+BENCH_INTERVAL_MS=${BENCH_INTERVAL_MS:-1000}
+BENCH_MAX_PPS=${BENCH_MAX_PPS:-0}
+BENCH_CAPTURE_THREADS=${BENCH_CAPTURE_THREADS:-1}
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+NURSE=$DIR/../nurse
+NS_A=nurse_bench_a
+NS_B=nurse_bench_b
+WORK=$(mktemp -d /tmp/nurse_bench.XXXXXX)
+METRICS=127.0.0.1:19100
+
+if [ "$(id -u)" != "0" ]; then
+    echo "Error: bench needs root for network namespaces and raw sockets" >&2
+    exit 1
+fi
+
+cleanup() {
+    [ -n "$NURSE_PID" ] && kill "$NURSE_PID" 2>/dev/null
+    [ -n "$RESP_PID" ] && kill "$RESP_PID" 2>/dev/null
+    wait 2>/dev/null
+    ip netns del $NS_A 2>/dev/null
+    ip netns del $NS_B 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+ip netns del $NS_A 2>/dev/null
+ip netns del $NS_B 2>/dev/null
+ip netns add $NS_A || exit 1
+ip netns add $NS_B || exit 1
+ip link add nb_veth_a type veth peer name nb_veth_b || exit 1
+ip link set nb_veth_a netns $NS_A
+ip link set nb_veth_b netns $NS_B
+ip -n $NS_A addr add 10.77.0.1/24 dev nb_veth_a
+ip -n $NS_B addr add 10.77.0.2/24 dev nb_veth_b
+ip -n $NS_A link set lo up
+ip -n $NS_A link set nb_veth_a up
+ip -n $NS_B link set nb_veth_b up
+ip -n $NS_A route add default via 10.77.0.2
+
+echo "== microbenchmarks"
+ip netns exec $NS_A "$DIR/micro" || exit 1
+
+ip netns exec $NS_B "$DIR/responder" -i nb_veth_b -l "$BENCH_LOSS" -d "$BENCH_DELAY_MS" 2>"$WORK/responder.log" &
+RESP_PID=$!
+
+# fetch metrics into a file, retried since a loaded box may be slow to answer
+scrape() {
+    for try in 1 2 3 4 5; do
+        ip netns exec $NS_A curl -s --max-time 5 http://$METRICS/metrics > "$1" 2>/dev/null && [ -s "$1" ] && return 0
+        sleep 1
+    done
+    echo "WARNING: Scrape metrics failed" >&2
+    return 1
+}
+
+# value of a metric line, summing labeled series
+metric() {
+    awk -v name="$1" '$1 == name || index($1, name "{") == 1 { v += $2 } END { printf "%.0f", v }' "$2"
+}
+
+# utime + stime of a process in clock ticks
+cpu_ticks() {
+    awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+echo "== throughput, interval ${BENCH_INTERVAL_MS} ms, loss ${BENCH_LOSS}%, delay ${BENCH_DELAY_MS} ms, ${BENCH_CAPTURE_THREADS} capture threads, ${BENCH_SECONDS} s per size"
+printf "%10s %12s %12s %10s %10s %10s %10s %14s\n" targets expect_pps probes/sec loss% timeout% overrun% backlog cpu_us/probe
+HZ=$(getconf CLK_TCK)
+for size in $BENCH_SIZES; do
+    awk -v n="$size" -v iv="$BENCH_INTERVAL_MS" 'BEGIN {
+        printf "@interval %d\n", iv
+        for (i = 0; i < n; ++i) {
+            ip = i % 65536
+            printf "10.78.%d.%d:%d bench%d\n", int(ip / 256), ip % 256, 1000 + int(i / 65536), i % 16
+        }
+    }' > "$WORK/targets.txt"
+
+    ip netns exec $NS_A "$NURSE" -f "$WORK/targets.txt" -r http://127.0.0.1:1/ -m $METRICS -p "$BENCH_MAX_PPS" -t "$BENCH_CAPTURE_THREADS" 2>"$WORK/nurse_$size.log" &
+    NURSE_PID=$!
+
+    # warm up until every target is loaded and has been probed once
+    sleep 1
+    i=0
+    while [ $i -lt 120 ]; do
+        ip netns exec $NS_A curl -s --max-time 5 http://$METRICS/metrics > "$WORK/m0" 2>/dev/null
+        [ "$(metric nurse_targets "$WORK/m0")" = "$size" ] && break
+        sleep 1
+        i=$((i + 1))
+    done
+    sleep $(( (BENCH_INTERVAL_MS + 999) / 1000 + 1 ))
+
+    scrape "$WORK/m0"
+    c0=$(cpu_ticks $NURSE_PID)
+    t0=$(date +%s%N)
+    sleep "$BENCH_SECONDS"
+    scrape "$WORK/m1"
+    c1=$(cpu_ticks $NURSE_PID)
+    t1=$(date +%s%N)
+
+    kill $NURSE_PID
+    wait $NURSE_PID 2>/dev/null
+    NURSE_PID=
+
+    sent=$(( $(metric nurse_probes_sent_total "$WORK/m1") - $(metric nurse_probes_sent_total "$WORK/m0") ))
+    replies=$(( $(metric nurse_replies_total "$WORK/m1") - $(metric nurse_replies_total "$WORK/m0") ))
+    retrans=$(( $(metric nurse_probe_retransmits_total "$WORK/m1") - $(metric nurse_probe_retransmits_total "$WORK/m0") ))
+    timeouts=$(( $(metric nurse_probe_timeouts_total "$WORK/m1") - $(metric nurse_probe_timeouts_total "$WORK/m0") ))
+    backlog=$(metric nurse_schedule_backlog "$WORK/m1")
+    awk -v size="$size" -v iv="$BENCH_INTERVAL_MS" -v sent="$sent" -v replies="$replies" -v backlog="$backlog" \
+        -v retrans="$retrans" -v timeouts="$timeouts" \
+        -v ns=$((t1 - t0)) -v ticks=$((c1 - c0)) -v hz="$HZ" 'BEGIN {
+        secs   = ns / 1e9
+        expect = size * 1000 / iv
+        pps    = sent / secs
+        loss   = sent > 0 ? 100 * (1 - replies / sent) : 0
+        probes = sent - retrans
+        tmo    = probes > 0 ? 100 * timeouts / probes : 0
+        over   = probes / secs < expect ? 100 * (1 - probes / secs / expect) : 0
+        cpu    = sent > 0 ? ticks * 1e6 / hz / sent : 0
+        if (loss < 0) loss = 0
+        printf "%10d %12.0f %12.0f %10.2f %10.2f %10.2f %10d %14.3f\n", size, expect, pps, loss, tmo, over, backlog, cpu
+    }'
+done
+
+kill $RESP_PID
+wait $RESP_PID 2>/dev/null
+RESP_PID=
+cat "$WORK/responder.log"
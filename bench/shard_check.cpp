@@ -0,0 +1,131 @@
+// Check of the shard assignment of targets
+// One target list is compiled into a snapshot and loaded by a TargetWatcher for every shard of n and n + 1
+// instances, as nurse -n i/n would. For each n the shards must cover every target exactly once with about
+// the same share each, and going to n + 1 instances must move only about 1 / (n + 1) of the targets, every
+// one of them onto the new instance. The text file must be split the same way as its snapshot.
+// Needs no root, the watchers' own log goes to stderr.
+#include "target_watcher.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+
+#define CHECK_ADDRS    25000
+#define CHECK_PORTS    4
+#define CHECK_SHARDS   8        // n goes from 1 to this
+
+static int failed = 0;     // failed expectations
+
+static void expect(bool ok, const char *what) {
+    if (!ok) {
+        printf("%-64s FAIL\n", what);
+        ++failed;
+    }
+}
+
+// shard of every target of the file for n instances, -1 where no shard took it, return false if one took it twice
+static bool assign(const std::string &path, uint32_t n, std::unordered_map<uint64_t, int> &owner) {
+    bool disjoint = true;
+    for (auto &o : owner) o.second = -1;
+    for (uint32_t i = 0; i < n; ++i) {
+        char spec[32];
+        snprintf(spec, sizeof(spec), "%u/%u", i, n);
+        TargetShard shard;
+        shard.parse(spec);
+        TargetWatcher watcher(path, shard);
+        if (watcher.load() < 0) {
+            fprintf(stderr, "ERROR: Load %s failed\n", path.c_str());
+            return false;
+        }
+        target_diff diff;
+        watcher.take(diff);
+        diff.for_each_added([&](uint32_t ip, uint16_t port) {
+            std::unordered_map<uint64_t, int>::iterator it = owner.find(((uint64_t)ip << 16) | port);
+            if (it == owner.end() || it->second >= 0) {
+                disjoint = false;
+                return;
+            }
+            it->second = (int)i;
+        });
+    }
+    return disjoint;
+}
+
+int main() {
+    char dir[] = "/tmp/nurse_shard.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string text = std::string(dir) + "/targets.txt";
+    std::string snap = std::string(dir) + "/targets.snap";
+
+    std::unordered_map<uint64_t, int> owner;
+    FILE *fp = fopen(text.c_str(), "w");
+    if (!fp) return 1;
+    for (uint32_t a = 0; a < CHECK_ADDRS; ++a) {
+        uint32_t ip = 0x0a000000 + a * 7;
+        for (int p = 0; p < CHECK_PORTS; ++p) {
+            uint16_t port = (uint16_t)(80 + p * 1000);
+            fprintf(fp, "%u.%u.%u.%u:%u\tweb\n", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, port);
+            owner[((uint64_t)htonl(ip) << 16) | htons(port)] = -1;
+        }
+    }
+    fclose(fp);
+    if (compile_hosts(text.c_str(), snap.c_str()) != CHECK_ADDRS * CHECK_PORTS) {
+        fprintf(stderr, "ERROR: Compile %s failed\n", text.c_str());
+        return 1;
+    }
+
+    const double total = (double)owner.size();
+    printf("%6s %10s %10s %10s %10s %8s\n", "shards", "min", "max", "moved", "expect", "result");
+    std::unordered_map<uint64_t, int> prev = owner, cur = owner, by_text = owner;
+    for (uint32_t n = 1; n <= CHECK_SHARDS + 1; ++n) {
+        int was_failed = failed;
+        expect(assign(snap, n, cur), "every target is taken by one shard at most");
+        std::vector<size_t> counts(n, 0);
+        size_t missing = 0, moved = 0, off_new = 0;
+        for (const auto &o : cur) {
+            if (o.second < 0) {
+                ++missing;
+                continue;
+            }
+            ++counts[o.second];
+            int before = prev[o.first];
+            if (n > 1 && before != o.second) {
+                ++moved;
+                if (o.second != (int)n - 1) ++off_new;
+            }
+        }
+        expect(missing == 0, "every target is taken by one shard at least");
+
+        // the share of each shard and the moved count are binomial, allow 5 standard deviations
+        double share = total / n;
+        double share_dev = 5 * std::sqrt(total * (1.0 / n) * (1 - 1.0 / n)) + 1;
+        size_t lo = counts[0], hi = counts[0];
+        for (size_t c : counts) {
+            lo = c < lo ? c : lo;
+            hi = c > hi ? c : hi;
+        }
+        expect(std::fabs(lo - share) <= share_dev && std::fabs(hi - share) <= share_dev, "shards take even shares");
+        double expect_moved = n > 1 ? share : 0;
+        if (n > 1) {
+            expect(std::fabs(moved - expect_moved) <= share_dev, "about 1 / n of the targets move to n shards");
+            expect(off_new == 0, "moved targets go to the new shard only");
+        }
+
+        expect(assign(text, n, by_text) && by_text == cur, "text file and snapshot are split alike");
+        printf("%6u %10zu %10zu %10zu %10.0f %8s\n", n, lo, hi, moved, expect_moved, failed == was_failed ? "ok" : "FAIL");
+        prev.swap(cur);
+    }
+
+    unlink(text.c_str());
+    unlink(snap.c_str());
+    rmdir(dir);
+    printf("== shard assignment %s\n", failed ? "FAILED" : "passed");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,286 @@
+#ifndef __ALERT_COALESCER_HPP__
+#define __ALERT_COALESCER_HPP__
+
+#include <cstdio>
+#include <cmath>
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+
+#include "metrics.hpp"
+
+#define ALERT_WINDOW_MS        3000     // transitions are collected this long before one message goes out
+#define ALERT_GROUP_LIMIT      5        // a service with more targets than this in one /24 is summarized by the subnet
+#define ALERT_MAX_LINES        40       // lines of one message, the rest is counted
+#define FLAP_PENALTY           1000     // added on every transition of a target
+#define FLAP_SUPPRESS          3000     // alerts of a target stop above this penalty
+#define FLAP_REUSE             750      // and resume below this one
+#define FLAP_PENALTY_MAX       12000    // bounds the suppression to 4 half lives after the last transition
+#define FLAP_HALF_LIFE_MS      60000
+
+#define ALERT_NONE    0xffffffffu
+
+// A target in an alert message, ip & port in network byte order as in the target table, filled at flush
+struct alert_entry {
+    uint32_t     id;
+    uint32_t     ip;
+    uint16_t     port;
+    uint8_t      section;   // ALERT_DOWN, ALERT_RECOVER or ALERT_FLAP
+    uint8_t      cause;
+    std::string  service;
+};
+
+enum alert_section {
+    ALERT_DOWN = 0,
+    ALERT_RECOVER,
+    ALERT_FLAP,
+    ALERT_SECTION_NUM
+};
+
+/*
+ * Coalescing stage between health transitions and the notifier
+ * Transitions are collected for a window starting at the first one, a target flipping back within the
+ * window cancels out, and the rest goes out as one message grouped by state, service and /24 subnet:
+ * small groups list their hosts with the ports, large ones are a single line for the subnet.
+ *
+ * Flapping targets are damped like BGP routes: every transition adds a penalty which decays
+ * exponentially, above FLAP_SUPPRESS the target is reported once as flapping and then kept quiet
+ * until the penalty decays below FLAP_REUSE, when its state is reported if it differs from the last one sent.
+ */
+class AlertCoalescer {
+    public:
+        AlertCoalescer(long int window = ALERT_WINDOW_MS) : window_ms(window), window_start(0) {}
+
+        void set_cause_text(uint8_t cause, const char *text) {
+            if (cause >= causes.size()) causes.resize(cause + 1);
+            causes[cause] = text;
+        }
+
+        void resize(size_t cap) {
+            if (cap <= state.size()) return;
+            state.resize(cap, 1);
+            alerted.resize(cap, 1);
+            suppressed.resize(cap, 0);
+            cause.resize(cap, 0);
+            penalty.resize(cap, 0);
+            penalty_ms.resize(cap, 0);
+            pending_idx.resize(cap, ALERT_NONE);
+        }
+
+        // (Re)start a target healthy with no history, pending alerts of its former self are dropped
+        void reset(uint32_t id) {
+            resize(id + 1);
+            if (pending_idx[id] != ALERT_NONE) {
+                pending[pending_idx[id]].id = ALERT_NONE;
+                pending_idx[id] = ALERT_NONE;
+            }
+            state[id] = alerted[id] = 1;
+            suppressed[id] = 0;
+            cause[id] = 0;
+            penalty[id] = 0;
+        }
+
+        // Start a target with the health it had before a restart and the health last alerted about,
+        // a transition whose alert was still pending then is queued again
+        void restore(uint32_t id, bool healthy, bool was_alerted, uint8_t why, long int now_ms) {
+            reset(id);
+            state[id]   = healthy ? 1 : 0;
+            alerted[id] = was_alerted ? 1 : 0;
+            cause[id]   = healthy ? 0 : why;
+            if (state[id] != alerted[id]) {
+                queue(id, healthy ? ALERT_RECOVER : ALERT_DOWN, cause[id], now_ms);
+            }
+        }
+
+        // health in the last message sent about a target
+        bool alerted_healthy(uint32_t id) const { return alerted[id] != 0; }
+
+        // A health transition of a target
+        void add(uint32_t id, bool healthy, uint8_t why, long int now_ms) {
+            state[id] = healthy ? 1 : 0;
+            cause[id] = healthy ? 0 : why;
+            decay(id, now_ms);
+            penalty[id] = std::min(penalty[id] + FLAP_PENALTY, (float)FLAP_PENALTY_MAX);
+            if (suppressed[id]) return;
+
+            uint8_t section = healthy ? ALERT_RECOVER : ALERT_DOWN;
+            if (penalty[id] >= FLAP_SUPPRESS) {
+                suppressed[id] = 1;
+                flapping.push_back(id);
+                metrics().add(M_ALERT_FLAPS);
+                section = ALERT_FLAP;
+            }
+            queue(id, section, why, now_ms);
+        }
+
+        // Once the window is over, render the collected transitions into text and return true
+        // describe(id, entry) fills ip, port and service of a target
+        template<class F>
+        bool flush(long int now_ms, F&& describe, std::string &text) {
+            release(now_ms);
+            if (pending.empty() || now_ms - window_start < window_ms) return false;
+
+            std::vector<alert_entry> entries;
+            entries.reserve(pending.size());
+            for (alert_entry &e : pending) {
+                if (e.id == ALERT_NONE) continue;
+                pending_idx[e.id] = ALERT_NONE;
+                // flipped back within the window, nothing to tell
+                if (e.section != ALERT_FLAP && (e.section == ALERT_RECOVER) == (alerted[e.id] != 0)) continue;
+                if (e.section != ALERT_FLAP) alerted[e.id] = (e.section == ALERT_RECOVER);
+                describe(e.id, e);
+                entries.push_back(std::move(e));
+            }
+            pending.clear();
+            if (entries.empty()) return false;
+
+            static const char *titles[ALERT_SECTION_NUM] = { "探活失败", "恢复正常", "抖动频繁, 暂停通知" };
+            text = "### 探活状态变动\n";
+            render(entries, titles, text);
+            return true;
+        }
+
+        // Append entries grouped by section, service and /24 subnet, one markdown quote line per group
+        void render(std::vector<alert_entry> &entries, const char * const *titles, std::string &text) const {
+            std::sort(entries.begin(), entries.end(), [](const alert_entry &a, const alert_entry &b) {
+                if (a.section != b.section) return a.section < b.section;
+                if (a.service != b.service) return a.service < b.service;
+                if (a.ip != b.ip) return ntohl(a.ip) < ntohl(b.ip);
+                return ntohs(a.port) < ntohs(b.port);
+            });
+
+            size_t lines = 0, left = 0;
+            size_t i = 0;
+            while (i < entries.size()) {
+                uint8_t section = entries[i].section;
+                size_t section_end = i;
+                while (section_end < entries.size() && entries[section_end].section == section) ++section_end;
+                text += "##### ";
+                text += titles[section];
+                text += " (" + std::to_string(section_end - i) + ")\n";
+
+                while (i < section_end) {
+                    size_t group_end = i;
+                    uint32_t subnet = ntohl(entries[i].ip) >> 8;
+                    while (group_end < section_end && entries[group_end].service == entries[i].service
+                        && ntohl(entries[group_end].ip) >> 8 == subnet) {
+                        ++group_end;
+                    }
+
+                    if (group_end - i > ALERT_GROUP_LIMIT) {
+                        if (lines++ < ALERT_MAX_LINES) subnet_line(entries, i, group_end, text);
+                        else ++left;
+                        i = group_end;
+                        continue;
+                    }
+                    while (i < group_end) {
+                        size_t host_end = i;
+                        while (host_end < group_end && entries[host_end].ip == entries[i].ip) ++host_end;
+                        if (lines++ < ALERT_MAX_LINES) host_line(entries, i, host_end, text);
+                        else ++left;
+                        i = host_end;
+                    }
+                }
+            }
+            if (left > 0) {
+                text += "> ... 另有 " + std::to_string(left) + " 组  \n";
+            }
+        }
+
+    private:
+        void decay(uint32_t id, long int now_ms) {
+            if (penalty[id] > 0) {
+                penalty[id] *= exp2f(-(float)(now_ms - penalty_ms[id]) / FLAP_HALF_LIFE_MS);
+            }
+            penalty_ms[id] = now_ms;
+        }
+
+        void queue(uint32_t id, uint8_t section, uint8_t cause, long int now_ms) {
+            if (pending.empty()) window_start = now_ms;
+            if (pending_idx[id] == ALERT_NONE) {
+                pending_idx[id] = pending.size();
+                pending.push_back(alert_entry());
+            }
+            alert_entry &e = pending[pending_idx[id]];
+            e.id      = id;
+            e.section = section;
+            e.cause   = cause;
+        }
+
+        // targets whose penalty decayed enough are alerted again, with their state if it changed meanwhile
+        void release(long int now_ms) {
+            size_t kept = 0;
+            for (uint32_t id : flapping) {
+                if (id >= suppressed.size() || !suppressed[id]) continue;
+                decay(id, now_ms);
+                if (penalty[id] >= FLAP_REUSE) {
+                    flapping[kept++] = id;
+                    continue;
+                }
+                suppressed[id] = 0;
+                if (state[id] != alerted[id]) {
+                    queue(id, state[id] ? ALERT_RECOVER : ALERT_DOWN, cause[id], now_ms);
+                }
+            }
+            flapping.resize(kept);
+        }
+
+        void subnet_line(const std::vector<alert_entry> &entries, size_t begin, size_t end, std::string &text) const {
+            uint32_t subnet = htonl(ntohl(entries[begin].ip) & 0xffffff00u);
+            char net[INET_ADDRSTRLEN] = {'\0', };
+            inet_ntop(AF_INET, &subnet, net, sizeof(net));
+            text += "> 服务: " + entries[begin].service + "  网段: " + net + "/24  " + std::to_string(end - begin) + " 个目标";
+            append_causes(entries, begin, end, text);
+            text += "  \n";
+        }
+
+        void host_line(const std::vector<alert_entry> &entries, size_t begin, size_t end, std::string &text) const {
+            char ip[INET_ADDRSTRLEN] = {'\0', };
+            inet_ntop(AF_INET, &entries[begin].ip, ip, sizeof(ip));
+            text += "> 服务: " + entries[begin].service + "  地址: " + ip;
+            text += (end - begin > 1) ? "  端口: " : ":";
+            for (size_t i = begin; i < end; ++i) {
+                if (i > begin) text += ",";
+                text += std::to_string(ntohs(entries[i].port));
+            }
+            append_causes(entries, begin, end, text);
+            text += "  \n";
+        }
+
+        // known causes of the down targets in a group, with counts when there are several targets
+        void append_causes(const std::vector<alert_entry> &entries, size_t begin, size_t end, std::string &text) const {
+            std::vector<size_t> counts(causes.size(), 0);
+            for (size_t i = begin; i < end; ++i) {
+                if (entries[i].section == ALERT_DOWN && entries[i].cause < causes.size()) ++counts[entries[i].cause];
+            }
+            bool first = true;
+            for (size_t c = 0; c < counts.size(); ++c) {
+                if (counts[c] == 0 || causes[c].empty()) continue;
+                text += first ? "  原因: " : ", ";
+                text += causes[c];
+                if (end - begin > 1) text += " " + std::to_string(counts[c]);
+                first = false;
+            }
+        }
+
+    private:
+        long int                  window_ms;
+        long int                  window_start;
+        std::vector<std::string>  causes;
+
+        // per target columns
+        std::vector<uint8_t>      state;        // latest health
+        std::vector<uint8_t>      alerted;      // health in the last message sent
+        std::vector<uint8_t>      suppressed;
+        std::vector<uint8_t>      cause;        // cause of the latest failure
+        std::vector<float>        penalty;
+        std::vector<long int>     penalty_ms;   // time the penalty was last decayed to
+        std::vector<uint32_t>     pending_idx;
+
+        std::vector<alert_entry>  pending;
+        std::vector<uint32_t>     flapping;
+};
+
+#endif
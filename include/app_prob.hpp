@@ -0,0 +1,379 @@
+#ifndef __APP_PROB_HPP__
+#define __APP_PROB_HPP__
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <vector>
+
+#include "probe_scheduler.hpp"
+#include "target_rules.hpp"
+#include "metrics.hpp"
+
+#define APP_MAX_CHECKS  65536   // checks running at once
+#define APP_BUF_SIZE    512     // the request, then the head of the answer, all a verdict needs
+#define APP_EVENTS      1024
+#define APP_NIL         0xffffffffu
+
+// Verdicts of an application check
+#define APP_OK          0
+#define APP_FAILED      1       // refused, reset, or answered that the service is not healthy
+#define APP_TIMEOUT     2       // no verdict before the deadline, the port is open and the application hangs
+
+// Causes of failures given by application checks, following the REPLY_* of host_prob.hpp
+#define REPLY_APP_FAILED  3
+#define REPLY_APP_TIMEOUT 4
+
+// Login of a mysql check, as the client authentication of haproxy's mysql-check: protocol 4.1, no password
+#define MYSQL_CLIENT_CAPS   0x0000a200  // CLIENT_PROTOCOL_41 | CLIENT_TRANSACTIONS | CLIENT_SECURE_CONNECTION
+#define MYSQL_CHARSET       0x21        // utf8_general_ci
+#define MYSQL_OK            0x00
+#define MYSQL_COM_QUIT      0x01
+
+/*
+ * Application checks of targets whose port answered a SYN
+ * A check is one non-blocking connection driven by the events of one epoll fd: connect, send the request,
+ * read until the head of the answer gives a verdict, then close with RST so no TIME_WAIT is left behind.
+ * A mysql check with a user logs in and quits, then waits for the server to close first, so the server
+ * ends the session cleanly. Without a user it stops at the greeting, which the server counts as a connect
+ * error of the prober host, and blocks the host after max_connect_errors of them in a row.
+ * Deadlines are timers of a wheel over the check slots, slots and their buffers are allocated once and reused,
+ * so a check costs a socket and a few syscalls but no thread, and one core runs tens of thousands at once.
+ * The epoll fd is waited on within the epoll of the probe loop.
+ */
+class AppProber {
+    public:
+        AppProber(long int now_ms, size_t max_checks = APP_MAX_CHECKS)
+            : epoll_fd(-1), max_slots(max_checks), wheel(now_ms), busy(0) {}
+
+        ~AppProber() {
+            for (app_conn &c : slots) {
+                if (c.fd >= 0) close(c.fd);
+            }
+            if (epoll_fd >= 0) close(epoll_fd);
+        }
+
+        bool start() {
+            epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            if (epoll_fd < 0) {
+                fprintf(stderr, "ERROR: Create epoll fd of app checks failed, %s\n", strerror(errno));
+                return false;
+            }
+            // every running check holds a socket
+            struct rlimit rl;
+            rlim_t want = max_slots + 1024;
+            if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < want && rl.rlim_cur < rl.rlim_max) {
+                rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || want < rl.rlim_max) ? want : rl.rlim_max;
+                if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+                    fprintf(stderr, "WARNING: Raise open files limit to %lu failed, %s\n", (unsigned long)rl.rlim_cur, strerror(errno));
+                }
+            }
+            return true;
+        }
+
+        int get_fd() const { return epoll_fd; }
+        size_t running() const { return busy; }
+
+        void resize(size_t cap) {
+            if (cap > slot_of.size()) slot_of.resize(cap, APP_NIL);
+        }
+
+        // Start a check of the target, return true if one runs for it now, false if none could be started
+        bool check(uint32_t id, const struct sockaddr_in &dst, const app_check &check, long int now_ms) {
+            resize(id + 1);
+            if (slot_of[id] != APP_NIL) return true;
+            if (epoll_fd < 0) return false;
+            uint32_t s = alloc();
+            if (s == APP_NIL) return false;
+
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                free_slots.push_back(s);
+                return false;
+            }
+            struct linger lg = { 1, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            app_conn &c = slots[s];
+            c.fd       = fd;
+            c.id       = id;
+            c.kind     = check.kind;
+            c.phase    = PHASE_CONNECT;
+            c.len      = 0;
+            c.start_us = get_us();
+            c.user_len = 0;
+            if (check.kind == CHECK_HTTP) {
+                char ip[INET_ADDRSTRLEN] = {'\0', };
+                inet_ntop(AF_INET, &dst.sin_addr, ip, sizeof(ip));
+                int n = snprintf(c.buf, APP_BUF_SIZE, "GET %s HTTP/1.1\r\nHost: %s:%u\r\nUser-Agent: nurse\r\nConnection: close\r\n\r\n",
+                    check.arg.c_str(), ip, ntohs(dst.sin_port));
+                c.len = (n > 0 && n < APP_BUF_SIZE) ? n : 0;
+            } else if (check.kind == CHECK_REDIS) {
+                memcpy(c.buf, "PING\r\n", 6);
+                c.len = 6;
+            } else if (check.kind == CHECK_MYSQL) {
+                c.user_len = check.arg.size() < CHECK_MYSQL_USER ? check.arg.size() : CHECK_MYSQL_USER;
+                memcpy(c.user, check.arg.data(), c.user_len);
+            }
+            slot_of[id] = s;
+            ++busy;
+            wheel.schedule(s, now_ms + (check.timeout_ms ? check.timeout_ms : CHECK_TIMEOUT_MS));
+
+            struct epoll_event event;
+            event.events   = EPOLLOUT;
+            event.data.u64 = 0;
+            event.data.u32 = s;
+            if ((connect(fd, (const struct sockaddr*)&dst, sizeof(dst)) != 0 && errno != EINPROGRESS)
+                || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                // unreachable at once, the verdict goes out with the next poll()
+                finish(s, APP_FAILED);
+                done.push_back(id);
+            }
+            return true;
+        }
+
+        // Drop the check of a target which is removed or reset, no verdict is given for it
+        void cancel(uint32_t id) {
+            if (id >= slot_of.size() || slot_of[id] == APP_NIL) return;
+            release(slot_of[id]);
+        }
+
+        // Run the events ready now and the deadlines up to now_ms, on_result(target id, APP_*) is called for each verdict
+        // return count of verdicts
+        template<class F>
+        size_t poll(long int now_ms, F&& on_result) {
+            size_t n = 0;
+            for (uint32_t id : done) {
+                on_result(id, APP_FAILED);
+                ++n;
+            }
+            done.clear();
+
+            struct epoll_event events[APP_EVENTS];
+            while (busy > 0) {
+                int cnt = epoll_wait(epoll_fd, events, APP_EVENTS, 0);
+                if (cnt <= 0) break;
+                for (int i = 0; i < cnt; ++i) {
+                    uint32_t s = events[i].data.u32;
+                    if (s >= slots.size() || slots[s].fd < 0) continue;
+                    int result = step(s, events[i].events);
+                    if (result < 0) continue;
+                    uint32_t id = slots[s].id;
+                    finish(s, result);
+                    on_result(id, result);
+                    ++n;
+                }
+                if (cnt < APP_EVENTS) break;
+            }
+
+            wheel.advance(now_ms, [&](uint32_t s) {
+                if (slots[s].fd < 0) return;
+                uint32_t id = slots[s].id;
+                finish(s, APP_TIMEOUT);
+                on_result(id, APP_TIMEOUT);
+                ++n;
+            });
+            metrics().set(G_APP_RUNNING, busy);
+            return n;
+        }
+
+        // milliseconds the caller may sleep before a deadline passes
+        long int idle_ms(long int max_ms) const {
+            return busy > 0 ? wheel.idle_ms(max_ms) : max_ms;
+        }
+
+    private:
+        enum { PHASE_CONNECT = 0, PHASE_READ, PHASE_LOGIN, PHASE_QUIT };
+        // steps of a check besides its verdicts
+        enum { STEP_MORE = -1, STEP_LOGIN = -2, STEP_QUIT = -3 };
+
+        struct app_conn {
+            int       fd;
+            uint32_t  id;
+            uint16_t  kind;
+            uint16_t  phase;
+            uint32_t  len;          // request to send, then answer read
+            long int  start_us;
+            uint8_t   user_len;
+            char      user[CHECK_MYSQL_USER];
+            char      buf[APP_BUF_SIZE];
+        };
+
+        uint32_t alloc() {
+            if (!free_slots.empty()) {
+                uint32_t s = free_slots.back();
+                free_slots.pop_back();
+                return s;
+            }
+            if (slots.size() >= max_slots) return APP_NIL;
+            slots.push_back(app_conn());
+            slots.back().fd = -1;
+            wheel.resize(slots.size());
+            return slots.size() - 1;
+        }
+
+        void release(uint32_t s) {
+            app_conn &c = slots[s];
+            wheel.cancel(s);
+            if (c.fd >= 0) close(c.fd);
+            c.fd = -1;
+            slot_of[c.id] = APP_NIL;
+            free_slots.push_back(s);
+            --busy;
+        }
+
+        void finish(uint32_t s, int result) {
+            metrics().add(result == APP_OK ? M_APP_OK : (result == APP_TIMEOUT ? M_APP_TIMEOUTS : M_APP_FAILED));
+            metrics().observe(T_APP_CHECK, get_us() - slots[s].start_us);
+            release(s);
+        }
+
+        // Advance a check on its events, return its verdict or STEP_MORE while it goes on
+        int step(uint32_t s, uint32_t events) {
+            app_conn &c = slots[s];
+            if (c.phase == PHASE_CONNECT) {
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+                if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err != 0) return APP_FAILED;
+                if (!(events & EPOLLOUT)) return STEP_MORE;
+                if (c.kind == CHECK_TCP) return APP_OK;
+                // a fresh connection takes a request of a few hundred bytes at once
+                if (c.len > 0 && send(c.fd, c.buf, c.len, MSG_NOSIGNAL) != (ssize_t)c.len) return APP_FAILED;
+
+                c.len   = 0;
+                c.phase = PHASE_READ;
+                struct epoll_event event;
+                event.events   = EPOLLIN;
+                event.data.u64 = 0;
+                event.data.u32 = s;
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &event) != 0) return APP_FAILED;
+                return STEP_MORE;
+            }
+
+            while (true) {
+                ssize_t got = recv(c.fd, c.buf + c.len, APP_BUF_SIZE - c.len, 0);
+                if (got > 0) {
+                    // logged in, whatever comes before the server closes is of no interest
+                    if (c.phase == PHASE_QUIT) continue;
+                    c.len += got;
+                    int result = verdict(c, c.len == APP_BUF_SIZE);
+                    if (result == STEP_LOGIN) {
+                        if (!login(c)) return APP_FAILED;
+                    } else if (result == STEP_QUIT) {
+                        c.phase = PHASE_QUIT;
+                        c.len   = 0;
+                    } else if (result >= 0) {
+                        return result;
+                    }
+                    continue;
+                }
+                if (got == 0) {
+                    if (c.phase == PHASE_QUIT) return APP_OK;
+                    int result = verdict(c, true);
+                    return result >= 0 ? result : APP_FAILED;
+                }
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_MORE;
+                // a reset after the login went through still ends the session
+                return c.phase == PHASE_QUIT ? APP_OK : APP_FAILED;
+            }
+        }
+
+        // Answer the greeting in buf with the login of the user and COM_QUIT in one write, return false if it fails
+        bool login(app_conn &c) {
+            uint8_t seq = (uint8_t)c.buf[3] + 1;
+            uint32_t plen = 4 + 4 + 1 + 23 + c.user_len + 1 + 1;
+            uint8_t *p = (uint8_t *)c.buf;
+            memset(p, 0, 4 + plen);
+            p[0] = plen & 0xff;
+            p[1] = (plen >> 8) & 0xff;
+            p[2] = (plen >> 16) & 0xff;
+            p[3] = seq;
+            p += 4;
+            for (int i = 0; i < 4; ++i) p[i] = (MYSQL_CLIENT_CAPS >> (8 * i)) & 0xff;
+            p[7] = 0x01;                // max packet 16M
+            p[8] = MYSQL_CHARSET;
+            p += 4 + 4 + 1 + 23;        // caps, max packet, charset, filler
+            memcpy(p, c.user, c.user_len);
+            p += c.user_len + 1 + 1;    // user, its NUL, empty auth response
+            const uint8_t quit[5] = { 0x01, 0x00, 0x00, 0x00, MYSQL_COM_QUIT };
+            memcpy(p, quit, sizeof(quit));
+            size_t len = 4 + plen + sizeof(quit);
+
+            if (send(c.fd, c.buf, len, MSG_NOSIGNAL) != (ssize_t)len) return false;
+            c.phase = PHASE_LOGIN;
+            c.len   = 0;
+            return true;
+        }
+
+        // Judge the head of an answer, STEP_MORE if more of it is needed and may still come, other STEP_* for the
+        // steps of a mysql login
+        static int verdict(const app_conn &c, bool final) {
+            switch (c.kind) {
+                case CHECK_HTTP: {
+                    // HTTP/1.x NNN
+                    if (c.len < 12) return final ? APP_FAILED : STEP_MORE;
+                    if (memcmp(c.buf, "HTTP/1.", 7) != 0 || c.buf[8] != ' ') return APP_FAILED;
+                    int status = 0;
+                    for (int i = 9; i < 12; ++i) {
+                        if (c.buf[i] < '0' || c.buf[i] > '9') return APP_FAILED;
+                        status = status * 10 + (c.buf[i] - '0');
+                    }
+                    return (status >= 200 && status < 400) ? APP_OK : APP_FAILED;
+                }
+                case CHECK_REDIS: {
+                    // a server requiring auth is up as well
+                    if (!memchr(c.buf, '\n', c.len)) return final ? APP_FAILED : STEP_MORE;
+                    if (c.buf[0] == '+') return APP_OK;
+                    return (c.len >= 7 && memcmp(c.buf, "-NOAUTH", 7) == 0) ? APP_OK : APP_FAILED;
+                }
+                case CHECK_MYSQL: {
+                    // 3 bytes length, 1 byte sequence, then protocol version 10, or 0xff for an error like too many connections
+                    if (c.len < 5) return final ? APP_FAILED : STEP_MORE;
+                    if (c.phase == PHASE_LOGIN) {
+                        // OK packet, or an error like access denied
+                        return (uint8_t)c.buf[4] == MYSQL_OK ? STEP_QUIT : APP_FAILED;
+                    }
+                    if ((uint8_t)c.buf[4] != 10) return APP_FAILED;
+                    if (c.user_len == 0) return APP_OK;
+                    // the login answers the whole greeting
+                    uint32_t plen = (uint8_t)c.buf[0] | ((uint8_t)c.buf[1] << 8) | ((uint8_t)c.buf[2] << 16);
+                    if (4 + plen > APP_BUF_SIZE) return APP_FAILED;
+                    if (c.len < 4 + plen) return final ? APP_FAILED : STEP_MORE;
+                    return STEP_LOGIN;
+                }
+                default:
+                    return APP_OK;
+            }
+        }
+
+        static long int get_us() {
+            struct timespec _cur_ts;
+            clock_gettime(CLOCK_MONOTONIC, &_cur_ts);
+            return _cur_ts.tv_sec * 1000000 + _cur_ts.tv_nsec / 1000;
+        }
+
+    private:
+        int                      epoll_fd;
+        size_t                   max_slots;
+        TimerWheel               wheel;         // deadlines of the slots
+        std::vector<app_conn>    slots;
+        std::vector<uint32_t>    free_slots;
+        std::vector<uint32_t>    slot_of;       // slot of the running check of each target
+        std::vector<uint32_t>    done;          // targets failed at connect, reported by the next poll()
+        size_t                   busy;
+};
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef __BPF_FILTER_HPP__
+#define __BPF_FILTER_HPP__
+
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/ip_icmp.h>
+#include <net/if_arp.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+
+#include <vector>
+
+// Builder of classic BPF programs with named forward jump targets
+// Classic BPF only jumps forward by at most 255 instructions, labels are resolved when the program is finished.
+class BpfProgram {
+    public:
+        // jump target meaning the next instruction
+        static const int NEXT = -1;
+
+        int new_label() {
+            labels.push_back(-1);
+            return (int)labels.size() - 1;
+        }
+
+        // the next instruction emitted is the target of label
+        void bind(int label) {
+            labels[label] = (int)insns.size();
+        }
+
+        void stmt(uint16_t code, uint32_t k) {
+            insn i = { BPF_STMT(code, k), NEXT, NEXT };
+            insns.push_back(i);
+        }
+
+        void jump(uint16_t code, uint32_t k, int jt, int jf) {
+            insn i = { BPF_JUMP(code, k, 0, 0), jt, jf };
+            insns.push_back(i);
+        }
+
+        // resolve the labels into out, return false if a label is unbound or out of reach
+        bool finish(std::vector<struct sock_filter> &out) const {
+            out.clear();
+            for (size_t pc = 0; pc < insns.size(); ++pc) {
+                struct sock_filter f = insns[pc].f;
+                if (!offset_of(insns[pc].jt, pc, f.jt) || !offset_of(insns[pc].jf, pc, f.jf)) {
+                    return false;
+                }
+                out.push_back(f);
+            }
+            return !out.empty() && out.size() <= BPF_MAXINSNS;
+        }
+
+    private:
+        struct insn {
+            struct sock_filter f;
+            int                jt;
+            int                jf;
+        };
+
+        bool offset_of(int label, size_t pc, uint8_t &off) const {
+            if (label == NEXT) {
+                off = 0;
+                return true;
+            }
+            int target = labels[label];
+            if (target <= (int)pc || target - (int)pc - 1 > 255) return false;
+            off = (uint8_t)(target - pc - 1);
+            return true;
+        }
+
+        std::vector<insn> insns;
+        std::vector<int>  labels;
+};
+
+// What a reply to one of our probes looks like on the capture interface
+struct reply_filter_spec {
+    int       link_type;    // ARPHRD_* of the interface
+    uint32_t  local_ip;     // network byte order
+    uint16_t  port_lo;      // capture port range, host byte order
+    uint16_t  port_hi;
+    uint32_t  cookie_ns;    // namespace of the probe cookie
+    uint32_t  cookie_shift; // bits below the namespace in the sequence number
+};
+
+// bytes of link header before the ip header on a link type, -1 if nurse can't capture on it
+inline int link_header_len(int link_type) {
+    switch (link_type) {
+        case ARPHRD_ETHER:
+        case ARPHRD_LOOPBACK:
+            return 14;
+        case ARPHRD_NONE:
+        case ARPHRD_PPP:
+        case ARPHRD_RAWIP:
+        case ARPHRD_TUNNEL:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// Jump to drop unless the port in A is in the capture port range
+inline void emit_port_check(BpfProgram &prog, const reply_filter_spec &spec, int drop) {
+    if (spec.port_lo == spec.port_hi) {
+        prog.jump(BPF_JMP | BPF_JEQ | BPF_K, spec.port_lo, BpfProgram::NEXT, drop);
+    } else {
+        prog.jump(BPF_JMP | BPF_JGE | BPF_K, spec.port_lo, BpfProgram::NEXT, drop);
+        prog.jump(BPF_JMP | BPF_JGT | BPF_K, spec.port_hi, drop, BpfProgram::NEXT);
+    }
+}
+
+// Checks of one ipv4 frame with its ip header at nh, jumping to drop on the first mismatch.
+// An unfragmented packet to the local ip passes if it is either
+//   tcp to a capture port with SYN+ACK or RST+ACK, acknowledging a sequence number(ack_seq - 1) of our cookie namespace
+//   icmp destination unreachable quoting such a probe: tcp from a capture port with its sequence number in our namespace
+inline void emit_reply_checks(BpfProgram &prog, const reply_filter_spec &spec, uint32_t nh, int drop) {
+    int icmp = prog.new_label();
+    int synack = prog.new_label();
+    prog.stmt(BPF_LD  | BPF_W   | BPF_ABS, nh + 16);
+    prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   ntohl(spec.local_ip), BpfProgram::NEXT, drop);
+    prog.stmt(BPF_LD  | BPF_H   | BPF_ABS, nh + 6);
+    prog.jump(BPF_JMP | BPF_JSET | BPF_K,  0x1fff, drop, BpfProgram::NEXT);
+
+    // X = ip header length, the next header is loaded relative to it
+    prog.stmt(BPF_LDX | BPF_B   | BPF_MSH, nh);
+    prog.stmt(BPF_LD  | BPF_B   | BPF_ABS, nh + 9);
+    prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   IPPROTO_TCP, BpfProgram::NEXT, icmp);
+
+    prog.stmt(BPF_LD  | BPF_H   | BPF_IND, nh + 2);
+    emit_port_check(prog, spec, drop);
+    prog.stmt(BPF_LD  | BPF_B   | BPF_IND, nh + 13);
+    prog.stmt(BPF_ALU | BPF_AND | BPF_K,   TH_SYN | TH_ACK | TH_RST);
+    prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   TH_SYN | TH_ACK, synack, BpfProgram::NEXT);
+    prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   TH_RST | TH_ACK, BpfProgram::NEXT, drop);
+    prog.bind(synack);
+    prog.stmt(BPF_LD  | BPF_W   | BPF_IND, nh + 8);
+    prog.stmt(BPF_ALU | BPF_SUB | BPF_K,   1);
+    prog.stmt(BPF_ALU | BPF_RSH | BPF_K,   spec.cookie_shift);
+    prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   spec.cookie_ns, BpfProgram::NEXT, drop);
+    // headers are all we parse, leave the payload in the kernel
+    prog.stmt(BPF_RET | BPF_K, nh + 60 + 60);
+
+    // the quoted probe starts 8 bytes into the icmp message, X becomes the length of both ip headers
+    prog.bind(icmp);
+    prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   IPPROTO_ICMP, BpfProgram::NEXT, drop);
+    prog.stmt(BPF_LD  | BPF_B   | BPF_IND, nh);
+    prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   ICMP_DEST_UNREACH, BpfProgram::NEXT, drop);
+    prog.stmt(BPF_LD  | BPF_B   | BPF_IND, nh + 8 + 9);
+    prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   IPPROTO_TCP, BpfProgram::NEXT, drop);
+    prog.stmt(BPF_LD  | BPF_B   | BPF_IND, nh + 8);
+    prog.stmt(BPF_ALU | BPF_AND | BPF_K,   0xf);
+    prog.stmt(BPF_ALU | BPF_LSH | BPF_K,   2);
+    prog.stmt(BPF_ALU | BPF_ADD | BPF_X,   0);
+    prog.stmt(BPF_MISC | BPF_TAX,          0);
+    prog.stmt(BPF_LD  | BPF_H   | BPF_IND, nh + 8);
+    emit_port_check(prog, spec, drop);
+    prog.stmt(BPF_LD  | BPF_W   | BPF_IND, nh + 8 + 4);
+    prog.stmt(BPF_ALU | BPF_RSH | BPF_K,   spec.cookie_shift);
+    prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   spec.cookie_ns, BpfProgram::NEXT, drop);
+    prog.stmt(BPF_RET | BPF_K, nh + 60 + 8 + 60 + 8);
+}
+
+// Build the capture filter accepting only replies to our probes, return false if the link type is unsupported
+inline bool build_reply_filter(const reply_filter_spec &spec, std::vector<struct sock_filter> &out) {
+    int link_len = link_header_len(spec.link_type);
+    if (link_len < 0) {
+        return false;
+    }
+
+    BpfProgram prog;
+    int drop = prog.new_label();
+    if (link_len == 0) {
+        // no link header, the kernel knows the protocol of the frame
+        prog.stmt(BPF_LD  | BPF_W   | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL);
+        prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   ETH_P_IP, BpfProgram::NEXT, drop);
+        emit_reply_checks(prog, spec, 0, drop);
+    } else {
+        // ethernet, ipv4 either right after the header or behind one VLAN tag kept in the frame
+        int tagged = prog.new_label();
+        prog.stmt(BPF_LD  | BPF_H   | BPF_ABS, 12);
+        prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   ETH_P_8021Q, tagged, BpfProgram::NEXT);
+        prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   ETH_P_8021AD, tagged, BpfProgram::NEXT);
+        prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   ETH_P_IP, BpfProgram::NEXT, drop);
+        emit_reply_checks(prog, spec, link_len, drop);
+
+        prog.bind(tagged);
+        prog.stmt(BPF_LD  | BPF_H   | BPF_ABS, 16);
+        prog.jump(BPF_JMP | BPF_JEQ | BPF_K,   ETH_P_IP, BpfProgram::NEXT, drop);
+        emit_reply_checks(prog, spec, link_len + 4, drop);
+    }
+
+    prog.bind(drop);
+    prog.stmt(BPF_RET | BPF_K, 0);
+    return prog.finish(out);
+}
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef __HEALTH_STORE_HPP__
+#define __HEALTH_STORE_HPP__
+
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "health_table.hpp"
+
+#define STATE_MAGIC       "NURSEHST"
+#define STATE_VERSION     1
+#define STATE_MIN_SLOTS   4096
+#define STATE_SYNC_MS     1000      // dirty pages of the state file are flushed this often
+
+#define STATE_VALID       0x01
+#define STATE_HEALTHY     0x02
+#define STATE_ALERTED     0x04      // the last alert sent said healthy
+
+struct state_header {
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  slot_size;
+    uint64_t  capacity;
+    uint32_t  epoch;        // run whose slots are current, bumped once a run has written all of its targets
+    uint32_t  pad[9];
+};
+
+// Health of one target, slot index is the target id of the run which wrote it, ip & port in network byte order
+struct state_slot {
+    uint32_t  ip;
+    uint16_t  port;
+    uint8_t   flags;
+    uint8_t   window;
+    uint64_t  history;
+    uint32_t  epoch;
+    uint8_t   recover;
+    uint8_t   refused;
+    uint8_t   cause;
+    uint8_t   check;        // over the other bytes, a slot torn by a crash of the host is dropped
+};
+
+/*
+ * Health states kept in a memory mapped file, so a restart picks up which targets are down
+ * Slots are written in place when the state of their target changes, the writes are plain stores into
+ * shared pages, a thread flushes the dirty pages with msync every STATE_SYNC_MS. A crash of nurse loses
+ * nothing, the pages are in the page cache, a crash of the host loses at most the last STATE_SYNC_MS.
+ *
+ * Target ids differ between runs, so the slots of the last run are read at open, sorted by ip:port and
+ * looked up when targets are added. Every target of a run gets its slot written with the run's epoch,
+ * then commit() makes that epoch current: slots of older runs are ignored, including removed targets.
+ * Targets come back over time, found by rule sweeps or added by later reloads, so the caller commits only
+ * once each of them had its chance, the slots of the last run can be looked up until then.
+ */
+class HealthStore {
+    public:
+        HealthStore() : fd(-1), base(NULL), map_size(0), hdr(NULL), slots(NULL), epoch(0),
+            committed(false), stop(false) {}
+
+        ~HealthStore() {
+            stop = true;
+            if (syncer.joinable()) syncer.join();
+            if (base) {
+                msync(base, map_size, MS_SYNC);
+                munmap(base, map_size);
+            }
+            if (fd >= 0) close(fd);
+        }
+
+        // Open or create the state file and read the slots of the last run, return false if it can't be used
+        bool open(const std::string &path) {
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                fprintf(stderr, "ERROR: Open state file %s failed, %s\n", path.c_str(), strerror(errno));
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                fprintf(stderr, "ERROR: Stat state file %s failed, %s\n", path.c_str(), strerror(errno));
+                return false;
+            }
+
+            size_t capacity = STATE_MIN_SLOTS;
+            bool fresh = true;
+            if ((size_t)st.st_size >= sizeof(state_header)) {
+                state_header old;
+                if (pread(fd, &old, sizeof(old), 0) == (ssize_t)sizeof(old) && memcmp(old.magic, STATE_MAGIC, 8) == 0
+                    && old.version == STATE_VERSION && old.slot_size == sizeof(state_slot)
+                    && old.capacity <= ((size_t)st.st_size - sizeof(state_header)) / sizeof(state_slot)) {
+                    capacity = std::max(capacity, (size_t)old.capacity);
+                    fresh = false;
+                } else {
+                    fprintf(stderr, "WARNING: State file %s is not a nurse state file of this version, start over\n", path.c_str());
+                }
+            }
+            if (!map(capacity)) return false;
+
+            if (fresh) {
+                memset(hdr, 0, sizeof(state_header));
+                memcpy(hdr->magic, STATE_MAGIC, 8);
+                hdr->version   = STATE_VERSION;
+                hdr->slot_size = sizeof(state_slot);
+                hdr->capacity  = capacity;
+            }
+            // slots of the run which last committed and of a run which crashed before committing
+            for (size_t i = 0; i < hdr->capacity; ++i) {
+                const state_slot &s = slots[i];
+                if ((s.flags & STATE_VALID) && s.epoch >= hdr->epoch && s.check == checksum(s)) {
+                    previous.push_back(s);
+                }
+            }
+            std::sort(previous.begin(), previous.end(), [](const state_slot &a, const state_slot &b) {
+                return key(a) != key(b) ? key(a) < key(b) : a.epoch > b.epoch;
+            });
+            previous.erase(std::unique(previous.begin(), previous.end(), [](const state_slot &a, const state_slot &b) {
+                return key(a) == key(b);
+            }), previous.end());
+            epoch = hdr->epoch + 1;
+
+            syncer = std::thread([this] { this->run(); });
+            return true;
+        }
+
+        bool active() const { return base != NULL; }
+        bool pending() const { return base != NULL && !committed; }
+        size_t restorable() const { return previous.size(); }
+
+        // State of ip:port saved by the last run, return false if there is none
+        bool find(uint32_t ip, uint16_t port, health_record &r, bool &alerted) const {
+            state_slot probe;
+            memset(&probe, 0, sizeof(probe));
+            probe.ip   = ip;
+            probe.port = port;
+            std::vector<state_slot>::const_iterator it = std::lower_bound(previous.begin(), previous.end(), probe,
+                [](const state_slot &a, const state_slot &b) { return key(a) < key(b); });
+            if (it == previous.end() || key(*it) != key(probe)) return false;
+
+            r.history = it->history;
+            r.window  = it->window;
+            r.recover = it->recover;
+            r.refused = it->refused;
+            r.cause   = it->cause;
+            r.healthy = (it->flags & STATE_HEALTHY) != 0;
+            alerted   = (it->flags & STATE_ALERTED) != 0;
+            return true;
+        }
+
+        void save(uint32_t id, uint32_t ip, uint16_t port, const health_record &r, bool alerted) {
+            if (!base || (id >= hdr->capacity && !grow(id + 1))) return;
+            state_slot s;
+            s.ip      = ip;
+            s.port    = port;
+            s.flags   = STATE_VALID | (r.healthy ? STATE_HEALTHY : 0) | (alerted ? STATE_ALERTED : 0);
+            s.window  = r.window;
+            s.history = r.history;
+            s.epoch   = epoch;
+            s.recover = r.recover;
+            s.refused = r.refused;
+            s.cause   = r.cause;
+            s.check   = checksum(s);
+            slots[id] = s;
+        }
+
+        void drop(uint32_t id) {
+            if (base && id < hdr->capacity) slots[id].flags = 0;
+        }
+
+        // Every target of this run has its slot written, make this run's slots the current ones
+        // and drop the slots of the last run, targets added after this start afresh
+        void commit() {
+            if (!base || committed) return;
+            hdr->epoch = epoch;
+            committed = true;
+            previous.clear();
+            previous.shrink_to_fit();
+        }
+
+    private:
+        static uint64_t key(const state_slot &s) { return ((uint64_t)s.ip << 16) | s.port; }
+
+        static uint8_t checksum(const state_slot &s) {
+            const uint8_t *p = (const uint8_t*)&s;
+            uint8_t sum = 0x5a;
+            for (size_t i = 0; i < offsetof(state_slot, check); ++i) sum = (uint8_t)((sum << 1 | sum >> 7) ^ p[i]);
+            return sum;
+        }
+
+        bool map(size_t capacity) {
+            size_t size = sizeof(state_header) + capacity * sizeof(state_slot);
+            struct stat st;
+            if (fstat(fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate(fd, size) != 0)) {
+                fprintf(stderr, "ERROR: Resize state file failed, %s\n", strerror(errno));
+                return false;
+            }
+            void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                fprintf(stderr, "ERROR: Mmap state file failed, %s\n", strerror(errno));
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(map_mutex);
+            if (base) munmap(base, map_size);
+            base     = (char*)addr;
+            map_size = size;
+            hdr      = (state_header*)base;
+            slots    = (state_slot*)(base + sizeof(state_header));
+            return true;
+        }
+
+        bool grow(size_t need) {
+            size_t capacity = hdr->capacity;
+            while (capacity < need) capacity *= 2;
+            if (!map(capacity)) return false;
+            hdr->capacity = capacity;
+            return true;
+        }
+
+        void run() {
+            while (!stop) {
+                usleep(STATE_SYNC_MS * 1000);
+                std::lock_guard<std::mutex> lock(map_mutex);
+                if (base && msync(base, map_size, MS_SYNC) != 0) {
+                    fprintf(stderr, "ERROR: Sync state file failed, %s\n", strerror(errno));
+                }
+            }
+        }
+
+    private:
+        int                      fd;
+        char                    *base;
+        size_t                   map_size;
+        state_header            *hdr;
+        state_slot              *slots;
+        uint32_t                 epoch;
+        bool                     committed;
+        std::vector<state_slot>  previous;  // slots of the last run sorted by ip:port, until commit()
+
+        std::mutex               map_mutex; // held by the sync thread while it flushes the mapping
+        std::atomic<bool>        stop;
+        std::thread              syncer;
+};
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef __HEALTH_TABLE_HPP__
+#define __HEALTH_TABLE_HPP__
+
+#include <cstdio>
+#include <stdint.h>
+#include <vector>
+
+// Longest failure window in probe cycles, one bit of history each
+#define HEALTH_MAX_WINDOW 64
+
+// A target whose health flipped in the last apply()
+struct health_change {
+    uint32_t id;
+    uint8_t  healthy;
+    uint8_t  cause;     // cause given with its last failure, 0 for a timeout
+};
+
+// Everything known about the health of one target, saved and loaded across restarts
+struct health_record {
+    uint64_t history;
+    uint8_t  window;
+    uint8_t  recover;
+    uint8_t  refused;
+    uint8_t  cause;
+    bool     healthy;
+};
+
+/*
+ * Health state of every target, stored by column and indexed by target id
+ * The probe loop records outcomes into three bitmaps (success, timeout, refusal) as they come,
+ * apply() then works 64 targets per word: successes of targets which are healthy and have no failure
+ * in their window ("clean") change nothing and are dropped with one and-not, only the rest is stepped
+ * one by one over its packed outcome history.
+ *
+ * A target goes down when fail_cnt of the last window probes failed, or after refuse_cnt refusals
+ * (RST or ICMP unreachable) in a row, timeouts in between don't break the row since routers rate limit ICMP.
+ * It recovers once it has answered 2 * window probes and none of the last window probes failed.
+ */
+class HealthTable {
+    public:
+        HealthTable(int fail_limit = 3, int refuse_limit = 2)
+            : fail_cnt(fail_limit < 1 ? 1 : fail_limit), refuse_cnt(refuse_limit < 1 ? 1 : refuse_limit) {}
+
+        void resize(size_t cap) {
+            if (cap <= history.size()) return;
+            size_t words = (cap + 63) / 64;
+            history.resize(cap, 0);
+            window.resize(cap, HEALTH_MAX_WINDOW);
+            recover.resize(cap, 0);
+            refused.resize(cap, 0);
+            cause.resize(cap, 0);
+            healthy_bits.resize(words, ~(uint64_t)0);
+            clean_bits.resize(words, ~(uint64_t)0);
+            ok_bits.resize(words, 0);
+            fail_bits.resize(words, 0);
+            refuse_bits.resize(words, 0);
+        }
+
+        // (Re)start a target healthy with an empty history, window is its failure window in probe cycles
+        void reset(uint32_t id, uint32_t window_cycles) {
+            resize(id + 1);
+            uint32_t w = window_cycles < (uint32_t)fail_cnt ? fail_cnt : window_cycles;
+            history[id] = 0;
+            window[id]  = w > HEALTH_MAX_WINDOW ? HEALTH_MAX_WINDOW : w;
+            recover[id] = 0;
+            refused[id] = 0;
+            cause[id]   = 0;
+            healthy_bits[id / 64] |= bit(id);
+            clean_bits[id / 64]   |= bit(id);
+        }
+
+        // Change the failure window of a target whose interval changed, its history and state are kept
+        void set_window(uint32_t id, uint32_t window_cycles) {
+            uint32_t w = window_cycles < (uint32_t)fail_cnt ? fail_cnt : window_cycles;
+            window[id] = w > HEALTH_MAX_WINDOW ? HEALTH_MAX_WINDOW : w;
+            if (healthy(id) && (history[id] & mask(id)) == 0) {
+                clean_bits[id / 64] |= bit(id);
+            } else {
+                clean_bits[id / 64] &= ~bit(id);
+            }
+        }
+
+        void save(uint32_t id, health_record &r) const {
+            r.history = history[id];
+            r.window  = window[id];
+            r.recover = recover[id];
+            r.refused = refused[id];
+            r.cause   = cause[id];
+            r.healthy = healthy(id);
+        }
+
+        // Take over the state saved for a target after reset(), the window given to reset() is kept
+        void load(uint32_t id, const health_record &r) {
+            history[id] = r.history;
+            recover[id] = r.recover;
+            refused[id] = r.refused;
+            cause[id]   = r.cause;
+            if (r.healthy) {
+                healthy_bits[id / 64] |= bit(id);
+            } else {
+                healthy_bits[id / 64] &= ~bit(id);
+            }
+            if (r.healthy && (history[id] & mask(id)) == 0) {
+                clean_bits[id / 64] |= bit(id);
+            } else {
+                clean_bits[id / 64] &= ~bit(id);
+            }
+        }
+
+        bool healthy(uint32_t id) const {
+            return (healthy_bits[id / 64] & bit(id)) != 0;
+        }
+
+        // healthy without any failure in its window, as of the last apply()
+        bool clean(uint32_t id) const {
+            return (clean_bits[id / 64] & bit(id)) != 0;
+        }
+
+        // outcomes of probes, applied by the next apply()
+        void on_success(uint32_t id) { record(ok_bits, id); }
+        void on_fail(uint32_t id) { record(fail_bits, id); }
+        void on_refused(uint32_t id, uint8_t why) {
+            cause[id] = why;
+            record(refuse_bits, id);
+        }
+
+        // Apply the outcomes recorded since the last call, targets whose health flipped are appended to changes
+        // return count of them
+        size_t apply(std::vector<health_change> &changes) {
+            size_t before = changes.size();
+            stepped_ids.clear();
+            for (uint32_t w : dirty) {
+                uint64_t fail = fail_bits[w], refuse = refuse_bits[w], ok = ok_bits[w];
+                fail_bits[w] = refuse_bits[w] = ok_bits[w] = 0;
+
+                uint64_t todo = fail | refuse | (ok & ~clean_bits[w]);
+                while (todo) {
+                    int b = __builtin_ctzll(todo);
+                    todo &= todo - 1;
+                    uint32_t id = w * 64 + b;
+                    uint64_t m = (uint64_t)1 << b;
+                    stepped_ids.push_back(id);
+                    if (fail & m) step_fail(id, false, changes);
+                    if (refuse & m) step_fail(id, true, changes);
+                    if (ok & m) step_success(id, changes);
+                }
+            }
+            dirty.clear();
+            return changes.size() - before;
+        }
+
+        // targets whose state was stepped by the last apply(), clean successes are not
+        const std::vector<uint32_t>& stepped() const { return stepped_ids; }
+
+        void print(uint32_t id) const {
+            fprintf(stderr, "healthy: %d | recover: %u | fails: %d/%u | refused: %u\n", healthy(id) ? 1 : 0,
+                recover[id], __builtin_popcountll(history[id] & mask(id)), window[id], refused[id]);
+        }
+
+    private:
+        static uint64_t bit(uint32_t id) { return (uint64_t)1 << (id % 64); }
+
+        uint64_t mask(uint32_t id) const {
+            return window[id] >= 64 ? ~(uint64_t)0 : (((uint64_t)1 << window[id]) - 1);
+        }
+
+        void record(std::vector<uint64_t> &bits, uint32_t id) {
+            uint32_t w = id / 64;
+            if ((ok_bits[w] | fail_bits[w] | refuse_bits[w]) == 0) dirty.push_back(w);
+            bits[w] |= bit(id);
+        }
+
+        void step_fail(uint32_t id, bool refusal, std::vector<health_change> &changes) {
+            history[id] = (history[id] << 1) | 1;
+            if (refusal) {
+                if (refused[id] < 255) ++refused[id];
+            } else {
+                cause[id] = 0;
+            }
+            clean_bits[id / 64] &= ~bit(id);
+            if (!healthy(id)) return;
+
+            if (__builtin_popcountll(history[id] & mask(id)) >= fail_cnt || refused[id] >= refuse_cnt) {
+                healthy_bits[id / 64] &= ~bit(id);
+                recover[id] = (uint8_t)(2 * window[id]);
+                health_change c = { id, 0, cause[id] };
+                changes.push_back(c);
+            }
+        }
+
+        void step_success(uint32_t id, std::vector<health_change> &changes) {
+            history[id] <<= 1;
+            refused[id] = 0;
+            if (recover[id] > 0) --recover[id];
+
+            bool quiet = (history[id] & mask(id)) == 0;
+            if (!healthy(id) && quiet && recover[id] == 0) {
+                healthy_bits[id / 64] |= bit(id);
+                health_change c = { id, 1, 0 };
+                changes.push_back(c);
+            }
+            if (healthy(id) && quiet) {
+                clean_bits[id / 64] |= bit(id);
+            }
+        }
+
+    private:
+        int                     fail_cnt;
+        int                     refuse_cnt;
+
+        // per target columns
+        std::vector<uint64_t>   history;    // bit i set if the probe i cycles ago failed
+        std::vector<uint8_t>    window;
+        std::vector<uint8_t>    recover;    // successes still needed before a down target may recover
+        std::vector<uint8_t>    refused;    // refusals in a row
+        std::vector<uint8_t>    cause;
+
+        // per target bits, 64 targets a word
+        std::vector<uint64_t>   healthy_bits;
+        std::vector<uint64_t>   clean_bits;
+        std::vector<uint64_t>   ok_bits;
+        std::vector<uint64_t>   fail_bits;
+        std::vector<uint64_t>   refuse_bits;
+        std::vector<uint32_t>   dirty;      // words with outcomes not applied yet
+        std::vector<uint32_t>   stepped_ids;
+};
+
+#endif
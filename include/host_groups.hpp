@@ -0,0 +1,171 @@
+#ifndef __HOST_GROUPS_HPP__
+#define __HOST_GROUPS_HPP__
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#define HOST_SILENT_PROBES  3       // probes in a row a port must lose before it counts as silent
+#define HOST_NIL            0xffffffffu
+
+/*
+ * Targets grouped by ip address, with a liveness layer per host
+ * A port is silent after HOST_SILENT_PROBES probes in a row got no answer from the host itself: lost, or
+ * answered by ICMP unreachable from the path, while a RST proves the host is up as much as a SYN-ACK does.
+ * Once every port of a host with several ports is silent, the host is parked: only one canary port keeps
+ * being probed and the others are handed back to be taken off the schedule. Any reply to the canary wakes
+ * the host and hands back the other ports to be probed again.
+ *
+ * Members of a host are an intrusive list over target ids, so grouping allocates per host, not per target.
+ */
+class HostGroups {
+    public:
+        HostGroups() : parked_cnt(0) {}
+
+        void resize(size_t cap) {
+            if (cap <= host_of.size()) return;
+            host_of.resize(cap, HOST_NIL);
+            next.resize(cap, HOST_NIL);
+            silent.resize(cap, 0);
+        }
+
+        // Put a target into the group of its ip, a parked host wakes since the new port has not been silent
+        void add(uint32_t id, uint32_t ip, std::vector<uint32_t> &wake) {
+            resize(id + 1);
+            remove(id, wake);
+
+            uint32_t h = 0;
+            std::unordered_map<uint32_t, uint32_t>::iterator it = index.find(ip);
+            if (it != index.end()) {
+                h = it->second;
+            } else {
+                if (free_hosts.empty()) {
+                    h = hosts.size();
+                    hosts.push_back(host());
+                } else {
+                    h = free_hosts.back();
+                    free_hosts.pop_back();
+                }
+                hosts[h] = host();
+                hosts[h].ip = ip;
+                index[ip] = h;
+            }
+
+            host &g = hosts[h];
+            if (g.canary != HOST_NIL) wake_host(h, wake);
+            host_of[id] = h;
+            next[id]    = g.head;
+            silent[id]  = 0;
+            g.head = id;
+            ++g.count;
+        }
+
+        // Take a target out of its group, removing the canary of a parked host wakes it
+        void remove(uint32_t id, std::vector<uint32_t> &wake) {
+            if (id >= host_of.size() || host_of[id] == HOST_NIL) return;
+            uint32_t h = host_of[id];
+            host &g = hosts[h];
+            if (g.canary == id) {
+                wake_host(h, wake);
+            } else if (g.canary != HOST_NIL) {
+                --parked_cnt;
+            }
+            if (silent[id] >= HOST_SILENT_PROBES) --g.silent;
+
+            if (g.head == id) {
+                g.head = next[id];
+            } else {
+                uint32_t m = g.head;
+                while (next[m] != id) m = next[m];
+                next[m] = next[id];
+            }
+            host_of[id] = HOST_NIL;
+            next[id]    = HOST_NIL;
+            silent[id]  = 0;
+            // woken ports which are gone must not be resumed by the caller
+            for (size_t i = 0; i < wake.size(); ++i) {
+                if (wake[i] == id) wake[i] = HOST_NIL;
+            }
+
+            if (--g.count == 0) {
+                index.erase(g.ip);
+                free_hosts.push_back(h);
+            }
+        }
+
+        // A probe of the target got no answer from the host, if that leaves its whole host silent the other ports
+        // go into park, return true if the host got parked
+        bool on_silent(uint32_t id, std::vector<uint32_t> &park) {
+            if (id >= host_of.size() || host_of[id] == HOST_NIL) return false;
+            if (silent[id] >= HOST_SILENT_PROBES || ++silent[id] < HOST_SILENT_PROBES) return false;
+
+            host &g = hosts[host_of[id]];
+            ++g.silent;
+            if (g.canary != HOST_NIL || g.count < 2 || g.silent < g.count) return false;
+
+            // the port lost last stays as canary
+            g.canary = id;
+            for (uint32_t m = g.head; m != HOST_NIL; m = next[m]) {
+                if (m != id) park.push_back(m);
+            }
+            parked_cnt += g.count - 1;
+            return true;
+        }
+
+        // The host answered on the target port, a reply to the canary wakes its host and the other ports go into wake
+        // return true if the host woke
+        bool on_reply(uint32_t id, std::vector<uint32_t> &wake) {
+            if (id >= host_of.size() || host_of[id] == HOST_NIL) return false;
+            host &g = hosts[host_of[id]];
+            if (silent[id] >= HOST_SILENT_PROBES) --g.silent;
+            silent[id] = 0;
+            if (g.canary != id) return false;
+            wake_host(host_of[id], wake);
+            return true;
+        }
+
+        // ports not probed because their host is parked
+        size_t parked() const { return parked_cnt; }
+
+        size_t ports(uint32_t id) const {
+            return (id < host_of.size() && host_of[id] != HOST_NIL) ? hosts[host_of[id]].count : 0;
+        }
+
+    private:
+        struct host {
+            uint32_t ip;
+            uint32_t head;
+            uint32_t count;
+            uint32_t silent;    // members silent for HOST_SILENT_PROBES probes
+            uint32_t canary;    // HOST_NIL unless parked
+
+            host() : ip(0), head(HOST_NIL), count(0), silent(0), canary(HOST_NIL) {}
+        };
+
+        // parked ports start from scratch, so a host still dark after waking parks again only once they all lost probes
+        void wake_host(uint32_t h, std::vector<uint32_t> &wake) {
+            host &g = hosts[h];
+            for (uint32_t m = g.head; m != HOST_NIL; m = next[m]) {
+                if (m == g.canary) continue;
+                if (silent[m] >= HOST_SILENT_PROBES) --g.silent;
+                silent[m] = 0;
+                wake.push_back(m);
+            }
+            parked_cnt -= g.count - 1;
+            g.canary = HOST_NIL;
+        }
+
+    private:
+        std::vector<host>       hosts;
+        std::vector<uint32_t>   free_hosts;
+        std::unordered_map<uint32_t, uint32_t> index;   // ip to host
+
+        // per target columns
+        std::vector<uint32_t>   host_of;
+        std::vector<uint32_t>   next;
+        std::vector<uint8_t>    silent;     // lost probes in a row, saturating at HOST_SILENT_PROBES
+
+        size_t                  parked_cnt;
+};
+
+#endif
@@ -3,10 +3,18 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include <ifaddrs.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <net/ethernet.h>
 #include <netinet/tcp.h>
 #include <netinet/ip.h>
@@ -14,10 +22,24 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <linux/filter.h>
+#include <linux/if_packet.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include "thread_pool.hpp"
+#include "probe_cookie.hpp"
+#include "target_table.hpp"
+#include "target_rules.hpp"
+#include "metrics.hpp"
+#include "spsc_queue.hpp"
+#include "bpf_filter.hpp"
 
 #define MAX_SEND_THERAD 8
+#define SEND_BATCH_SIZE 256
+#define SEND_CHUNK_MIN  1024
 #define LOCAL_PORT 28724
 #define SYN_SCAN  0
 #define NULL_SCAN 1
@@ -26,6 +48,28 @@
 #define ACK_SCAN  4
 #define UDP_SCAN  5
 
+#define CAPTURE_RECV 0
+#define CAPTURE_RING 1
+
+// return values of match_reply() besides a target index
+#define CAPTURE_MISS  -1    // not a reply to a probe of ours
+#define CAPTURE_SWEEP -2    // a reply to a sweep probe of a target rule, not to a target
+
+// what a matched reply says about the probed port
+#define REPLY_OPEN    0     // SYN-ACK, the port accepts connections
+#define REPLY_CLOSED  1     // RST, the host is up but refuses the port
+#define REPLY_UNREACH 2     // ICMP destination unreachable from the host or a router on the path
+
+// TPACKET_V3 rx ring layout, each block holds variable length frames
+#define RING_BLOCK_SIZE  (1 << 20)
+#define RING_BLOCK_NUM   16
+#define RING_FRAME_SIZE  2048
+#define RING_RETIRE_MS   10
+
+// capture threads of the PACKET_FANOUT mode, each with its own socket, ring and reply queue
+#define MAX_CAPTURE_THREAD 16
+#define REPLY_QUEUE_SIZE   (1 << 16)
+
 // Struct for calculate tcp header checksum
 struct pseudo_header_tcp {
     unsigned int   src_addr;
@@ -36,6 +80,72 @@ struct pseudo_header_tcp {
     struct tcphdr  tcp;
 };
 
+// Prebuilt SYN datagram, one per target, kept in a contiguous template buffer
+struct syn_packet {
+    struct iphdr   ip;
+    struct tcphdr  tcp;
+};
+
+// Send counters of one report period, shared by the batched and single send paths
+struct send_stat {
+    std::atomic<size_t>   packets;
+    std::atomic<size_t>   errors;
+    std::atomic<size_t>   syscalls;
+    std::atomic<long int> begin_us;
+    std::atomic<long int> end_us;
+
+    send_stat() { reset(); }
+
+    void reset() {
+        packets  = 0;
+        errors   = 0;
+        syscalls = 0;
+        begin_us = 0;
+        end_us   = 0;
+    }
+
+    void mark(long int b_us, long int e_us) {
+        long int cur = begin_us.load();
+        while ((cur == 0 || b_us < cur) && !begin_us.compare_exchange_weak(cur, b_us)) {}
+        cur = end_us.load();
+        while (e_us > cur && !end_us.compare_exchange_weak(cur, e_us)) {}
+    }
+
+    long int span_us() const {
+        return end_us - begin_us;
+    }
+
+    double pps() const {
+        long int span = span_us();
+        return span > 0 ? packets * 1000000.0 / span : 0.0;
+    }
+};
+
+// One captured SYN-ACK addressed to us, decoded but not yet matched to a probe
+struct reply_rec {
+    uint32_t isn;       // sequence number of the probe answered, the probe cookie
+    uint32_t ip;        // probed target
+    uint16_t port;
+    uint16_t kind;      // REPLY_*
+    uint16_t lport;     // source port of the probe answered, network byte order
+    int64_t  rx_ns;     // kernel receive timestamp
+};
+
+// A capture socket with its rx ring, used by one thread only
+struct capture_ctx {
+    int           fd;
+    char         *ring;
+    size_t        ring_size;
+    unsigned int  ring_block;
+};
+
+// Kernel counters of the capture sockets from PACKET_STATISTICS, accumulated since start
+struct capture_stat {
+    unsigned long packets;
+    unsigned long drops;
+    unsigned long freezes;
+};
+
 // Class to store different types of ip & port
 class host_addr {
     public:
@@ -77,46 +187,179 @@ class host_addr {
 // Class for sending syn packet & capture ack packet
 class host_prob {
     public:
-        host_prob(int, uint16_t);
+        host_prob(int, uint16_t, int, int, int, uint16_t);
         ~host_prob();
 
-        int detect(const host_addr &);
-        std::string capture();
+        // targets are addressed by their id in the target table, replies resolve back to it by the probe cookie
+        int load_targets(const TargetTable &);
+
+        int detect(uint32_t);
+
+        // batched send path: templates are built once per target, sent with sendmmsg
+        int detect_batch(const uint32_t *, size_t);
+
+        // probes of addresses swept by target rules, built on the fly and sent from the calling thread
+        int detect_sweep(const sweep_addr *, size_t);
 
+        // drain every reply available now, calling on_reply(target id, rtt in us, REPLY_*) for each, return count of replies
+        // rtt is the kernel receive timestamp of the reply minus the send time of the probe
+        // besides SYN-ACKs, RSTs and ICMP unreachables quoting a probe are replies too, telling the port is down
+        template<class F>
+        int capture_all(F&& on_reply);
+        // same, besides on_sweep(ip, port, REPLY_*) is called for replies to sweep probes, ip & port in network byte order
+        template<class F, class G>
+        int capture_all(F&& on_reply, G&& on_sweep);
+        bool get_capture_stat(capture_stat &);
+
+        // sends of the current probe of a target so far, retransmissions included, a reply to any of them answers it
+        void set_tries(uint32_t id, int n) { if (id < tries.size()) tries[id] = (uint8_t)n; }
+
+        // fd to wait on for replies: the capture socket, or an eventfd signalled by the capture threads
         int get_recv_fd() { return this->recv_fd;}
+        send_stat& get_send_stat() { return this->stat; }
+        size_t get_send_queue() const { return this->send_pool.queue_size(); }
+
+    protected:
+        // hot paths of sending and capturing, timed by bench/micro from a subclass
+        unsigned short calc_tcp_csum(uint16_t *, int);
+        char* prep_tcp_packet(const struct sockaddr_in &, const host_addr &, uint32_t, int);
+        void patch_template(uint32_t);
+        int parse_frame(const char *, size_t);
+        const syn_packet& get_template(uint32_t id) const { return this->templates[id]; }
+        const host_addr& get_local_addr() const { return this->local_addr; }
 
     private:
         // util functions
-        unsigned short calc_tcp_csum(uint16_t *, int);
-        char* prep_tcp_packet(const host_addr &, const host_addr &, int);
+        unsigned short update_csum(unsigned short, uint16_t, uint16_t);
+        void fill_tcp_packet(char *, const struct sockaddr_in &, const host_addr &, uint32_t, int);
         bool get_local_ip(char *, size_t);
+        long int get_cur_us();
+        int64_t get_real_ns();
+        uint32_t reply_rtt_us(uint32_t, int64_t);
 
         // functions for sending & capturing packet
         int create_detect_socket();
-        int create_capture_socket();
+        int get_detect_socket();
+        bool create_capture_socket(capture_ctx &);
+        bool setup_rx_ring(capture_ctx &);
+        bool join_fanout(int);
+        int get_link_type(int);
+        int net_offset(const char *, size_t) const;
+        ssize_t recv_frame(int, char *, size_t, int64_t &);
+        template<class F>
+        void drain_socket(capture_ctx &, F&&);
+        void capture_loop(size_t);
+        int send_chunk(const uint32_t *, size_t);
+        int send_msgs(int, struct mmsghdr *, unsigned int, size_t &, int);
+        uint16_t source_port(uint32_t, uint32_t) const;
+        void set_source_port(syn_packet &, uint16_t);
+        bool own_port(uint16_t) const;
+        bool decode_frame(const char *, size_t, int64_t, reply_rec &) const;
+        int match_reply(const reply_rec &);
+        bool decode_icmp(const char *, size_t, reply_rec &) const;
 
     private:
         ThreadPool send_pool;
+        size_t     send_threads;
         host_addr  local_addr;
+        uint16_t   port_num;    // probes rotate over port_num source ports from the port of local_addr
+        char       local_iface[IFNAMSIZ];
+        int        link_type;
         int        recv_fd;
+        int        capture_mode;
+
+        std::vector<capture_ctx>  caps;
+        capture_stat              cap_stat;
+
+        // PACKET_FANOUT mode: capture threads decode replies into their queues and signal event_fd
+        int                                                   event_fd;
+        std::vector<std::thread>                              cap_threads;
+        std::vector< std::unique_ptr< SpscQueue<reply_rec> > > reply_queues;
+        std::atomic<bool>                                     cap_stop;
+
+        const TargetTable               *targets;
+        std::vector<syn_packet>          templates;
+        std::vector<struct sockaddr_in>  tmpl_dst;
+        std::vector<uint32_t>            gens;      // bumped by every send, each one has a cookie and source port of its own
+        std::vector<uint8_t>             tries;     // sends of the current probe, the last tries generations are in flight
+        std::vector<int64_t>             sent_ns;
+        int                              sweep_fd;
+        std::vector<syn_packet>          sweep_pkts;
+        std::vector<struct sockaddr_in>  sweep_dst;
+        probe_cookie                     cookie;
+        send_stat                        stat;
 };
 
-host_prob::host_prob(int send_thread_num = MAX_SEND_THERAD, uint16_t capture_port = LOCAL_PORT) : send_pool(send_thread_num) {
+// cookie_ns below 0 keeps the random namespace, instances sharing a host and capture port must not have the same one
+// probes go out from port_num source ports starting at capture_port, replies to any of them are captured
+host_prob::host_prob(int send_thread_num = MAX_SEND_THERAD, uint16_t capture_port = LOCAL_PORT, int mode = CAPTURE_RING, int capture_threads = 1,
+    int cookie_ns = -1, uint16_t port_count = 1) :
+    send_pool(send_thread_num), send_threads(send_thread_num), port_num(port_count), link_type(-1), recv_fd(-1), capture_mode(mode), event_fd(-1), cap_stop(false), targets(NULL), sweep_fd(-1) {
+    memset(&cap_stat, 0, sizeof(cap_stat));
+    if (cookie_ns >= 0) cookie.set_ns((uint32_t)cookie_ns);
+
     char local_ip[INET_ADDRSTRLEN] = {'\0', };
     if (!get_local_ip(local_ip, INET_ADDRSTRLEN)) {
         throw std::runtime_error("Failed to get local ip");
     }
 
     local_addr.fill(std::string(local_ip), capture_port);
+    if (port_num < 1 || capture_port + port_num - 1 > 0xffff) {
+        throw std::runtime_error("Invalid source port range");
+    }
 
-    recv_fd = create_capture_socket();
-    if (recv_fd < 0) {
-        throw std::runtime_error("Failed to create recv socket");
+    if (capture_threads < 1) capture_threads = 1;
+    if (capture_threads > MAX_CAPTURE_THREAD) capture_threads = MAX_CAPTURE_THREAD;
+    caps.resize(capture_threads);
+    for (size_t i = 0; i < caps.size(); ++i) {
+        if (!create_capture_socket(caps[i])) {
+            throw std::runtime_error("Failed to create recv socket");
+        }
+        if (caps.size() > 1 && !join_fanout(caps[i].fd)) {
+            throw std::runtime_error("Failed to join capture socket into fanout group");
+        }
     }
+    if (caps.size() == 1) {
+        recv_fd = caps[0].fd;
+        return;
+    }
+
+    // the kernel spreads replies over the sockets by flow hash, each socket is drained by its own pinned thread
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        throw std::runtime_error("Failed to create eventfd");
+    }
+    recv_fd = event_fd;
+    long int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (size_t i = 0; i < caps.size(); ++i) {
+        reply_queues.emplace_back(new SpscQueue<reply_rec>(REPLY_QUEUE_SIZE));
+    }
+    for (size_t i = 0; i < caps.size(); ++i) {
+        cap_threads.emplace_back([this, i] { this->capture_loop(i); });
+
+        // leave cpu 0 to the probe loop when there are enough cores
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        int cpu = (cpus > 1) ? (int)((i + 1) % cpus) : 0;
+        CPU_SET(cpu, &cpu_set);
+        if (pthread_setaffinity_np(cap_threads.back().native_handle(), sizeof(cpu_set), &cpu_set) != 0) {
+            fprintf(stderr, "WARNING: Pin capture thread %zu to cpu %d failed\n", i, cpu);
+        }
+    }
+    fprintf(stderr, "NOTICE: Capture with %zu threads in fanout group\n", caps.size());
 }
 
 host_prob::~host_prob() {
-    if(this->recv_fd) close(recv_fd);
+    cap_stop = true;
+    for (std::thread &t : cap_threads) {
+        t.join();
+    }
+    for (size_t i = 0; i < caps.size(); ++i) {
+        if (caps[i].ring) munmap(caps[i].ring, caps[i].ring_size);
+        if (caps[i].fd >= 0) close(caps[i].fd);
+    }
+    if (event_fd >= 0) close(event_fd);
+    if (sweep_fd >= 0) close(sweep_fd);
 }
 
 /*
@@ -150,12 +393,29 @@ unsigned short host_prob::calc_tcp_csum(uint16_t *ptr, int pkt_len) {
     return((short)~csum);
 }
 
-char* host_prob::prep_tcp_packet(const host_addr &dst, const host_addr &src, int scan_type = SYN_SCAN) {
-    struct iphdr *ip_header = NULL;
-    struct tcphdr *tcp_header = NULL;
+/*
+ * Ref: https://tools.ietf.org/html/rfc1624
+ * Incrementally update a checksum when one 16-bit word of the covered data changes from old_val to new_val:
+ * HC' = ~(~HC + ~m + m'). Both values are taken as stored in the packet, so no byte order conversion is needed.
+ */
+unsigned short host_prob::update_csum(unsigned short csum, uint16_t old_val, uint16_t new_val) {
+    uint32_t sum = (uint16_t)~csum + (uint16_t)~old_val + new_val;
+    sum = (sum>>16) + (sum & 0xffff);
+    sum = sum + (sum>>16);
+    return (unsigned short)~sum;
+}
 
+char* host_prob::prep_tcp_packet(const struct sockaddr_in &dst, const host_addr &src, uint32_t seq, int scan_type = SYN_SCAN) {
     //Datagram to represent the packet
     char *datagram = (char*)calloc(4096,sizeof(char));
+    fill_tcp_packet(datagram, dst, src, seq, scan_type);
+    return datagram;
+}
+
+// datagram must hold at least a zeroed syn_packet
+void host_prob::fill_tcp_packet(char *datagram, const struct sockaddr_in &dst, const host_addr &src, uint32_t seq, int scan_type = SYN_SCAN) {
+    struct iphdr *ip_header = NULL;
+    struct tcphdr *tcp_header = NULL;
 
     //IP header
     ip_header = (struct iphdr *) datagram;
@@ -167,20 +427,20 @@ char* host_prob::prep_tcp_packet(const host_addr &dst, const host_addr &src, int
     ip_header->ihl      = 5;
     ip_header->version  = 4;
     ip_header->tos      = 0;
-    ip_header->tot_len  = sizeof (struct iphdr) + sizeof (struct tcphdr);
+    ip_header->tot_len  = htons(sizeof (struct iphdr) + sizeof (struct tcphdr));
     ip_header->id       = htons(9999); //to identify our packets easily on the wire in tcpdump
     ip_header->frag_off = htons(0);
     ip_header->ttl      = 64;
     ip_header->protocol = IPPROTO_TCP;
     ip_header->check    = 0;
-    ip_header->saddr    = inet_addr(src.ip);
-    ip_header->daddr    = inet_addr(dst.ip);
-    ip_header->check    = calc_tcp_csum((uint16_t *) datagram, ip_header->tot_len >> 1);
+    ip_header->saddr    = src.addr.sin_addr.s_addr;
+    ip_header->daddr    = dst.sin_addr.s_addr;
+    ip_header->check    = calc_tcp_csum((uint16_t *) datagram, sizeof(struct iphdr));
 
     //TCP Header
     tcp_header->source  = htons(src.port);
-    tcp_header->dest    = htons(dst.port);
-    tcp_header->seq     = htonl(888888); //to identify our packets easily on the wire in tcpdump
+    tcp_header->dest    = dst.sin_port;
+    tcp_header->seq     = htonl(seq); //probe cookie, identifies the target and probe of the reply
     tcp_header->ack_seq = 0;
     tcp_header->doff    = sizeof(struct tcphdr)/4;
     tcp_header->fin     = 0;
@@ -215,8 +475,8 @@ char* host_prob::prep_tcp_packet(const host_addr &dst, const host_addr &src, int
 
     //Pseudo tcp header;
     struct pseudo_header_tcp psh;
-    psh.src_addr    = inet_addr( src.ip );
-    psh.dst_addr    = inet_addr( dst.ip );
+    psh.src_addr    = src.addr.sin_addr.s_addr;
+    psh.dst_addr    = dst.sin_addr.s_addr;
     psh.placeholder = 0;
     psh.protocol    = IPPROTO_TCP;
     psh.tcp_len     = htons( sizeof(struct tcphdr) );
@@ -232,13 +492,13 @@ char* host_prob::prep_tcp_packet(const host_addr &dst, const host_addr &src, int
        tcp_header->syn, tcp_header->ack, tcp_header->fin, ntohl(tcp_header->seq)
     );
     */
-    return datagram;
 }
 
 bool host_prob::get_local_ip(char* ip, size_t len) {
     if (len < INET_ADDRSTRLEN) return false;
 
-    char iface[8] = {'\0', };
+    char *iface = this->local_iface;
+    memset(iface, 0, IFNAMSIZ);
     FILE *f = fopen("/proc/net/route", "r");
     if (!f) {
         fprintf(stderr, "ERROR: open /proc/net/route failed\n");
@@ -247,7 +507,7 @@ bool host_prob::get_local_ip(char* ip, size_t len) {
 
     char dest[64] = {0, };
     while (!feof(f)) {
-        if (fscanf(f, "%s %s %*[^\r\n]%*c", iface, dest) != 2) continue;
+        if (fscanf(f, "%15s %63s %*[^\r\n]%*c", iface, dest) != 2) continue;
         if (strcmp(dest, "00000000") == 0) {
             fprintf(stderr, "DEBUG: Default iface is %s\n", iface);
             break;
@@ -291,60 +551,331 @@ int host_prob::create_detect_socket() {
     return send_socket;
 }
 
-int host_prob::detect(const host_addr &dst) {
-    this->send_pool.enqueue([&] ()->int{
-        // using thread_local to hold the socket for each thread
-        static thread_local int send_fd = create_detect_socket();
+int host_prob::get_detect_socket() {
+    // using thread_local to hold the socket for each thread
+    static thread_local int send_fd = create_detect_socket();
+    return send_fd;
+}
+
+long int host_prob::get_cur_us() {
+    struct timespec _cur_ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &_cur_ts);
+    return _cur_ts.tv_sec*1000000 + _cur_ts.tv_nsec/1000;
+}
+
+// Wall clock, same as the kernel timestamps of captured packets
+int64_t host_prob::get_real_ns() {
+    struct timespec _cur_ts;
+    clock_gettime(CLOCK_REALTIME, &_cur_ts);
+    return (int64_t)_cur_ts.tv_sec*1000000000 + _cur_ts.tv_nsec;
+}
+
+// Karn: once a probe went out again, a reply may answer an earlier send or be a SYN-ACK the target
+// retransmitted, no time is taken from it
+uint32_t host_prob::reply_rtt_us(uint32_t id, int64_t rx_ns) {
+    if (tries[id] > 1) return 0;
+    int64_t rtt_ns = rx_ns - sent_ns[id];
+    // the wall clock may step back between send and receive
+    if (rtt_ns < 0) return 0;
+    return (rtt_ns / 1000 > 0xffffffffLL) ? 0xffffffffu : (uint32_t)(rtt_ns / 1000);
+}
+
+int host_prob::detect(uint32_t id) {
+    struct sockaddr_in dst = targets->sock_addr(id);
+    uint32_t seq = cookie.make(id, ++gens[id], dst.sin_addr.s_addr, dst.sin_port);
+    uint16_t sport = source_port(id, gens[id]);
+    sent_ns[id] = get_real_ns();
+    // everything the task needs is copied into it, nothing refers to the caller's frame
+    this->send_pool.submit([this, dst, seq, sport] () {
+        int send_fd = get_detect_socket();
         if (send_fd < 0) {
             fprintf(stderr, "ERROR: creaet send socket failed\n");
-            return -1;
+            return;
         }
         //fprintf(stderr, "DEBUG: using send socket %d\n", send_fd);
 
-        char *packet = prep_tcp_packet(dst, this->local_addr);
-        ssize_t bytes_sent = sendto(send_fd, packet, sizeof(struct iphdr) + sizeof(struct tcphdr), 0,
-            (struct sockaddr *)&(dst.addr), sizeof(dst.addr)
+        long int begin_us = get_cur_us();
+        syn_packet packet;
+        memset(&packet, 0, sizeof(packet));
+        fill_tcp_packet((char*)&packet, dst, this->local_addr, seq);
+        set_source_port(packet, sport);
+        ssize_t bytes_sent = sendto(send_fd, &packet, sizeof(packet), 0,
+            (struct sockaddr *)&dst, sizeof(dst)
         );
-        free(packet);
 
+        ++this->stat.syscalls;
+        this->stat.mark(begin_us, get_cur_us());
+        metrics().add(M_SEND_SYSCALLS);
         if (bytes_sent < 0) {
-            fprintf(stderr, "ERROR: Send datagram to %s:%d failed\n", dst.ip, dst.port);
-            return -3;
+            ++this->stat.errors;
+            metrics().add(M_SEND_ERRORS);
+            fprintf(stderr, "ERROR: Send datagram to %s:%d failed\n", inet_ntoa(dst.sin_addr), ntohs(dst.sin_port));
+            return;
         }
-
-        return 0;
+        ++this->stat.packets;
+        metrics().add(M_PROBES_SENT);
     });
 
     return 0;
 }
 
-int host_prob::create_capture_socket() {
-    // sudo tcpdump -dd -i eth0 'tcp and tcp[tcpflags] & (tcp-syn|tcp-ack) != 0 and tcp[8:4] = 888889'
-    // generate lsf code for packet which travel through device eth0
-    static struct sock_filter tcp_filter [] = {
-        { 0x28, 0, 0, 0x0000000c },
-        { 0x15, 11, 0, 0x000086dd },
-        { 0x15, 0, 10, 0x00000800 },
-        { 0x30, 0, 0, 0x00000017 },
-        { 0x15, 0, 8, 0x00000006 },
-        { 0x28, 0, 0, 0x00000014 },
-        { 0x45, 6, 0, 0x00001fff },
-        { 0xb1, 0, 0, 0x0000000e },
-        { 0x50, 0, 0, 0x0000001b },
-        { 0x45, 0, 3, 0x00000012 },
-        { 0x40, 0, 0, 0x00000016 },
-        { 0x15, 0, 1, 0x000d9039 },
-        { 0x6, 0, 0, 0x0000ffff },
-        { 0x6, 0, 0, 0x00000000 },
-    };
-
-    // Because using lsf we need to create an ETH_PACKET capture socket
-    // Because raw socket receive all packets flow through cur device
-    // We need only one raw socket to deal with ack packets, so here use static variable
-    static int recv_socket = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+// Build SYN templates of the targets added since the last load, templates are indexed by target id
+// return number of templates rebuilt
+int host_prob::load_targets(const TargetTable &table) {
+    targets = &table;
+    templates.resize(table.capacity());
+    tmpl_dst.resize(table.capacity());
+    gens.resize(table.capacity(), 0);
+    tries.resize(table.capacity(), 0);
+    sent_ns.resize(table.capacity(), 0);
+
+    const std::vector<uint32_t> &changes = table.changes();
+    for (size_t i = 0; i < changes.size(); ++i) {
+        uint32_t id = changes[i];
+        // a new service or interval leaves the packet as it is, and the probe in flight still matches
+        if (table.change_of(id) == TargetTable::CHANGE_UPDATED) continue;
+        memset(&templates[id], 0, sizeof(syn_packet));
+        memset(&tmpl_dst[id], 0, sizeof(struct sockaddr_in));
+        gens[id] = 0;
+        tries[id] = 0;
+        if (table.alive(id)) {
+            tmpl_dst[id] = table.sock_addr(id);
+            fill_tcp_packet((char*)&templates[id], tmpl_dst[id], this->local_addr, 0);
+        }
+    }
+
+    return (int)changes.size();
+}
+
+// Send templates of the given targets with sendmmsg, SEND_BATCH_SIZE datagrams per syscall
+int host_prob::send_chunk(const uint32_t *ids, size_t num) {
+    int send_fd = get_detect_socket();
+    if (send_fd < 0) {
+        fprintf(stderr, "ERROR: creaet send socket failed\n");
+        return -1;
+    }
+
+    struct mmsghdr msgs[SEND_BATCH_SIZE];
+    struct iovec   iovs[SEND_BATCH_SIZE];
+    memset(msgs, 0, sizeof(msgs));
+
+    long int begin_us = get_cur_us();
+    int failed = 0;
+    size_t syscalls = 0;
+    size_t pos = 0;
+    while (pos < num) {
+        unsigned int cnt = 0;
+        int64_t now_ns = get_real_ns();
+        for (; pos < num && cnt < SEND_BATCH_SIZE; ++pos) {
+            uint32_t id = ids[pos];
+            sent_ns[id] = now_ns;
+            iovs[cnt].iov_base             = &templates[id];
+            iovs[cnt].iov_len              = sizeof(syn_packet);
+            msgs[cnt].msg_hdr.msg_name     = &tmpl_dst[id];
+            msgs[cnt].msg_hdr.msg_namelen  = sizeof(struct sockaddr_in);
+            msgs[cnt].msg_hdr.msg_iov      = &iovs[cnt];
+            msgs[cnt].msg_hdr.msg_iovlen   = 1;
+            ++cnt;
+        }
+        failed += send_msgs(send_fd, msgs, cnt, syscalls, 0);
+    }
+    this->stat.mark(begin_us, get_cur_us());
+
+    // one update per chunk keeps the metrics off the per packet path
+    metrics().add(M_SEND_SYSCALLS, syscalls);
+    metrics().add(M_SEND_ERRORS, failed);
+    metrics().add(M_PROBES_SENT, num - failed);
+
+    return failed;
+}
+
+// Send a batch of prepared messages, return number of datagrams the kernel refused
+// with MSG_DONTWAIT the rest of the batch is given up once the socket buffer is full
+int host_prob::send_msgs(int send_fd, struct mmsghdr *msgs, unsigned int cnt, size_t &syscalls, int flags) {
+    int failed = 0;
+    unsigned int off = 0;
+    while (off < cnt) {
+        int sent = sendmmsg(send_fd, msgs + off, cnt - off, flags);
+        ++this->stat.syscalls;
+        ++syscalls;
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                failed += cnt - off;
+                this->stat.errors += cnt - off;
+                break;
+            }
+            // skip the datagram which the kernel refused, continue with the rest
+            sent = 1;
+            ++failed;
+            ++this->stat.errors;
+        } else {
+            this->stat.packets += sent;
+        }
+        off += sent;
+    }
+    return failed;
+}
+
+// Start a new generation of the target for its next send: ip id, the probe cookie in tcp seq and the source port
+// change, the checksums are updated incrementally
+void host_prob::patch_template(uint32_t id) {
+    uint32_t gen = ++gens[id];
+
+    struct iphdr &iph = templates[id].ip;
+    uint16_t old_id = iph.id;
+    uint16_t new_id = htons((gen & 0xffff) ? (gen & 0xffff) : 1);
+    iph.check = update_csum(iph.check, old_id, new_id);
+    iph.id    = new_id;
+
+    struct tcphdr &tcph = templates[id].tcp;
+    uint32_t old_seq = tcph.seq;
+    uint32_t new_seq = htonl(cookie.make(id, gen, iph.daddr, tcph.dest));
+    tcph.check = update_csum(tcph.check, (uint16_t)old_seq, (uint16_t)new_seq);
+    tcph.check = update_csum(tcph.check, (uint16_t)(old_seq >> 16), (uint16_t)(new_seq >> 16));
+    tcph.seq   = new_seq;
+    if (port_num > 1) set_source_port(templates[id], source_port(id, gen));
+}
+
+// Source port of a probe generation of the target, network byte order
+// Consecutive probes of a target, retransmits included, leave from different ports, so each one is a
+// 4-tuple of its own to conntrack and middleboxes on the path, and targets spread over the whole range.
+uint16_t host_prob::source_port(uint32_t id, uint32_t gen) const {
+    return htons((uint16_t)(local_addr.port + (id + gen) % port_num));
+}
+
+void host_prob::set_source_port(syn_packet &packet, uint16_t port) {
+    packet.tcp.check  = update_csum(packet.tcp.check, packet.tcp.source, port);
+    packet.tcp.source = port;
+}
+
+// port in network byte order is one of the source ports
+bool host_prob::own_port(uint16_t port) const {
+    return (uint16_t)(ntohs(port) - local_addr.port) < port_num;
+}
+
+// Patch the templates of the given live targets, then send them in chunks across the send pool,
+// the calling thread sends chunks too, return number of datagrams failed to send
+int host_prob::detect_batch(const uint32_t *ids, size_t num) {
+    if (!targets || num == 0) return 0;
+
+    for (size_t i = 0; i < num; ++i) {
+        patch_template(ids[i]);
+    }
+
+    // a few chunks per thread, so threads which finish early steal the rest
+    size_t chunk = num / (send_threads * 4);
+    if (chunk < SEND_CHUNK_MIN) chunk = SEND_CHUNK_MIN;
+
+    std::atomic<int> failed(0);
+    this->send_pool.run_range(num, chunk, [this, ids, &failed] (size_t begin, size_t end) {
+        int ret = this->send_chunk(ids + begin, end - begin);
+        failed += (ret < 0) ? (int)(end - begin) : ret;
+    });
+    return failed;
+}
+
+// Send SYN probes to the addresses swept by target rules, they have no target slot and no template, so the
+// packets are built here and carry the sweep index in their cookie, return number of datagrams failed to send
+// Sweeps have a socket of their own, never waited on: probes to absent hosts on the link hold its send buffer
+// while their neighbour resolution fails, they must not hold up the probes of targets.
+int host_prob::detect_sweep(const sweep_addr *addrs, size_t num) {
+    if (num == 0) return 0;
+    if (sweep_fd < 0 && (sweep_fd = create_detect_socket()) < 0) {
+        fprintf(stderr, "ERROR: creaet send socket failed\n");
+        return (int)num;
+    }
+
+    if (sweep_pkts.size() < SEND_BATCH_SIZE) {
+        sweep_pkts.resize(SEND_BATCH_SIZE);
+        sweep_dst.resize(SEND_BATCH_SIZE);
+    }
+    struct mmsghdr msgs[SEND_BATCH_SIZE];
+    struct iovec   iovs[SEND_BATCH_SIZE];
+    memset(msgs, 0, sizeof(msgs));
+
+    long int begin_us = get_cur_us();
+    int failed = 0;
+    size_t syscalls = 0;
+    size_t pos = 0;
+    while (pos < num) {
+        unsigned int cnt = 0;
+        for (; pos < num && cnt < SEND_BATCH_SIZE; ++pos) {
+            struct sockaddr_in &dst = sweep_dst[cnt];
+            memset(&dst, 0, sizeof(dst));
+            dst.sin_family      = AF_INET;
+            dst.sin_port        = addrs[pos].port;
+            dst.sin_addr.s_addr = addrs[pos].ip;
+            memset(&sweep_pkts[cnt], 0, sizeof(syn_packet));
+            fill_tcp_packet((char*)&sweep_pkts[cnt], dst, this->local_addr,
+                cookie.make(probe_cookie::sweep_index, 0, dst.sin_addr.s_addr, dst.sin_port));
+            if (port_num > 1) set_source_port(sweep_pkts[cnt], source_port(ntohl(dst.sin_addr.s_addr), dst.sin_port));
+
+            iovs[cnt].iov_base             = &sweep_pkts[cnt];
+            iovs[cnt].iov_len              = sizeof(syn_packet);
+            msgs[cnt].msg_hdr.msg_name     = &dst;
+            msgs[cnt].msg_hdr.msg_namelen  = sizeof(struct sockaddr_in);
+            msgs[cnt].msg_hdr.msg_iov      = &iovs[cnt];
+            msgs[cnt].msg_hdr.msg_iovlen   = 1;
+            ++cnt;
+        }
+        failed += send_msgs(sweep_fd, msgs, cnt, syscalls, MSG_DONTWAIT);
+    }
+    this->stat.mark(begin_us, get_cur_us());
+
+    metrics().add(M_SEND_SYSCALLS, syscalls);
+    metrics().add(M_SEND_ERRORS, failed);
+    metrics().add(M_PROBES_SENT, num - failed);
+    metrics().add(M_SWEEP_PROBES, num - failed);
+
+    return failed;
+}
+
+bool host_prob::create_capture_socket(capture_ctx &ctx) {
+    ctx.fd         = -1;
+    ctx.ring       = NULL;
+    ctx.ring_size  = 0;
+    ctx.ring_block = 0;
+
+    // Created with no protocol so nothing is queued before the filter is attached and the socket is bound,
+    // then bound to ipv4 on the interface of the local ip, so our own outgoing syns never reach the filter
+    int recv_socket = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
     if (recv_socket < 0) {
         fprintf(stderr, "ERROR: Create recv socket failed\n");
-        return -1;
+        return false;
+    }
+    ctx.fd = recv_socket;
+
+    unsigned int ifindex = if_nametoindex(this->local_iface);
+    if (ifindex == 0) {
+        fprintf(stderr, "ERROR: Get index of iface %s failed, %s\n", this->local_iface, strerror(errno));
+        return false;
+    }
+    if (this->link_type < 0) {
+        this->link_type = get_link_type(recv_socket);
+    }
+
+    // only syn-acks to our address and capture port which carry our cookie namespace pass
+    std::vector<struct sock_filter> tcp_filter;
+    reply_filter_spec spec;
+    spec.link_type    = this->link_type;
+    spec.local_ip     = this->local_addr.addr.sin_addr.s_addr;
+    spec.port_lo      = ntohs(this->local_addr.addr.sin_port);
+    spec.port_hi      = spec.port_lo + port_num - 1;
+    spec.cookie_ns    = cookie.ns();
+    spec.cookie_shift = COOKIE_TAG_BITS + COOKIE_IDX_BITS;
+    if (!build_reply_filter(spec, tcp_filter)) {
+        fprintf(stderr, "ERROR: Can't build lsf filter for link type %d of iface %s\n", this->link_type, this->local_iface);
+        return false;
+    }
+
+    // Attach lsf filter
+    struct sock_fprog filter;
+    filter.len    = tcp_filter.size();
+    filter.filter = tcp_filter.data();
+    if (setsockopt(recv_socket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) < 0) {
+        fprintf(stderr, "ERROR: Can't set lsf filter for recv socket\n");
+        return false;
     }
 
     // Set larger SO_RCVBUF so that it can hold more packets
@@ -352,66 +883,403 @@ int host_prob::create_capture_socket() {
     unsigned int optLen = sizeof(optVal);
     if (setsockopt(recv_socket, SOL_SOCKET, SO_RCVBUF, &optVal, optLen) < 0) {
         fprintf(stderr, "ERROR: Cant't set recv buf for recv socket\n");
-        return -1;
+        return false;
     }
 
-    // Attach lsf filter
-    struct sock_fprog filter;
-    filter.len    = sizeof(tcp_filter)/sizeof(struct sock_filter);
-    filter.filter = tcp_filter;
-    if (setsockopt(recv_socket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) < 0) {
-        fprintf(stderr, "ERROR: Can't set lsf filter for recv socket\n");
-        return -1;
+    // frames read by recvmsg carry the kernel receive time, the ring has it in every frame header
+    int one = 1;
+    if (capture_mode != CAPTURE_RING && setsockopt(recv_socket, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "WARNING: Can't enable SO_TIMESTAMPNS, latency includes user space delay\n");
+    }
+
+    if (capture_mode == CAPTURE_RING && !setup_rx_ring(ctx)) {
+        fprintf(stderr, "ERROR: Can't setup rx ring for recv socket\n");
+        return false;
+    }
+
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    sll.sll_ifindex  = ifindex;
+    if (bind(recv_socket, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        fprintf(stderr, "ERROR: Bind recv socket to iface %s failed, %s\n", this->local_iface, strerror(errno));
+        return false;
     }
 
-    return recv_socket;
+    return true;
 }
 
-std::string host_prob::capture() {
-    char recv_buf[ETH_FRAME_LEN];
-    memset(recv_buf, 0, ETH_FRAME_LEN);
+// ARPHRD_* link type of the local iface, the capture filter and frame parsing depend on its link header
+int host_prob::get_link_type(int fd) {
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    memcpy(ifr.ifr_name, this->local_iface, IFNAMSIZ);
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+        fprintf(stderr, "WARNING: Get link type of iface %s failed, %s, assume ethernet\n", this->local_iface, strerror(errno));
+        return ARPHRD_ETHER;
+    }
+    fprintf(stderr, "DEBUG: Link type of iface %s is %d\n", this->local_iface, ifr.ifr_hwaddr.sa_family);
+    return ifr.ifr_hwaddr.sa_family;
+}
+
+// Join the socket into the fanout group of this process, replies of one flow always go to the same socket
+bool host_prob::join_fanout(int fd) {
+    int group = getpid() & 0xffff;
+    int arg = group | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+        fprintf(stderr, "ERROR: Join fanout group %d failed, %s\n", group, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Map a TPACKET_V3 rx ring on the capture socket, the kernel writes frames into blocks shared with us
+// so replies are read in place without recvfrom and without copying
+bool host_prob::setup_rx_ring(capture_ctx &ctx) {
+    int version = TPACKET_V3;
+    if (setsockopt(ctx.fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        fprintf(stderr, "ERROR: Set TPACKET_V3 failed, %s\n", strerror(errno));
+        return false;
+    }
+
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size       = RING_BLOCK_SIZE;
+    req.tp_block_nr         = RING_BLOCK_NUM;
+    req.tp_frame_size       = RING_FRAME_SIZE;
+    req.tp_frame_nr         = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * RING_BLOCK_NUM;
+    req.tp_retire_blk_tov   = RING_RETIRE_MS;
+    req.tp_feature_req_word = 0;
+    if (setsockopt(ctx.fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        fprintf(stderr, "ERROR: Set PACKET_RX_RING failed, %s\n", strerror(errno));
+        return false;
+    }
+
+    size_t ring_size = (size_t)req.tp_block_size * req.tp_block_nr;
+    void *addr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, ctx.fd, 0);
+    if (addr == MAP_FAILED) {
+        // MAP_LOCKED may exceed RLIMIT_MEMLOCK, the ring still works unlocked
+        addr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ctx.fd, 0);
+    }
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Mmap rx ring failed, %s\n", strerror(errno));
+        return false;
+    }
+
+    ctx.ring       = (char*)addr;
+    ctx.ring_size  = ring_size;
+    ctx.ring_block = 0;
+    return true;
+}
+
+// Hand every frame available now on the socket to on_frame(frame, len, kernel receive timestamp)
+template<class F>
+void host_prob::drain_socket(capture_ctx &ctx, F&& on_frame) {
+    if (!ctx.ring) {
+        char recv_buf[ETH_FRAME_LEN];
+        int64_t rx_ns = 0;
+        while (true) {
+            ssize_t recv_len = recv_frame(ctx.fd, recv_buf, sizeof(recv_buf), rx_ns);
+            if (recv_len < 0) break;
+            on_frame(recv_buf, (size_t)recv_len, rx_ns);
+        }
+        return;
+    }
+
+    // walk every block handed over to user space, then give it back to the kernel
+    while (true) {
+        struct tpacket_block_desc *block = (struct tpacket_block_desc*)(ctx.ring + (size_t)ctx.ring_block * RING_BLOCK_SIZE);
+        if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+            break;
+        }
+
+        unsigned int num_pkts = block->hdr.bh1.num_pkts;
+        struct tpacket3_hdr *frame = (struct tpacket3_hdr*)((char*)block + block->hdr.bh1.offset_to_first_pkt);
+        for (unsigned int i = 0; i < num_pkts; ++i) {
+            // the kernel stamps every frame of the ring on receive
+            int64_t rx_ns = (int64_t)frame->tp_sec*1000000000 + frame->tp_nsec;
+            on_frame((char*)frame + frame->tp_mac, (size_t)frame->tp_snaplen, rx_ns);
+            frame = (struct tpacket3_hdr*)((char*)frame + frame->tp_next_offset);
+        }
+
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        ctx.ring_block = (ctx.ring_block + 1) % RING_BLOCK_NUM;
+    }
+}
+
+// Body of a capture thread in fanout mode: decode replies of its socket into its queue, matching them
+// to probes is left to the probe loop, which owns the probe state
+void host_prob::capture_loop(size_t i) {
+    capture_ctx &ctx = caps[i];
+    SpscQueue<reply_rec> &queue = *reply_queues[i];
+    while (!cap_stop) {
+        struct pollfd pfd;
+        pfd.fd      = ctx.fd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) <= 0) continue;
+
+        int pushed = 0, miss = 0, dropped = 0;
+        drain_socket(ctx, [&](const char *frame, size_t len, int64_t rx_ns) {
+            reply_rec rec;
+            if (!decode_frame(frame, len, rx_ns, rec)) {
+                ++miss;
+            } else if (queue.push(rec)) {
+                ++pushed;
+            } else {
+                ++dropped;
+            }
+        });
+
+        if (miss) metrics().add(M_REPLIES_UNMATCHED, miss);
+        if (dropped) metrics().add(M_CAPTURE_QUEUE_DROPS, dropped);
+        if (pushed) {
+            uint64_t one = 1;
+            if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                fprintf(stderr, "ERROR: Signal capture event failed, %s\n", strerror(errno));
+            }
+        }
+    }
+}
+
+template<class F>
+int host_prob::capture_all(F&& on_reply) {
+    return capture_all(on_reply, [](uint32_t, uint16_t, int) {});
+}
+
+template<class F, class G>
+int host_prob::capture_all(F&& on_reply, G&& on_sweep) {
+    int cnt = 0;
+    int miss = 0;
+    int kinds[3] = {0, 0, 0};
+    if (cap_threads.empty()) {
+        drain_socket(caps[0], [&](const char *frame, size_t len, int64_t rx_ns) {
+            reply_rec rec;
+            int idx = decode_frame(frame, len, rx_ns, rec) ? match_reply(rec) : CAPTURE_MISS;
+            if (idx == CAPTURE_SWEEP) {
+                on_sweep(rec.ip, rec.port, (int)rec.kind);
+                return;
+            }
+            if (idx < 0) {
+                ++miss;
+                return;
+            }
+            on_reply((uint32_t)idx, reply_rtt_us(idx, rx_ns), (int)rec.kind);
+            ++kinds[rec.kind];
+            ++cnt;
+        });
+    } else {
+        uint64_t events = 0;
+        if (read(event_fd, &events, sizeof(events)) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "ERROR: Read capture event failed, %s\n", strerror(errno));
+        }
+        reply_rec rec;
+        for (size_t i = 0; i < reply_queues.size(); ++i) {
+            while (reply_queues[i]->pop(rec)) {
+                int idx = match_reply(rec);
+                if (idx == CAPTURE_SWEEP) {
+                    on_sweep(rec.ip, rec.port, (int)rec.kind);
+                    continue;
+                }
+                if (idx < 0) {
+                    ++miss;
+                    continue;
+                }
+                on_reply((uint32_t)idx, reply_rtt_us(idx, rec.rx_ns), (int)rec.kind);
+                ++kinds[rec.kind];
+                ++cnt;
+            }
+        }
+    }
+
+    metrics().add(M_REPLIES, kinds[REPLY_OPEN]);
+    metrics().add(M_REPLIES_CLOSED, kinds[REPLY_CLOSED]);
+    metrics().add(M_REPLIES_UNREACH, kinds[REPLY_UNREACH]);
+    metrics().add(M_REPLIES_UNMATCHED, miss);
+    return cnt;
+}
+
+// Read PACKET_STATISTICS, the kernel resets its counters on every read so accumulate them here
+bool host_prob::get_capture_stat(capture_stat &st) {
+    for (size_t i = 0; i < caps.size(); ++i) {
+        struct tpacket_stats_v3 kstat;
+        memset(&kstat, 0, sizeof(kstat));
+        socklen_t len = sizeof(kstat);
+        if (getsockopt(caps[i].fd, SOL_PACKET, PACKET_STATISTICS, &kstat, &len) < 0) {
+            fprintf(stderr, "ERROR: Get capture statistics failed, %s\n", strerror(errno));
+            return false;
+        }
+
+        cap_stat.packets += kstat.tp_packets;
+        cap_stat.drops   += kstat.tp_drops;
+        cap_stat.freezes += (capture_mode == CAPTURE_RING) ? kstat.tp_freeze_q_cnt : 0;
+    }
+    st = cap_stat;
+    return true;
+}
+
+// Receive one frame without waiting, rx_ns is set to its kernel receive timestamp(SO_TIMESTAMPNS)
+// return -1 if there is none
+ssize_t host_prob::recv_frame(int fd, char *recv_buf, size_t buf_len, int64_t &rx_ns) {
+    char ctrl_buf[CMSG_SPACE(sizeof(struct timespec))];
 
     struct sockaddr saddr;
-    socklen_t saddr_size = sizeof(saddr);
-    ssize_t recv_len = recvfrom(this->recv_fd, recv_buf, ETH_FRAME_LEN, MSG_DONTWAIT, &saddr, &saddr_size);
+    struct iovec iov;
+    iov.iov_base = recv_buf;
+    iov.iov_len  = buf_len;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name       = &saddr;
+    msg.msg_namelen    = sizeof(saddr);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctrl_buf;
+    msg.msg_controllen = sizeof(ctrl_buf);
+
+    ssize_t recv_len = recvmsg(fd, &msg, MSG_DONTWAIT);
     if (recv_len <= 0) {
-        if (errno != EAGAIN || errno != EWOULDBLOCK) {
+        if (recv_len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
             fprintf(stderr, "ERROR: Revf from socket failed, %s\n", strerror(errno));
         }
-        return "";
+        return -1;
     }
 
-    struct iphdr *iph = (struct iphdr*)(recv_buf + sizeof(struct ethhdr));
+    rx_ns = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            rx_ns = (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+        }
+    }
+    if (rx_ns == 0) {
+        rx_ns = get_real_ns();
+    }
+    return recv_len;
+}
+
+// Decode one captured ethernet frame into rec if it is a syn-ack to our capture port
+// it only reads the frame, so capture threads may call it concurrently
+bool host_prob::decode_frame(const char *frame, size_t frame_len, int64_t rx_ns, reply_rec &rec) const {
+    int nh = net_offset(frame, frame_len);
+    if (nh < 0 || frame_len < nh + sizeof(struct iphdr)) {
+        return false;
+    }
+
+    struct iphdr *iph = (struct iphdr*)(frame + nh);
     unsigned short iph_len = (iph->ihl) * 4;
     if (iph_len < 20) {
         fprintf(stderr, "WARNING: Invalid IP header length: %u bytes\n", iph_len);
-        return "";
-    }
-
-    if (iph->protocol == 6) {
-        struct tcphdr *tcph = (struct tcphdr *)(recv_buf + iph_len + sizeof(struct ethhdr));
-
-        struct in_addr source;
-        source.s_addr = iph->saddr;
-
-        char remote_ip[INET_ADDRSTRLEN] = {'\0',};
-        int  remote_port = 0;
-        inet_ntop(AF_INET, &source, remote_ip, INET_ADDRSTRLEN);
-        remote_port = ntohs(tcph->source);
-
-        if (tcph->syn == 1 && tcph->ack == 1 && iph->daddr == this->local_addr.addr.sin_addr.s_addr && tcph->dest == this->local_addr.addr.sin_port) {
-            /*
-            fprintf(stderr, "MESSAGE: Recv packet from %s:%d with SYN:%d ACK:%d FIN:%d RST:%d ACK_SEQ %d\n",
-                remote_ip, remote_port,
-                tcph->syn,
-                tcph->ack,
-                tcph->fin,
-                tcph->rst,
-                ntohl(tcph->ack_seq)
-            );
-            */
-            return std::string(remote_ip) + ":" + std::to_string(remote_port);
+        return false;
+    }
+
+    if (iph->daddr != this->local_addr.addr.sin_addr.s_addr) {
+        return false;
+    }
+    if (iph->protocol == IPPROTO_ICMP) {
+        rec.rx_ns = rx_ns;
+        return decode_icmp(frame + nh + iph_len, frame_len - nh - iph_len, rec);
+    }
+    if (iph->protocol != 6 || frame_len < nh + iph_len + sizeof(struct tcphdr)) {
+        return false;
+    }
+
+    struct tcphdr *tcph = (struct tcphdr *)(frame + nh + iph_len);
+    if (tcph->ack != 1 || (tcph->syn != 1 && tcph->rst != 1) || !own_port(tcph->dest)) {
+        return false;
+    }
+    /*
+    fprintf(stderr, "MESSAGE: Recv packet from %s:%d with SYN:%d ACK:%d FIN:%d RST:%d ACK_SEQ %d\n",
+        remote_ip, remote_port,
+        tcph->syn,
+        tcph->ack,
+        tcph->fin,
+        tcph->rst,
+        ntohl(tcph->ack_seq)
+    );
+    */
+
+    rec.isn   = ntohl(tcph->ack_seq) - 1;
+    rec.ip    = iph->saddr;
+    rec.port  = tcph->source;
+    rec.lport = tcph->dest;
+    rec.kind  = tcph->syn ? REPLY_OPEN : REPLY_CLOSED;
+    rec.rx_ns = rx_ns;
+    return true;
+}
+
+// Decode an ICMP destination unreachable quoting one of our probes, the quote holds its ip header
+// and the first 8 bytes of its tcp header, enough for the ports and the sequence number
+bool host_prob::decode_icmp(const char *msg, size_t msg_len, reply_rec &rec) const {
+    if (msg_len < 8 + sizeof(struct iphdr) + 8) {
+        return false;
+    }
+    const struct icmphdr *icmph = (const struct icmphdr *)msg;
+    // fragmentation needed is about the path mtu, not about the target
+    if (icmph->type != ICMP_DEST_UNREACH || icmph->code == ICMP_FRAG_NEEDED) {
+        return false;
+    }
+
+    const struct iphdr *orig = (const struct iphdr *)(msg + 8);
+    size_t orig_len = orig->ihl * 4;
+    if (orig_len < 20 || orig->protocol != IPPROTO_TCP || msg_len < 8 + orig_len + 8) {
+        return false;
+    }
+    const struct tcphdr *probe = (const struct tcphdr *)(msg + 8 + orig_len);
+    if (orig->saddr != this->local_addr.addr.sin_addr.s_addr || !own_port(probe->source)) {
+        return false;
+    }
+
+    rec.isn   = ntohl(probe->seq);
+    rec.ip    = orig->daddr;
+    rec.port  = probe->dest;
+    rec.lport = probe->source;
+    rec.kind  = REPLY_UNREACH;
+    return true;
+}
+
+// Offset of the ip header in a captured frame, as the capture filter expects it on the link type of the iface
+int host_prob::net_offset(const char *frame, size_t frame_len) const {
+    int nh = link_header_len(this->link_type);
+    if (nh == (int)sizeof(struct ethhdr) && frame_len >= sizeof(struct ethhdr)) {
+        uint16_t proto = ntohs(((const struct ethhdr *)frame)->h_proto);
+        if (proto == ETH_P_8021Q || proto == ETH_P_8021AD) nh += 4;
+    }
+    return nh;
+}
+
+// Resolve a decoded reply to its target, return the target id if it answers a send of the current probe of the target,
+// CAPTURE_SWEEP if it answers a sweep probe, CAPTURE_MISS otherwise
+int host_prob::match_reply(const reply_rec &rec) {
+    // the cookie resolves the reply to its target, which must be the one it came from,
+    // and must be issued for one of the sends of the current probe of the target
+    uint32_t idx = cookie.index(rec.isn);
+    if (idx == probe_cookie::sweep_index) {
+        return cookie.verify(rec.isn, idx, 0, rec.ip, rec.port) ? CAPTURE_SWEEP : CAPTURE_MISS;
+    }
+    if (idx >= tmpl_dst.size() || tmpl_dst[idx].sin_addr.s_addr != rec.ip || tmpl_dst[idx].sin_port != rec.port) {
+        return CAPTURE_MISS;
+    }
+    // a retransmission must not turn the answer to an earlier send of the same probe into a stale reply,
+    // each send left from its own port, the reply must come back to the port of the send its cookie names.
+    // Sends of earlier probes of the target are stale.
+    uint32_t sends = tries[idx] > 0 ? tries[idx] : 1;
+    for (uint32_t i = 0; i < sends && i <= gens[idx]; ++i) {
+        uint32_t gen = gens[idx] - i;
+        if (cookie.verify(rec.isn, idx, gen, rec.ip, rec.port) && rec.lport == source_port(idx, gen)) {
+            return (int)idx;
         }
     }
-    return "";
+    return CAPTURE_MISS;
+}
+
+// Parse one captured ethernet frame, return the target id if it is a syn-ack to its current probe
+int host_prob::parse_frame(const char *frame, size_t frame_len) {
+    reply_rec rec;
+    if (!decode_frame(frame, frame_len, 0, rec)) {
+        return CAPTURE_MISS;
+    }
+    return match_reply(rec);
 }
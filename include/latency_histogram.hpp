@@ -0,0 +1,131 @@
+#ifndef __LATENCY_HISTOGRAM_HPP__
+#define __LATENCY_HISTOGRAM_HPP__
+
+#include <stdint.h>
+#include <vector>
+
+// Log-linear(HDR style) buckets over microseconds: values below 2^(SUB_BITS+1) have one bucket each,
+// every power of two above is split into 2^SUB_BITS linear buckets, so the relative error stays below 1/2^SUB_BITS
+#define LATENCY_SUB_BITS  3
+#define LATENCY_SUB_NUM   (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS  24    // about 16 s, larger values go to the last bucket
+#define LATENCY_BUCKETS   ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_NUM)
+
+// Connect latency histogram of one target, 16-bit counters allocated on the first sample
+// when a counter would overflow every counter is halved, older samples fade out but the shape stays
+class LatencyHistogram {
+    public:
+        LatencyHistogram() : total(0), max_us(0) {}
+
+        static uint32_t bucket_of(uint32_t us) {
+            if (us < 2 * LATENCY_SUB_NUM) return us;
+            int msb = 31 - __builtin_clz(us);
+            if (msb >= LATENCY_MAX_BITS) return LATENCY_BUCKETS - 1;
+            int shift = msb - LATENCY_SUB_BITS;
+            return (shift + 1) * LATENCY_SUB_NUM + ((us >> shift) - LATENCY_SUB_NUM);
+        }
+
+        // highest value which falls into the bucket
+        static uint32_t bucket_value(uint32_t idx) {
+            if (idx < 2 * LATENCY_SUB_NUM) return idx;
+            int shift = idx / LATENCY_SUB_NUM - 1;
+            uint32_t sub = idx % LATENCY_SUB_NUM + LATENCY_SUB_NUM;
+            return ((sub + 1) << shift) - 1;
+        }
+
+        void record(uint32_t us) {
+            if (counts.empty()) {
+                counts.resize(LATENCY_BUCKETS, 0);
+            }
+            uint16_t &cnt = counts[bucket_of(us)];
+            if (cnt == 0xffff) {
+                total = 0;
+                for (size_t i = 0; i < counts.size(); ++i) {
+                    counts[i] >>= 1;
+                    total += counts[i];
+                }
+            }
+            ++cnt;
+            ++total;
+            if (us > max_us) max_us = us;
+        }
+
+        // q in [0, 1], return 0 without samples
+        uint32_t percentile(double q) const {
+            if (total == 0) return 0;
+            uint64_t rank = (uint64_t)(q * total + 0.5);
+            if (rank == 0) rank = 1;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < counts.size(); ++i) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    uint32_t val = bucket_value(i);
+                    return val < max_us ? val : max_us;
+                }
+            }
+            return max_us;
+        }
+
+        uint32_t count() const { return total; }
+        uint32_t max() const { return max_us; }
+
+        // start a new report window, the buckets stay allocated
+        void reset() {
+            for (size_t i = 0; i < counts.size(); ++i) counts[i] = 0;
+            total  = 0;
+            max_us = 0;
+        }
+
+        void release() {
+            std::vector<uint16_t>().swap(counts);
+            total  = 0;
+            max_us = 0;
+        }
+
+    private:
+        friend class LatencySummary;
+
+        std::vector<uint16_t>   counts;
+        uint32_t                total;
+        uint32_t                max_us;
+};
+
+// Sum of target histograms, e.g. every target of one service, with wide counters
+class LatencySummary {
+    public:
+        LatencySummary() : counts(LATENCY_BUCKETS, 0), total(0), max_us(0) {}
+
+        void merge(const LatencyHistogram &h) {
+            if (h.total == 0) return;
+            for (size_t i = 0; i < h.counts.size(); ++i) {
+                counts[i] += h.counts[i];
+            }
+            total += h.total;
+            if (h.max_us > max_us) max_us = h.max_us;
+        }
+
+        uint32_t percentile(double q) const {
+            if (total == 0) return 0;
+            uint64_t rank = (uint64_t)(q * total + 0.5);
+            if (rank == 0) rank = 1;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < counts.size(); ++i) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    uint32_t val = LatencyHistogram::bucket_value(i);
+                    return val < max_us ? val : max_us;
+                }
+            }
+            return max_us;
+        }
+
+        uint64_t count() const { return total; }
+        uint32_t max() const { return max_us; }
+
+    private:
+        std::vector<uint64_t>   counts;
+        uint64_t                total;
+        uint32_t                max_us;
+};
+
+#endif
@@ -0,0 +1,375 @@
+#ifndef __METRICS_HPP__
+#define __METRICS_HPP__
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Counters, only ever incremented
+enum metric_counter {
+    M_PROBES_SENT = 0,
+    M_SEND_ERRORS,
+    M_SEND_SYSCALLS,
+    M_REPLIES,
+    M_REPLIES_CLOSED,
+    M_REPLIES_UNREACH,
+    M_REPLIES_UNMATCHED,
+    M_PROBE_TIMEOUTS,
+    M_PROBE_RETRIES,
+    M_ALERT_POSTS,
+    M_ALERT_ERRORS,
+    M_ALERT_RETRIES,
+    M_ALERT_DROPS_FULL,
+    M_ALERT_DROPS_FAILED,
+    M_ALERT_FLAPS,
+    M_CAPTURE_QUEUE_DROPS,
+    M_SWEEP_PROBES,
+    M_SWEEP_FOUND,
+    M_APP_OK,
+    M_APP_FAILED,
+    M_APP_TIMEOUTS,
+    M_APP_SKIPPED,
+    M_COUNTER_NUM
+};
+
+// Values set by their single owner, kernel capture counters are already totals
+enum metric_gauge {
+    G_TARGETS = 0,
+    G_PARKED,
+    G_RULES,
+    G_APP_RUNNING,
+    G_BACKLOG,
+    G_SEND_QUEUE,
+    G_ALERT_QUEUE,
+    G_KERNEL_PACKETS,
+    G_KERNEL_DROPS,
+    G_KERNEL_FREEZES,
+    G_GAUGE_NUM
+};
+
+// Durations kept as histograms
+enum metric_timer {
+    T_PHASE_RELOAD = 0,
+    T_PHASE_SEND,
+    T_PHASE_WAIT,
+    T_PHASE_CAPTURE,
+    T_PHASE_REPORT,
+    T_ALERT_POST,
+    T_APP_CHECK,
+    T_TIMER_NUM
+};
+
+#define METRIC_SHARDS  32
+#define METRIC_BUCKETS 7    // 100us, 1ms, 10ms, 100ms, 1s, 10s, +Inf
+
+struct metric_desc {
+    const char *name;
+    const char *type;
+    const char *label;
+    const char *help;
+};
+
+static const metric_desc counter_descs[M_COUNTER_NUM] = {
+    { "nurse_probes_sent_total",       "counter", NULL, "SYN probes handed to the kernel" },
+    { "nurse_send_errors_total",       "counter", NULL, "SYN probes the kernel refused to send" },
+    { "nurse_send_syscalls_total",     "counter", NULL, "sendto/sendmmsg calls" },
+    { "nurse_replies_total",           "counter", NULL, "SYN-ACK replies matched to the current probe of a target" },
+    { "nurse_replies_refused_total",   "counter", "reason=\"closed\"", "RST or ICMP unreachable replies to the current probe of a target" },
+    { "nurse_replies_refused_total",   "counter", "reason=\"unreachable\"", "RST or ICMP unreachable replies to the current probe of a target" },
+    { "nurse_replies_unmatched_total", "counter", NULL, "captured frames which matched no probe" },
+    { "nurse_probe_timeouts_total",    "counter", NULL, "probes lost after every retransmission or past their deadline" },
+    { "nurse_probe_retransmits_total", "counter", NULL, "probes sent again because their retransmission timeout expired" },
+    { "nurse_alert_posts_total",       "counter", NULL, "alert http posts, retries included" },
+    { "nurse_alert_errors_total",      "counter", NULL, "alert http posts failed or answered with a non 2xx status" },
+    { "nurse_alert_retries_total",     "counter", NULL, "failed alert posts scheduled for another try" },
+    { "nurse_alert_drops_total",       "counter", "reason=\"queue_full\"", "alert messages dropped without being delivered" },
+    { "nurse_alert_drops_total",       "counter", "reason=\"gave_up\"", "alert messages dropped without being delivered" },
+    { "nurse_alert_flap_suppressions_total", "counter", NULL, "targets whose alerts were suppressed for flapping" },
+    { "nurse_capture_queue_drops_total", "counter", NULL, "replies dropped because a capture thread queue was full" },
+    { "nurse_sweep_probes_total",      "counter", NULL, "SYN probes sent to addresses of target rules" },
+    { "nurse_sweep_found_total",       "counter", NULL, "addresses of target rules which answered a sweep probe and became targets" },
+    { "nurse_app_checks_total",        "counter", "result=\"ok\"", "application checks finished, by result" },
+    { "nurse_app_checks_total",        "counter", "result=\"failed\"", "application checks finished, by result" },
+    { "nurse_app_checks_total",        "counter", "result=\"timeout\"", "application checks finished, by result" },
+    { "nurse_app_checks_skipped_total", "counter", NULL, "SYN-ACKs counted as success since no application check could be started" },
+};
+
+static const metric_desc gauge_descs[G_GAUGE_NUM] = {
+    { "nurse_targets",                 "gauge",   NULL, "targets being probed" },
+    { "nurse_targets_parked",          "gauge",   NULL, "ports not probed while their silent host is watched through one canary port" },
+    { "nurse_target_rules",            "gauge",   NULL, "cidr and port range rules swept for targets" },
+    { "nurse_app_checks_running",      "gauge",   NULL, "application checks in progress" },
+    { "nurse_schedule_backlog",        "gauge",   NULL, "due probes waiting for send budget" },
+    { "nurse_thread_pool_queue_depth", "gauge",   "pool=\"send\"", "tasks waiting in thread pool" },
+    { "nurse_alert_queue_depth",       "gauge",   NULL, "alert messages not delivered yet" },
+    { "nurse_capture_packets_total",   "counter", NULL, "frames passed to the capture socket, from PACKET_STATISTICS" },
+    { "nurse_capture_drops_total",     "counter", NULL, "frames dropped by the kernel, from PACKET_STATISTICS" },
+    { "nurse_capture_freezes_total",   "counter", NULL, "rx ring queue freezes, from PACKET_STATISTICS" },
+};
+
+static const metric_desc timer_descs[T_TIMER_NUM] = {
+    { "nurse_loop_phase_seconds",      "histogram", "phase=\"reload\"",  "time spent in each phase of the probe loop" },
+    { "nurse_loop_phase_seconds",      "histogram", "phase=\"send\"",    "time spent in each phase of the probe loop" },
+    { "nurse_loop_phase_seconds",      "histogram", "phase=\"wait\"",    "time spent in each phase of the probe loop" },
+    { "nurse_loop_phase_seconds",      "histogram", "phase=\"capture\"", "time spent in each phase of the probe loop" },
+    { "nurse_loop_phase_seconds",      "histogram", "phase=\"report\"",  "time spent in each phase of the probe loop" },
+    { "nurse_alert_post_seconds",      "histogram", NULL,                "latency of alert http posts" },
+    { "nurse_app_check_seconds",       "histogram", NULL,                "duration of application checks from connect to verdict" },
+};
+
+// Counters of one thread, on its own cache line so recording never contends
+struct alignas(64) metric_shard {
+    std::atomic<uint64_t> counters[M_COUNTER_NUM];
+    std::atomic<uint64_t> buckets[T_TIMER_NUM][METRIC_BUCKETS];
+    std::atomic<uint64_t> sum_us[T_TIMER_NUM];
+};
+
+// Process wide metrics
+// Every thread records into its own shard with relaxed atomic adds, no lock and no shared cache line,
+// the shards are only summed up when the metrics are rendered
+class Metrics {
+    public:
+        Metrics() : shard_cnt(0) {
+            for (int i = 0; i < METRIC_SHARDS; ++i) {
+                for (int m = 0; m < M_COUNTER_NUM; ++m) shards[i].counters[m] = 0;
+                for (int t = 0; t < T_TIMER_NUM; ++t) {
+                    for (int b = 0; b < METRIC_BUCKETS; ++b) shards[i].buckets[t][b] = 0;
+                    shards[i].sum_us[t] = 0;
+                }
+            }
+            for (int g = 0; g < G_GAUGE_NUM; ++g) gauges[g] = 0;
+        }
+
+        void add(metric_counter m, uint64_t n = 1) {
+            local().counters[m].fetch_add(n, std::memory_order_relaxed);
+        }
+
+        // sum of a counter over all threads
+        uint64_t get(metric_counter m) const {
+            uint64_t v = 0;
+            for (int i = 0; i < METRIC_SHARDS; ++i) v += shards[i].counters[m].load(std::memory_order_relaxed);
+            return v;
+        }
+
+        void set(metric_gauge g, uint64_t v) {
+            gauges[g].store(v, std::memory_order_relaxed);
+        }
+
+        void observe(metric_timer t, long int us) {
+            if (us < 0) us = 0;
+            int b = 0;
+            for (long int limit = 100; b < METRIC_BUCKETS - 1 && us > limit; limit *= 10) {
+                ++b;
+            }
+            metric_shard &s = local();
+            s.buckets[t][b].fetch_add(1, std::memory_order_relaxed);
+            s.sum_us[t].fetch_add(us, std::memory_order_relaxed);
+        }
+
+        // Prometheus text exposition format 0.0.4
+        std::string render() const {
+            std::string out;
+            char line[256];
+            const char *last = "";
+            for (int m = 0; m < M_COUNTER_NUM; ++m) {
+                uint64_t v = get((metric_counter)m);
+                header(out, counter_descs[m], last);
+                if (counter_descs[m].label) {
+                    snprintf(line, sizeof(line), "%s{%s} %lu\n", counter_descs[m].name, counter_descs[m].label, (unsigned long)v);
+                } else {
+                    snprintf(line, sizeof(line), "%s %lu\n", counter_descs[m].name, (unsigned long)v);
+                }
+                out += line;
+            }
+            for (int g = 0; g < G_GAUGE_NUM; ++g) {
+                header(out, gauge_descs[g], last);
+                if (gauge_descs[g].label) {
+                    snprintf(line, sizeof(line), "%s{%s} %lu\n", gauge_descs[g].name, gauge_descs[g].label, (unsigned long)gauges[g].load());
+                } else {
+                    snprintf(line, sizeof(line), "%s %lu\n", gauge_descs[g].name, (unsigned long)gauges[g].load());
+                }
+                out += line;
+            }
+            static const char *les[METRIC_BUCKETS] = { "0.0001", "0.001", "0.01", "0.1", "1", "10", "+Inf" };
+            for (int t = 0; t < T_TIMER_NUM; ++t) {
+                header(out, timer_descs[t], last);
+                std::string label = timer_descs[t].label ? timer_descs[t].label : "";
+                std::string sep   = label.empty() ? "" : ",";
+                std::string tail  = label.empty() ? "" : "{" + label + "}";
+                uint64_t cnt = 0, sum = 0;
+                for (int b = 0; b < METRIC_BUCKETS; ++b) {
+                    for (int i = 0; i < METRIC_SHARDS; ++i) cnt += shards[i].buckets[t][b].load(std::memory_order_relaxed);
+                    snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%s\"} %lu\n", timer_descs[t].name, label.c_str(), sep.c_str(), les[b], (unsigned long)cnt);
+                    out += line;
+                }
+                for (int i = 0; i < METRIC_SHARDS; ++i) sum += shards[i].sum_us[t].load(std::memory_order_relaxed);
+                snprintf(line, sizeof(line), "%s_sum%s %.6f\n%s_count%s %lu\n",
+                    timer_descs[t].name, tail.c_str(), sum / 1000000.0, timer_descs[t].name, tail.c_str(), (unsigned long)cnt);
+                out += line;
+            }
+            return out;
+        }
+
+    private:
+        metric_shard& local() {
+            // threads beyond METRIC_SHARDS share shards, which is still correct, only slower
+            static thread_local int slot = shard_cnt.fetch_add(1) % METRIC_SHARDS;
+            return shards[slot];
+        }
+
+        static void header(std::string &out, const metric_desc &d, const char *&last) {
+            if (strcmp(last, d.name) == 0) return;
+            last = d.name;
+            out += std::string("# HELP ") + d.name + " " + d.help + "\n# TYPE " + d.name + " " + d.type + "\n";
+        }
+
+    private:
+        metric_shard            shards[METRIC_SHARDS];
+        std::atomic<uint64_t>   gauges[G_GAUGE_NUM];
+        std::atomic<int>        shard_cnt;
+};
+
+inline Metrics& metrics() {
+    static Metrics inst;
+    return inst;
+}
+
+// Serve metrics over HTTP on a local tcp port or a UNIX socket, one short connection per scrape
+// address is "[ip:]port", ip defaults to 127.0.0.1, or "unix:/path/to/socket"
+class MetricsServer {
+    public:
+        MetricsServer(const std::string &addr) : address(addr), listen_fd(-1), stop(false) {}
+
+        ~MetricsServer() {
+            stop = true;
+            if (worker.joinable()) worker.join();
+            if (listen_fd >= 0) close(listen_fd);
+            if (!unix_path.empty()) unlink(unix_path.c_str());
+        }
+
+        // return false if the address can't be listened on
+        bool start() {
+            listen_fd = address.compare(0, 5, "unix:") == 0 ? listen_unix(address.substr(5)) : listen_tcp(address);
+            if (listen_fd < 0) {
+                return false;
+            }
+            worker = std::thread([this] { this->run(); });
+            return true;
+        }
+
+    private:
+        int listen_tcp(const std::string &addr) {
+            std::string ip = "127.0.0.1";
+            std::string port = addr;
+            size_t pos = addr.rfind(':');
+            if (pos != std::string::npos) {
+                ip   = addr.substr(0, pos);
+                port = addr.substr(pos + 1);
+            }
+
+            struct sockaddr_in sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sin_family = AF_INET;
+            sa.sin_port   = htons(atoi(port.c_str()));
+            if (inet_pton(AF_INET, ip.c_str(), &sa.sin_addr) <= 0 || sa.sin_port == 0) {
+                fprintf(stderr, "ERROR: Invalid metrics address %s\n", addr.c_str());
+                return -1;
+            }
+
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int one = 1;
+            if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+                || bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(fd, 16) < 0) {
+                fprintf(stderr, "ERROR: Listen metrics on %s failed, %s\n", addr.c_str(), strerror(errno));
+                if (fd >= 0) close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        int listen_unix(const std::string &path) {
+            struct sockaddr_un sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sun_family = AF_UNIX;
+            if (path.empty() || path.size() >= sizeof(sa.sun_path)) {
+                fprintf(stderr, "ERROR: Invalid metrics socket path %s\n", path.c_str());
+                return -1;
+            }
+            strncpy(sa.sun_path, path.c_str(), sizeof(sa.sun_path) - 1);
+            unlink(path.c_str());
+
+            int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0 || bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(fd, 16) < 0) {
+                fprintf(stderr, "ERROR: Listen metrics on %s failed, %s\n", path.c_str(), strerror(errno));
+                if (fd >= 0) close(fd);
+                return -1;
+            }
+            unix_path = path;
+            return fd;
+        }
+
+        void run() {
+            while (!stop) {
+                struct pollfd pfd;
+                pfd.fd      = listen_fd;
+                pfd.events  = POLLIN;
+                pfd.revents = 0;
+                if (poll(&pfd, 1, 1000) <= 0) continue;
+
+                int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd < 0) continue;
+                serve(fd);
+                close(fd);
+            }
+        }
+
+        // any request gets the metrics, the request itself is only drained
+        void serve(int fd) {
+            struct timeval tv;
+            tv.tv_sec  = 1;
+            tv.tv_usec = 0;
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+            char req[1024];
+            size_t len = 0;
+            while (len < sizeof(req) - 1) {
+                ssize_t n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+                if (n <= 0) break;
+                len += n;
+                req[len] = '\0';
+                if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+            }
+
+            std::string body = metrics().render();
+            char head[160];
+            snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+            std::string resp = std::string(head) + body;
+            size_t off = 0;
+            while (off < resp.size()) {
+                ssize_t n = send(fd, resp.data() + off, resp.size() - off, MSG_NOSIGNAL);
+                if (n <= 0) break;
+                off += n;
+            }
+        }
+
+    private:
+        std::string         address;
+        std::string         unix_path;
+        int                 listen_fd;
+        std::atomic<bool>   stop;
+        std::thread         worker;
+};
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef __NOTIFIER_HPP__
+#define __NOTIFIER_HPP__
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include <atomic>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.hpp"
+
+#define NOTIFY_QUEUE_SIZE      256      // messages waiting for delivery, newer ones are dropped beyond it
+#define NOTIFY_MAX_INFLIGHT    2
+#define NOTIFY_MAX_TRIES       5
+#define NOTIFY_BACKOFF_MS      500      // before the first retry, doubled for each next one
+#define NOTIFY_BACKOFF_MAX_MS  30000
+#define NOTIFY_CONNECT_MS      1000
+#define NOTIFY_TIMEOUT_MS      5000
+
+// Delivery of alert messages to the webhook, off the probe loop
+// post() only queues the message, one thread drives every transfer with curl_multi: connections to the
+// webhook are kept alive and reused, failed posts are retried with exponential backoff and jitter, and
+// when the webhook can't keep up the queue is bounded and the overflow is counted, the probe loop never waits.
+class Notifier {
+    public:
+        Notifier(const std::string &webhook, size_t queue_size = NOTIFY_QUEUE_SIZE)
+            : url(webhook), capacity(queue_size), multi(NULL), headers(NULL), depth_cnt(0), stop(false) {}
+
+        ~Notifier() {
+            stop = true;
+            if (multi) curl_multi_wakeup(multi);
+            if (worker.joinable()) worker.join();
+
+            for (job &j : jobs) {
+                if (j.easy) {
+                    curl_multi_remove_handle(multi, j.easy);
+                    curl_easy_cleanup(j.easy);
+                }
+            }
+            for (CURL *easy : idle) curl_easy_cleanup(easy);
+            if (multi) curl_multi_cleanup(multi);
+            if (headers) curl_slist_free_all(headers);
+        }
+
+        // curl_global_init must have been called, return false if curl can't be set up
+        bool start() {
+            multi = curl_multi_init();
+            if (!multi) {
+                fprintf(stderr, "ERROR: Create curl multi handle failed\n");
+                return false;
+            }
+            curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)NOTIFY_MAX_INFLIGHT);
+            headers = curl_slist_append(headers, "Content-Type: application/json;charset=utf-8");
+            seed = (unsigned int)time(NULL);
+            worker = std::thread([this] { this->run(); });
+            return true;
+        }
+
+        // Queue a message body for delivery, return false if the queue is full and the message is dropped
+        bool post(const std::string &body) {
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                if (depth_cnt.load() >= capacity) {
+                    metrics().add(M_ALERT_DROPS_FULL);
+                    fprintf(stderr, "WARNING: Alert queue full with %zu messages, drop one\n", capacity);
+                    return false;
+                }
+                queue.push_back(body);
+                ++depth_cnt;
+            }
+            if (multi) curl_multi_wakeup(multi);
+            return true;
+        }
+
+        // messages not delivered yet: queued, being posted or waiting for a retry
+        size_t depth() const { return depth_cnt.load(); }
+
+    private:
+        struct job {
+            std::string  body;
+            int          tries;
+            long int     due_ms;
+            long int     begin_us;
+            CURL        *easy;      // set while being posted
+        };
+
+        static long int now_us() {
+            struct timespec _cur_ts;
+            clock_gettime(CLOCK_MONOTONIC_RAW, &_cur_ts);
+            return _cur_ts.tv_sec*1000000 + _cur_ts.tv_nsec/1000;
+        }
+
+        void run() {
+            while (!stop) {
+                take_queued();
+                start_due();
+
+                long int wait_ms = 1000;
+                long int curl_ms = -1;
+                curl_multi_timeout(multi, &curl_ms);
+                if (curl_ms >= 0 && curl_ms < wait_ms) wait_ms = curl_ms;
+                long int now_ms = now_us() / 1000;
+                for (const job &j : jobs) {
+                    if (!j.easy && j.due_ms - now_ms < wait_ms) wait_ms = j.due_ms > now_ms ? j.due_ms - now_ms : 0;
+                }
+                curl_multi_poll(multi, NULL, 0, (int)wait_ms, NULL);
+
+                int running = 0;
+                curl_multi_perform(multi, &running);
+                finish_done();
+            }
+        }
+
+        void take_queued() {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            while (!queue.empty()) {
+                job j;
+                j.body     = std::move(queue.front());
+                j.tries    = 0;
+                j.due_ms   = 0;
+                j.begin_us = 0;
+                j.easy     = NULL;
+                jobs.push_back(std::move(j));
+                queue.pop_front();
+            }
+        }
+
+        // start the posts which are due, oldest first, as long as there is room
+        void start_due() {
+            long int now_ms = now_us() / 1000;
+            int inflight = 0;
+            for (const job &j : jobs) {
+                if (j.easy) ++inflight;
+            }
+            for (job &j : jobs) {
+                if (inflight >= NOTIFY_MAX_INFLIGHT) break;
+                if (j.easy || j.due_ms > now_ms) continue;
+
+                CURL *easy = NULL;
+                if (!idle.empty()) {
+                    easy = idle.back();
+                    idle.pop_back();
+                    curl_easy_reset(easy);
+                } else {
+                    easy = curl_easy_init();
+                }
+                if (!easy) {
+                    fprintf(stderr, "ERROR: Create curl handle failed\n");
+                    break;
+                }
+                curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+                curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+                curl_easy_setopt(easy, CURLOPT_POST, 1L);
+                curl_easy_setopt(easy, CURLOPT_POSTFIELDS, j.body.c_str());
+                curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, (long)j.body.size());
+                curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+                curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT_MS, (long)NOTIFY_CONNECT_MS);
+                curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, (long)NOTIFY_TIMEOUT_MS);
+                curl_easy_setopt(easy, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4);
+                curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+                curl_easy_setopt(easy, CURLOPT_PRIVATE, (void*)&j);
+
+                j.easy     = easy;
+                j.begin_us = now_us();
+                ++j.tries;
+                curl_multi_add_handle(multi, easy);
+                ++inflight;
+            }
+        }
+
+        void finish_done() {
+            int left = 0;
+            CURLMsg *msg = NULL;
+            while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+                if (msg->msg != CURLMSG_DONE) continue;
+                CURL *easy = msg->easy_handle;
+                CURLcode res = msg->data.result;
+                job *j = NULL;
+                curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char**)&j);
+                long code = 0;
+                curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+                curl_multi_remove_handle(multi, easy);
+                idle.push_back(easy);
+                if (!j) continue;
+                j->easy = NULL;
+
+                metrics().add(M_ALERT_POSTS);
+                metrics().observe(T_ALERT_POST, now_us() - j->begin_us);
+                if (res == CURLE_OK && code >= 200 && code < 300) {
+                    fprintf(stderr, "DEBUG: Curl post success\n");
+                    remove(j);
+                    continue;
+                }
+
+                metrics().add(M_ALERT_ERRORS);
+                const char *why = (res != CURLE_OK) ? curl_easy_strerror(res) : "bad http status";
+                if (j->tries >= NOTIFY_MAX_TRIES) {
+                    metrics().add(M_ALERT_DROPS_FAILED);
+                    fprintf(stderr, "ERROR: Alert post failed(%s, status %ld), drop it after %d tries\n", why, code, j->tries);
+                    remove(j);
+                    continue;
+                }
+
+                // full jitter on the upper half, so retries of many messages don't line up
+                long int backoff = (long int)NOTIFY_BACKOFF_MS << (j->tries - 1);
+                if (backoff > NOTIFY_BACKOFF_MAX_MS) backoff = NOTIFY_BACKOFF_MAX_MS;
+                backoff = backoff / 2 + rand_r(&seed) % (backoff / 2 + 1);
+                j->due_ms = now_us() / 1000 + backoff;
+                metrics().add(M_ALERT_RETRIES);
+                fprintf(stderr, "WARNING: Alert post failed(%s, status %ld), retry in %ld ms\n", why, code, backoff);
+            }
+        }
+
+        void remove(job *j) {
+            for (std::list<job>::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+                if (&*it == j) {
+                    jobs.erase(it);
+                    --depth_cnt;
+                    return;
+                }
+            }
+        }
+
+    private:
+        std::string              url;
+        size_t                   capacity;
+
+        // handed over from post(), guarded by queue_mutex
+        std::mutex               queue_mutex;
+        std::deque<std::string>  queue;
+
+        // owned by the worker thread
+        CURLM                   *multi;
+        struct curl_slist       *headers;
+        std::list<job>           jobs;
+        std::vector<CURL*>       idle;
+        unsigned int             seed;
+
+        std::atomic<size_t>      depth_cnt;
+        std::atomic<bool>        stop;
+        std::thread              worker;
+};
+
+#endif
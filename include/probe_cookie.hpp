@@ -0,0 +1,129 @@
+#ifndef __PROBE_COOKIE_HPP__
+#define __PROBE_COOKIE_HPP__
+
+#include <cstdio>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+// Layout of the 32-bit initial sequence number carried by every probe, high to low bits:
+//   | namespace | tag | index |
+// namespace tells nurse processes on the same host apart and is cheap enough to check in the capture filter,
+// tag is a keyed hash of (index, generation, target ip, target port) which rejects stale and spoofed replies,
+// generation counts the sends to the target, so only a reply to a send of its current probe is accepted,
+// index is the target slot, masked with a per-process secret so it does not show on the wire as is.
+// The index takes the bits of up to 1M targets per process, the rest go to the tag: a stale reply from the
+// same ip:port passes with probability 1/256 per send of the current probe (at most 3/256 once retransmitted),
+// less with a source port range, where it must also come back to the port of the send it answers.
+#define COOKIE_NS_BITS  4
+#define COOKIE_TAG_BITS 8
+#define COOKIE_IDX_BITS 20
+
+class probe_cookie {
+    public:
+        static const uint32_t max_targets = (1u << COOKIE_IDX_BITS);
+        // the last index is no target slot, it marks probes of target rules, whose tag covers their ip:port only
+        static const uint32_t sweep_index = max_targets - 1;
+
+        probe_cookie() {
+            if (!read_secret()) {
+                // fall back on a weak secret, matching still requires the reply to come from the probed ip:port
+                struct timespec _cur_ts;
+                clock_gettime(CLOCK_REALTIME, &_cur_ts);
+                k0 = ((uint64_t)_cur_ts.tv_sec << 32) ^ (uint64_t)_cur_ts.tv_nsec ^ 0x736f6d6570736575ULL;
+                k1 = ((uint64_t)getpid() << 32) ^ (uint64_t)_cur_ts.tv_nsec ^ 0x646f72616e646f6dULL;
+                fprintf(stderr, "WARNING: Read /dev/urandom failed, using time based cookie secret\n");
+            }
+            idx_mask = (uint32_t)(k0 >> 17) & ((1u << COOKIE_IDX_BITS) - 1);
+            ns_val   = (uint32_t)(k1 >> 37) & ((1u << COOKIE_NS_BITS) - 1);
+        }
+
+        uint32_t ns() const { return ns_val; }
+        void set_ns(uint32_t n) { ns_val = n & ((1u << COOKIE_NS_BITS) - 1); }
+
+        // ip and port are in network byte order as they are in the packet
+        uint32_t make(uint32_t idx, uint32_t gen, uint32_t ip, uint16_t port) const {
+            return (ns_val << (COOKIE_TAG_BITS + COOKIE_IDX_BITS))
+                | (tag(idx, gen, ip, port) << COOKIE_IDX_BITS)
+                | ((idx ^ idx_mask) & ((1u << COOKIE_IDX_BITS) - 1));
+        }
+
+        // Resolve the sequence number acknowledged by a reply(ack_seq - 1) to a target index
+        // return max_targets if it was not issued by this process
+        uint32_t index(uint32_t isn) const {
+            if ((isn >> (COOKIE_TAG_BITS + COOKIE_IDX_BITS)) != ns_val) {
+                return max_targets;
+            }
+            return (isn ^ idx_mask) & ((1u << COOKIE_IDX_BITS) - 1);
+        }
+
+        // return false if isn was not issued for the given probe generation of target idx at ip:port
+        bool verify(uint32_t isn, uint32_t idx, uint32_t gen, uint32_t ip, uint16_t port) const {
+            return ((isn >> COOKIE_IDX_BITS) & ((1u << COOKIE_TAG_BITS) - 1)) == tag(idx, gen, ip, port);
+        }
+
+    private:
+        bool read_secret() {
+            int fd = open("/dev/urandom", O_RDONLY);
+            if (fd < 0) return false;
+            uint64_t key[2] = {0, 0};
+            ssize_t len = read(fd, key, sizeof(key));
+            close(fd);
+            if (len != (ssize_t)sizeof(key)) return false;
+            k0 = key[0];
+            k1 = key[1];
+            return true;
+        }
+
+        static uint64_t rotl(uint64_t x, int b) {
+            return (x << b) | (x >> (64 - b));
+        }
+
+        /*
+         * Ref: https://131002.net/siphash/siphash.pdf
+         * SipHash-2-4 over a fixed 16 bytes message
+         */
+        uint32_t tag(uint32_t idx, uint32_t gen, uint32_t ip, uint16_t port) const {
+            uint64_t m[2] = { ((uint64_t)ip << 32) | ((uint64_t)port << 16), ((uint64_t)idx << 32) | gen };
+            uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+            uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+            uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+            uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+#define SIPROUND do { \
+            v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32); \
+            v2 += v3; v3 = rotl(v3, 16); v3 ^= v2; \
+            v0 += v3; v3 = rotl(v3, 21); v3 ^= v0; \
+            v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32); \
+        } while (0)
+
+            for (int i = 0; i < 2; ++i) {
+                v3 ^= m[i];
+                SIPROUND;
+                SIPROUND;
+                v0 ^= m[i];
+            }
+            uint64_t b = (uint64_t)16 << 56;
+            v3 ^= b;
+            SIPROUND;
+            SIPROUND;
+            v0 ^= b;
+            v2 ^= 0xff;
+            SIPROUND;
+            SIPROUND;
+            SIPROUND;
+            SIPROUND;
+#undef SIPROUND
+
+            return (uint32_t)(v0 ^ v1 ^ v2 ^ v3) & ((1u << COOKIE_TAG_BITS) - 1);
+        }
+
+    private:
+        uint64_t   k0;
+        uint64_t   k1;
+        uint32_t   idx_mask;
+        uint32_t   ns_val;
+};
+
+#endif
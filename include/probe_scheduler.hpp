@@ -0,0 +1,465 @@
+#ifndef __PROBE_SCHEDULER_HPP__
+#define __PROBE_SCHEDULER_HPP__
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+// Hierarchical timer wheel with 1 ms ticks, 4 levels of 256 slots cover about 49 days
+#define WHEEL_LEVELS     4
+#define WHEEL_SLOT_BITS  8
+#define WHEEL_SLOTS      (1 << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK  (WHEEL_SLOTS - 1)
+#define WHEEL_NIL        0xffffffffu
+
+#define DEFAULT_INTERVAL_MS 1000
+#define MIN_INTERVAL_MS     10
+#define PROBE_TIMEOUT_MS    900
+
+// Retransmission within a probe cycle, timeouts follow RFC 6298 with 1 ms clock granularity
+#define PROBE_MAX_TRIES     3       // sends of one probe before it is lost
+#define PROBE_RTO_INIT_MS   250     // before the first rtt sample of a target
+#define PROBE_RTO_MIN_MS    20
+
+// Adaptive pace, the configured interval is the pace of a target with nothing special going on
+#define PROBE_SUSPECT_MS    200     // gap between probes of a target which just missed a reply
+#define PROBE_STABLE_CYCLES 10      // good replies in a row before the gap of a stable target doubles
+#define PROBE_MAX_STRETCH   10
+
+// Timer wheel over target ids, at most one timer per id
+// Timers are intrusive doubly linked lists kept in arrays indexed by id, so scheduling and
+// cancelling are O(1) and allocate nothing once the arrays are sized for the target table
+class TimerWheel {
+    public:
+        TimerWheel(long int now_ms) : heads(WHEEL_LEVELS * WHEEL_SLOTS, WHEEL_NIL), cur_tick(now_ms) {}
+
+        void resize(size_t cap) {
+            if (cap <= next.size()) return;
+            next.resize(cap, WHEEL_NIL);
+            prev.resize(cap, WHEEL_NIL);
+            slot_of.resize(cap, WHEEL_NIL);
+            due.resize(cap, 0);
+        }
+
+        bool pending(uint32_t id) const {
+            return id < slot_of.size() && slot_of[id] != WHEEL_NIL;
+        }
+
+        // timers already due fire on the next advance()
+        void schedule(uint32_t id, long int due_ms) {
+            cancel(id);
+            link(id, due_ms > cur_tick ? due_ms : cur_tick + 1);
+        }
+
+        void cancel(uint32_t id) {
+            if (!pending(id)) return;
+            uint32_t slot = slot_of[id];
+            if (prev[id] == WHEEL_NIL) {
+                heads[slot] = next[id];
+            } else {
+                next[prev[id]] = next[id];
+            }
+            if (next[id] != WHEEL_NIL) {
+                prev[next[id]] = prev[id];
+            }
+            next[id]    = WHEEL_NIL;
+            prev[id]    = WHEEL_NIL;
+            slot_of[id] = WHEEL_NIL;
+        }
+
+        // Run every tick up to now_ms, calling on_expire(id) for each timer due
+        // on_expire may schedule the id again
+        template<class F>
+        void advance(long int now_ms, F&& on_expire) {
+            while (cur_tick < now_ms) {
+                ++cur_tick;
+
+                // move timers of the upper levels whose range starts now down to the lower levels
+                for (int level = 1; level < WHEEL_LEVELS; ++level) {
+                    if ((cur_tick & (((long int)1 << (level * WHEEL_SLOT_BITS)) - 1)) != 0) break;
+                    uint32_t slot = level * WHEEL_SLOTS + ((cur_tick >> (level * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK);
+                    uint32_t id = detach(slot);
+                    while (id != WHEEL_NIL) {
+                        uint32_t nid = next[id];
+                        next[id] = prev[id] = slot_of[id] = WHEEL_NIL;
+                        link(id, due[id]);
+                        id = nid;
+                    }
+                }
+
+                uint32_t id = detach(cur_tick & WHEEL_SLOT_MASK);
+                while (id != WHEEL_NIL) {
+                    uint32_t nid = next[id];
+                    next[id] = prev[id] = slot_of[id] = WHEEL_NIL;
+                    on_expire(id);
+                    id = nid;
+                }
+            }
+        }
+
+        // Milliseconds from now on without any timer to run, at most max_ms
+        long int idle_ms(long int max_ms) const {
+            long int idle = 0;
+            for (long int tick = cur_tick + 1; idle < max_ms; ++tick, ++idle) {
+                if ((tick & WHEEL_SLOT_MASK) == 0 || heads[tick & WHEEL_SLOT_MASK] != WHEEL_NIL) break;
+            }
+            return idle;
+        }
+
+    private:
+        void link(uint32_t id, long int due_ms) {
+            long int delta = due_ms - cur_tick;
+            if (delta < 0) delta = 0;
+            int level = 0;
+            while (level < WHEEL_LEVELS - 1 && delta >= ((long int)1 << ((level + 1) * WHEEL_SLOT_BITS))) {
+                ++level;
+            }
+            if (level == WHEEL_LEVELS - 1 && delta >= ((long int)1 << (WHEEL_LEVELS * WHEEL_SLOT_BITS))) {
+                due_ms = cur_tick + ((long int)1 << (WHEEL_LEVELS * WHEEL_SLOT_BITS)) - 1;
+            }
+
+            uint32_t slot = level * WHEEL_SLOTS + ((due_ms >> (level * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK);
+            due[id]     = due_ms;
+            slot_of[id] = slot;
+            prev[id]    = WHEEL_NIL;
+            next[id]    = heads[slot];
+            if (heads[slot] != WHEEL_NIL) {
+                prev[heads[slot]] = id;
+            }
+            heads[slot] = id;
+        }
+
+        uint32_t detach(uint32_t slot) {
+            uint32_t id = heads[slot];
+            heads[slot] = WHEEL_NIL;
+            return id;
+        }
+
+    private:
+        std::vector<uint32_t>   heads;
+        std::vector<uint32_t>   next;
+        std::vector<uint32_t>   prev;
+        std::vector<uint32_t>   slot_of;
+        std::vector<long int>   due;
+        long int                cur_tick;
+};
+
+// Token bucket for the global packets per second budget, rate 0 means unlimited
+class TokenBucket {
+    public:
+        TokenBucket(uint32_t pps) : rate(pps), burst(pps / 50 > 256 ? pps / 50 : 256), tokens(burst), last_us(0) {}
+
+        uint32_t get_rate() const { return rate; }
+
+        // return how many of want packets may go now
+        size_t take(long int now_us, size_t want) {
+            if (rate == 0) return want;
+            if (last_us > 0 && now_us > last_us) {
+                tokens += (double)(now_us - last_us) * rate / 1000000.0;
+                if (tokens > burst) tokens = burst;
+            }
+            last_us = now_us;
+
+            size_t allowed = (tokens < want) ? (size_t)tokens : want;
+            tokens -= allowed;
+            return allowed;
+        }
+
+        // hand back packets taken and not sent
+        void give_back(size_t n) {
+            if (rate != 0) tokens += n;
+        }
+
+    private:
+        uint32_t   rate;
+        double     burst;
+        double     tokens;
+        long int   last_us;
+};
+
+// Probe schedule of every target
+// A target waits in the wheel for its next probe, then in the ready queue for send budget,
+// then in the wheel again until its reply or retransmission timeout, and the next probe is due one interval after the last one.
+// A probe is sent again when its rto expires, up to PROBE_MAX_TRIES times with the rto doubled each time, and is lost
+// once the last rto expires or the cycle deadline passes, so a single dropped packet doesn't fail the cycle.
+//
+// The pace adapts: a target missing a reply or refused becomes a suspect, probed every PROBE_SUSPECT_MS with its
+// deadline cut to its retransmission timeouts, until the caller confirms the failure (PACE_DOWN, back to the
+// interval until it recovers) or clears it. With a max interval set, every PROBE_STABLE_CYCLES good replies
+// in a row double the gap of a healthy target up to it.
+class ProbeScheduler {
+    public:
+        enum { ST_NONE = 0, ST_IDLE, ST_READY, ST_INFLIGHT };
+        enum { PACE_NORMAL = 0, PACE_SUSPECT, PACE_DOWN };
+
+        ProbeScheduler(long int now_ms, uint32_t max_pps) : wheel(now_ms), bucket(max_pps), max_interval(0), ready_head(0), ready_cnt(0), retries(0) {}
+
+        // longest gap between probes of a stable target, 0 keeps every target at its interval
+        void set_max_interval(uint32_t max_ms) { max_interval = max_ms; }
+
+        void resize(size_t cap) {
+            if (cap <= state.size()) return;
+            wheel.resize(cap);
+            state.resize(cap, ST_NONE);
+            interval.resize(cap, DEFAULT_INTERVAL_MS);
+            sent_ms.resize(cap, 0);
+            tries.resize(cap, 0);
+            srtt_us.resize(cap, 0);
+            rttvar_us.resize(cap, 0);
+            rto_ms.resize(cap, PROBE_RTO_INIT_MS);
+            stretch.resize(cap, 0);
+            streak.resize(cap, 0);
+            pace.resize(cap, PACE_NORMAL);
+        }
+
+        // Start probing a target, first probes of targets added together are spread evenly over their interval
+        void add(uint32_t id, uint32_t interval_ms, long int now_ms) {
+            resize(id + 1);
+            set_interval(id, interval_ms);
+            set_state(id, ST_IDLE);
+            tries[id]     = 0;
+            srtt_us[id]   = 0;
+            rttvar_us[id] = 0;
+            rto_ms[id]    = PROBE_RTO_INIT_MS;
+            stretch[id]   = 0;
+            streak[id]    = 0;
+            pace[id]      = PACE_NORMAL;
+            wheel.schedule(id, now_ms + (long int)((id * 2654435761u) % interval[id]));
+        }
+
+        void remove(uint32_t id) {
+            if (id >= state.size()) return;
+            wheel.cancel(id);
+            set_state(id, ST_NONE);
+        }
+
+        // Probe a removed target again, keeping its rtt estimate, spread over its interval like add()
+        void resume(uint32_t id, long int now_ms) {
+            if (id >= state.size() || state[id] != ST_NONE) return;
+            set_state(id, ST_IDLE);
+            tries[id] = 0;
+            wheel.schedule(id, now_ms + (long int)((id * 2654435761u) % interval[id]));
+        }
+
+        // takes effect from the next probe on
+        void set_interval(uint32_t id, uint32_t interval_ms) {
+            interval[id] = (interval_ms == 0) ? DEFAULT_INTERVAL_MS : (interval_ms < MIN_INTERVAL_MS ? MIN_INTERVAL_MS : interval_ms);
+        }
+
+        uint32_t get_interval(uint32_t id) const { return interval[id]; }
+        uint32_t get_timeout(uint32_t id) const {
+            uint32_t limit = interval[id] - interval[id] / 10;
+            return limit < PROBE_TIMEOUT_MS ? limit : PROBE_TIMEOUT_MS;
+        }
+
+        // smoothed rtt and retransmission timeout of a target, srtt is 0 before its first sample
+        uint32_t get_srtt_us(uint32_t id) const { return srtt_us[id]; }
+        uint32_t get_rto(uint32_t id) const { return rto_ms[id]; }
+
+        // gap from one probe of a target to the next at its current pace
+        uint32_t get_gap(uint32_t id) const {
+            if (pace[id] == PACE_SUSPECT) {
+                return interval[id] < PROBE_SUSPECT_MS ? interval[id] : PROBE_SUSPECT_MS;
+            }
+            if (pace[id] == PACE_DOWN || max_interval <= interval[id] || stretch[id] == 0) return interval[id];
+            uint64_t gap = (uint64_t)interval[id] << stretch[id];
+            return gap < max_interval ? (uint32_t)gap : max_interval;
+        }
+
+        int get_pace(uint32_t id) const { return pace[id]; }
+
+        // PACE_DOWN once the failure of a target is confirmed, PACE_NORMAL once it recovered or a suspect is cleared
+        void set_pace(uint32_t id, int p) {
+            if (id >= pace.size()) return;
+            pace[id]    = (uint8_t)p;
+            stretch[id] = 0;
+            streak[id]  = 0;
+        }
+
+        // targets which became suspects since the last call, appended to out
+        void take_suspects(std::vector<uint32_t> &out) {
+            out.insert(out.end(), new_suspects.begin(), new_suspects.end());
+            new_suspects.clear();
+        }
+
+        // Run the wheel up to now, due targets go to the ready queue, probes whose rto expired go there again
+        // while they have tries left, on_timeout(id) is called for lost probes
+        template<class F>
+        void advance(long int now_ms, F&& on_timeout) {
+            wheel.advance(now_ms, [&](uint32_t id) {
+                if (state[id] == ST_INFLIGHT) {
+                    if (tries[id] < PROBE_MAX_TRIES && now_ms < deadline(id)) {
+                        ++retries;
+                        set_state(id, ST_READY);
+                        ready.push_back(id);
+                        return;
+                    }
+                    // Karn: keep the backed off rto until a reply gives a fresh sample
+                    uint32_t rto = rto_ms[id] * 2;
+                    rto_ms[id] = rto < PROBE_TIMEOUT_MS ? rto : PROBE_TIMEOUT_MS;
+                    set_state(id, ST_IDLE);
+                    tries[id] = 0;
+                    mark_suspect(id);
+                    schedule_next(id, now_ms);
+                    on_timeout(id);
+                } else if (state[id] == ST_IDLE) {
+                    set_state(id, ST_READY);
+                    ready.push_back(id);
+                }
+            });
+        }
+
+        // Move ready targets allowed by the send budget into out, in the order they became due
+        size_t pop_ready(long int now_us, std::vector<uint32_t> &out) {
+            out.clear();
+            size_t allowed = bucket.take(now_us, ready_cnt);
+            while (out.size() < allowed && ready_head < ready.size()) {
+                uint32_t id = ready[ready_head++];
+                // entries of targets removed or answered while queued, and second entries of a target, send nothing
+                if (state[id] != ST_READY) continue;
+                set_state(id, ST_INFLIGHT);
+                out.push_back(id);
+            }
+            bucket.give_back(allowed - out.size());
+            if (ready_head == ready.size() || ready_cnt == 0) {
+                ready.clear();
+                ready_head = 0;
+            } else if (ready_head > 4096 && ready_head * 2 > ready.size()) {
+                ready.erase(ready.begin(), ready.begin() + ready_head);
+                ready_head = 0;
+            }
+            return out.size();
+        }
+
+        // targets waiting for send budget, stale entries of the ready queue not counted
+        size_t backlog() const { return ready_cnt; }
+
+        // Send budget left by the targets for other probes, nothing while due targets wait for it
+        size_t take_budget(long int now_us, size_t want) {
+            return backlog() > 0 ? 0 : bucket.take(now_us, want);
+        }
+
+        void return_budget(size_t n) { bucket.give_back(n); }
+
+        // retransmissions since the last call
+        size_t take_retries() {
+            size_t n = retries;
+            retries = 0;
+            return n;
+        }
+
+        // return sends of the current probe so far, this one included
+        int on_sent(uint32_t id, long int now_ms) {
+            set_state(id, ST_INFLIGHT);
+            if (tries[id] == 0) {
+                sent_ms[id] = now_ms;
+            }
+            long int due_ms = now_ms + ((long int)rto_ms[id] << tries[id]);
+            ++tries[id];
+            wheel.schedule(id, due_ms < deadline(id) ? due_ms : deadline(id));
+            return tries[id];
+        }
+
+        // rtt_us of the reply updates the rto of the target, 0 for no sample, ok is false for a refusal
+        // a reply to any send of the probe ends it, the caller gives no sample once the probe was sent again
+        // return false if the target has no probe waiting for a reply
+        bool on_reply(uint32_t id, long int now_ms, uint32_t rtt_us, bool ok = true) {
+            if (id >= state.size()) return false;
+            // a retransmission waiting for send budget is still answered by the probe before it
+            if (state[id] != ST_INFLIGHT && !(state[id] == ST_READY && tries[id] > 0)) return false;
+            set_state(id, ST_IDLE);
+            if (rtt_us > 0) {
+                update_rto(id, rtt_us);
+            } else if (tries[id] > 1) {
+                // Karn: no sample from a retransmitted probe, its backed off rto stays for the next one,
+                // a target slower than its rto gets a probe sent once, and a sample, in a few cycles
+                uint32_t rto = rto_ms[id] << (tries[id] - 1);
+                rto_ms[id] = rto < PROBE_TIMEOUT_MS ? rto : PROBE_TIMEOUT_MS;
+            }
+            tries[id] = 0;
+            if (!ok) {
+                mark_suspect(id);
+            } else if (pace[id] == PACE_NORMAL && ++streak[id] >= PROBE_STABLE_CYCLES) {
+                streak[id] = 0;
+                if (stretch[id] < PROBE_MAX_STRETCH && get_gap(id) < max_interval) ++stretch[id];
+            }
+            schedule_next(id, now_ms);
+            return true;
+        }
+
+        // milliseconds the caller may sleep before the scheduler has work again
+        long int idle_ms(long int max_ms) const {
+            return backlog() > 0 ? 0 : wheel.idle_ms(max_ms);
+        }
+
+    private:
+        // every change of state goes through here, so the targets in the ready queue are counted
+        void set_state(uint32_t id, uint8_t s) {
+            if (state[id] == ST_READY) --ready_cnt;
+            if (s == ST_READY) ++ready_cnt;
+            state[id] = s;
+        }
+
+        // a suspect with a known rtt is lost once its retransmissions are, without waiting for the cycle timeout
+        long int deadline(uint32_t id) const {
+            uint32_t limit = get_timeout(id);
+            if (pace[id] == PACE_SUSPECT && srtt_us[id] > 0) {
+                uint32_t rtos = rto_ms[id] * ((1u << PROBE_MAX_TRIES) - 1);
+                if (rtos < limit) limit = rtos;
+            }
+            return sent_ms[id] + limit;
+        }
+
+        void mark_suspect(uint32_t id) {
+            stretch[id] = 0;
+            streak[id]  = 0;
+            if (pace[id] != PACE_NORMAL) return;
+            pace[id] = PACE_SUSPECT;
+            new_suspects.push_back(id);
+        }
+
+        // RFC 6298 2.2 and 2.3, with alpha 1/8 and beta 1/4
+        // samples come from probes sent once only (Karn): the reply to a retransmitted probe may answer any of its
+        // sends, or be a SYN-ACK retransmitted by the target, so it says nothing reliable about the rtt
+        void update_rto(uint32_t id, uint32_t rtt_us) {
+            if (srtt_us[id] == 0) {
+                srtt_us[id]   = rtt_us;
+                rttvar_us[id] = rtt_us / 2;
+            } else {
+                uint32_t err  = srtt_us[id] > rtt_us ? srtt_us[id] - rtt_us : rtt_us - srtt_us[id];
+                rttvar_us[id] = rttvar_us[id] - rttvar_us[id] / 4 + err / 4;
+                srtt_us[id]   = srtt_us[id] - srtt_us[id] / 8 + rtt_us / 8;
+            }
+            uint32_t var_us = 4 * rttvar_us[id] > 1000 ? 4 * rttvar_us[id] : 1000;
+            uint32_t rto = (srtt_us[id] + var_us + 999) / 1000;
+            rto_ms[id] = rto < PROBE_RTO_MIN_MS ? PROBE_RTO_MIN_MS : (rto > PROBE_TIMEOUT_MS ? PROBE_TIMEOUT_MS : rto);
+        }
+
+        void schedule_next(uint32_t id, long int now_ms) {
+            long int due_ms = sent_ms[id] + get_gap(id);
+            wheel.schedule(id, due_ms > now_ms ? due_ms : now_ms);
+        }
+
+    private:
+        TimerWheel                wheel;
+        TokenBucket               bucket;
+        std::vector<uint8_t>      state;
+        std::vector<uint32_t>     interval;
+        std::vector<long int>     sent_ms;    // first send of the current probe, the cycle starts there
+        std::vector<uint8_t>      tries;
+        std::vector<uint32_t>     srtt_us;
+        std::vector<uint32_t>     rttvar_us;
+        std::vector<uint32_t>     rto_ms;
+        std::vector<uint8_t>      stretch;    // log2 of the gap over the interval
+        std::vector<uint8_t>      streak;     // good replies since the last stretch
+        std::vector<uint8_t>      pace;
+        std::vector<uint32_t>     new_suspects;
+        uint32_t                  max_interval;
+        std::vector<uint32_t>     ready;
+        size_t                    ready_head;
+        size_t                    ready_cnt;  // targets in ST_READY
+        size_t                    retries;
+};
+
+#endif
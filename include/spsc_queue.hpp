@@ -0,0 +1,54 @@
+#ifndef __SPSC_QUEUE_HPP__
+#define __SPSC_QUEUE_HPP__
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+// Bounded single-producer single-consumer ring, size must be a power of two
+// Each side owns one index and only reads the other one, so push and pop are a load, a copy and a store.
+template<class T>
+class SpscQueue {
+    public:
+        SpscQueue(size_t size) : buf(size), mask(size - 1), head(0), cached_tail(0), tail(0), cached_head(0) {}
+
+        // producer side, return false if the queue is full
+        bool push(const T &item) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t - cached_head > mask) {
+                cached_head = head.load(std::memory_order_acquire);
+                if (t - cached_head > mask) return false;
+            }
+            buf[t & mask] = item;
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        // consumer side, return false if the queue is empty
+        bool pop(T &item) {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h == cached_tail) {
+                cached_tail = tail.load(std::memory_order_acquire);
+                if (h == cached_tail) return false;
+            }
+            item = buf[h & mask];
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        std::vector<T>        buf;
+        size_t                mask;
+
+        // consumer line: its index and its view of the producer's
+        std::atomic<size_t>   head;
+        size_t                cached_tail;
+        char                  pad0[64 - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+
+        // producer line
+        std::atomic<size_t>   tail;
+        size_t                cached_head;
+        char                  pad1[64 - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+};
+
+#endif
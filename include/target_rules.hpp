@@ -0,0 +1,239 @@
+#ifndef __TARGET_RULES_HPP__
+#define __TARGET_RULES_HPP__
+
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+
+#define SWEEP_PASS_MS       60000   // default time of one pass over every address and port of a rule
+#define SWEEP_CATCH_UP_MS   1000    // a rule behind its pace catches up at most this much at once
+
+// Application checks run after a SYN-ACK, CHECK_TCP takes the SYN-ACK as it is
+#define CHECK_TCP           0
+#define CHECK_HTTP          1       // GET path, 2xx or 3xx status
+#define CHECK_REDIS         2       // PING, +PONG or -NOAUTH
+#define CHECK_MYSQL         3       // server greeting of protocol 10, then login of a user without password and quit
+#define CHECK_TIMEOUT_MS    1000
+#define CHECK_MYSQL_USER    32      // longest user name of a mysql login
+#define CHECK_HTTP_PATH     "/health"
+
+// Ports of a rule, host byte order, inclusive
+struct port_range {
+    uint16_t lo;
+    uint16_t hi;
+
+    bool operator==(const port_range &o) const { return lo == o.lo && hi == o.hi; }
+};
+
+// Addresses, host byte order, inclusive
+struct ip_range {
+    uint32_t lo;
+    uint32_t hi;
+
+    bool operator==(const ip_range &o) const { return lo == o.lo && hi == o.hi; }
+};
+
+// A target expression like 10.1.0.0/16:80,443,8000-8010, kept as ranges and never expanded as a whole
+struct target_rule {
+    ip_range                 addrs;
+    std::vector<port_range>  ports;
+    uint32_t                 interval_ms;   // probe interval of the addresses found, 0 for the default one
+    uint32_t                 pass_ms;       // time of one pass over the rule
+    std::string              service;
+
+    uint64_t port_count() const {
+        uint64_t n = 0;
+        for (const port_range &r : ports) n += r.hi - r.lo + 1;
+        return n;
+    }
+
+    uint64_t size() const { return ((uint64_t)addrs.hi - addrs.lo + 1) * port_count(); }
+
+    // ip & port in host byte order
+    bool covers(uint32_t ip, uint16_t port) const {
+        if (ip < addrs.lo || ip > addrs.hi) return false;
+        for (const port_range &r : ports) {
+            if (port >= r.lo && port <= r.hi) return true;
+        }
+        return false;
+    }
+
+    bool operator==(const target_rule &o) const {
+        return addrs == o.addrs && ports == o.ports && interval_ms == o.interval_ms
+            && pass_ms == o.pass_ms && service == o.service;
+    }
+};
+
+// Application check of the targets of a service
+struct app_check {
+    std::string  service;
+    uint16_t     kind;          // CHECK_*
+    uint32_t     timeout_ms;    // from connect to verdict
+    std::string  arg;           // request path of CHECK_HTTP, user of CHECK_MYSQL
+
+    bool operator==(const app_check &o) const {
+        return service == o.service && kind == o.kind && timeout_ms == o.timeout_ms && arg == o.arg;
+    }
+};
+
+// Rules of a target file with the addresses excluded from every rule, and the checks of services
+struct target_rules {
+    std::vector<target_rule>  rules;
+    std::vector<ip_range>     excludes;
+    std::vector<app_check>    checks;
+
+    void clear() { rules.clear(); excludes.clear(); checks.clear(); }
+    bool same_sweep(const target_rules &o) const { return rules == o.rules && excludes == o.excludes; }
+    bool operator==(const target_rules &o) const { return same_sweep(o) && checks == o.checks; }
+    bool operator!=(const target_rules &o) const { return !(*this == o); }
+};
+
+// An address to probe on behalf of a rule, network byte order as it goes into the probe
+struct sweep_addr {
+    uint32_t ip;
+    uint16_t port;
+};
+
+// Lazy expansion of target rules
+// Each rule is walked by a cursor at the pace of one pass per pass_ms, addresses vary fastest so consecutive
+// probes go to different hosts. Nothing is kept per address, memory and load time depend on the rules only.
+class RangeSweeper {
+    public:
+        RangeSweeper() : last_ms(0), next_rule(0) {}
+
+        // Start over with new rules, excludes are merged into sorted disjoint ranges
+        void load(const target_rules &r, long int now_ms) {
+            rules = r.rules;
+            excludes = r.excludes;
+            std::sort(excludes.begin(), excludes.end(), [](const ip_range &a, const ip_range &b) { return a.lo < b.lo; });
+            size_t kept = 0;
+            for (size_t i = 0; i < excludes.size(); ++i) {
+                if (kept > 0 && excludes[i].lo <= excludes[kept - 1].hi + 1 && excludes[kept - 1].hi != 0xffffffffu) {
+                    excludes[kept - 1].hi = std::max(excludes[kept - 1].hi, excludes[i].hi);
+                } else {
+                    excludes[kept++] = excludes[i];
+                }
+            }
+            excludes.resize(kept);
+
+            cursors.assign(rules.size(), cursor());
+            for (size_t i = 0; i < rules.size(); ++i) {
+                cursors[i].total = rules[i].size();
+            }
+            last_ms = now_ms;
+            next_rule = 0;
+        }
+
+        bool empty() const { return rules.empty(); }
+        size_t size() const { return rules.size(); }
+
+        // addresses covered by the rules, excludes not taken off
+        uint64_t addresses() const {
+            uint64_t n = 0;
+            for (const target_rule &r : rules) n += r.size();
+            return n;
+        }
+
+        // every rule went over all of its addresses at least once since load()
+        bool swept() const {
+            for (const cursor &c : cursors) {
+                if (!c.wrapped) return false;
+            }
+            return true;
+        }
+
+        // First rule covering ip:port(network byte order) which is not excluded, NULL if none
+        const target_rule* find(uint32_t ip, uint16_t port) const {
+            uint32_t h = ntohl(ip);
+            if (excluded(h)) return NULL;
+            for (const target_rule &r : rules) {
+                if (r.covers(h, ntohs(port))) return &r;
+            }
+            return NULL;
+        }
+
+        // Append the addresses due by the pace of every rule to out, at most max of them
+        // skip(ip, port) returns true for addresses already probed as targets, they and excluded ones are passed over
+        template<class F>
+        size_t take(long int now_ms, size_t max, F&& skip, std::vector<sweep_addr> &out) {
+            out.clear();
+            long int elapsed = now_ms - last_ms;
+            last_ms = now_ms;
+            if (rules.empty()) return 0;
+
+            for (size_t i = 0; i < rules.size(); ++i) {
+                cursor &c = cursors[i];
+                double rate = (double)c.total / (rules[i].pass_ms ? rules[i].pass_ms : SWEEP_PASS_MS);
+                c.credit += rate * (elapsed > 0 ? elapsed : 0);
+                double cap = rate * SWEEP_CATCH_UP_MS;
+                if (c.credit > (cap > 1 ? cap : 1)) c.credit = (cap > 1 ? cap : 1);
+            }
+
+            // rules take turns, so a big rule doesn't starve the others when the budget is short
+            for (size_t n = 0; n < rules.size() && out.size() < max; ++n) {
+                size_t i = (next_rule + n) % rules.size();
+                const target_rule &r = rules[i];
+                cursor &c = cursors[i];
+                uint64_t addr_cnt = (uint64_t)r.addrs.hi - r.addrs.lo + 1;
+                while (c.credit >= 1 && out.size() < max) {
+                    c.credit -= 1;
+                    uint32_t ip = r.addrs.lo + (uint32_t)(c.pos % addr_cnt);
+                    uint16_t port = nth_port(r, c.pos / addr_cnt);
+                    if (++c.pos == c.total) {
+                        c.pos = 0;
+                        c.wrapped = true;
+                    }
+
+                    if (excluded(ip)) continue;
+                    sweep_addr a = { htonl(ip), htons(port) };
+                    if (skip(a.ip, a.port)) continue;
+                    out.push_back(a);
+                }
+            }
+            next_rule = (next_rule + 1) % rules.size();
+            return out.size();
+        }
+
+    private:
+        struct cursor {
+            uint64_t pos;
+            uint64_t total;
+            double   credit;    // probes due and not sent yet
+            bool     wrapped;   // a full pass is done
+
+            cursor() : pos(0), total(0), credit(0), wrapped(false) {}
+        };
+
+        static uint16_t nth_port(const target_rule &r, uint64_t n) {
+            for (const port_range &p : r.ports) {
+                uint64_t cnt = p.hi - p.lo + 1;
+                if (n < cnt) return (uint16_t)(p.lo + n);
+                n -= cnt;
+            }
+            return r.ports.empty() ? 0 : r.ports[0].lo;
+        }
+
+        bool excluded(uint32_t ip) const {
+            size_t lo = 0, hi = excludes.size();
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (excludes[mid].hi < ip) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            return lo < excludes.size() && excludes[lo].lo <= ip;
+        }
+
+    private:
+        std::vector<target_rule>  rules;
+        std::vector<ip_range>     excludes;
+        std::vector<cursor>       cursors;
+        long int                  last_ms;
+        size_t                    next_rule;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef __TARGET_SHARD_HPP__
+#define __TARGET_SHARD_HPP__
+
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#define SHARD_MAX 1024
+
+/*
+ * Slice of the targets probed by this instance when several instances share one target file
+ * Every instance reads the whole file and keeps the ip:port whose jump consistent hash falls on its index,
+ * so going from n to n + 1 instances moves 1 / (n + 1) of the targets and no target between the old ones.
+ * Ref: https://arxiv.org/abs/1406.2294
+ */
+class TargetShard {
+    public:
+        TargetShard() : index(0), count(1) {}
+
+        // "i/n" for the i-th of n instances, counted from 0, return false if it makes no sense
+        bool parse(const char *spec) {
+            char *end = NULL;
+            unsigned long i = strtoul(spec, &end, 10);
+            if (end == spec || *end != '/') return false;
+            const char *p = end + 1;
+            unsigned long n = strtoul(p, &end, 10);
+            if (end == p || *end != '\0' || n < 1 || n > SHARD_MAX || i >= n) return false;
+            index = (uint32_t)i;
+            count = (uint32_t)n;
+            return true;
+        }
+
+        bool sharded() const { return count > 1; }
+        uint32_t get_index() const { return index; }
+        uint32_t get_count() const { return count; }
+
+        // ip & port in network byte order
+        bool owns(uint32_t ip, uint16_t port) const {
+            return count == 1 || bucket(((uint64_t)ntohl(ip) << 16) | ntohs(port), count) == index;
+        }
+
+    private:
+        static uint32_t bucket(uint64_t key, uint32_t buckets) {
+            // neighbour addresses differ in a few low bits, spread them before the jump
+            key ^= key >> 33;
+            key *= 0xff51afd7ed558ccdULL;
+            key ^= key >> 33;
+            int64_t b = -1, j = 0;
+            while (j < (int64_t)buckets) {
+                b = j;
+                key = key * 2862933555777941757ULL + 1;
+                j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+            }
+            return (uint32_t)b;
+        }
+
+    private:
+        uint32_t index;
+        uint32_t count;
+};
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef __TARGET_SNAPSHOT_HPP__
+#define __TARGET_SNAPSHOT_HPP__
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "target_rules.hpp"
+
+#define SNAPSHOT_MAGIC    "NURSESNP"
+#define SNAPSHOT_VERSION  2
+
+/*
+ * Binary target file, compiled from the text format by `nurse compile` and mapped in place
+ * Layout, every section 8 bytes aligned, integers in the byte order of the host which compiled it:
+ *   header
+ *   records       snapshot_rec[rec_num], sorted by ip then port, ip & port in network byte order
+ *   services      uint32_t[serv_num + 1] offsets into the strings, then the NUL terminated names
+ *   rules         snapshot_rule[rule_num], their port ranges and the excluded ranges
+ *   checks        snapshot_check[check_num], service and argument are indexes of the strings
+ * The checksum covers everything after the header. Records are used as they are in the mapping,
+ * loading does not depend on their number besides one pass of the checksum.
+ */
+struct snapshot_header {
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  header_size;
+    uint64_t  file_size;
+    uint64_t  checksum;
+    uint32_t  rec_num;
+    uint32_t  serv_num;
+    uint32_t  rule_num;
+    uint32_t  range_num;
+    uint32_t  exclude_num;
+    uint32_t  str_size;
+    uint64_t  rec_off;
+    uint64_t  serv_off;
+    uint64_t  rule_off;
+    uint64_t  range_off;
+    uint64_t  exclude_off;
+    uint32_t  check_num;
+    uint32_t  pad;
+    uint64_t  check_off;
+};
+
+struct snapshot_rec {
+    uint32_t ip;
+    uint16_t port;
+    uint16_t serv;
+    uint32_t interval_ms;
+};
+
+struct snapshot_rule {
+    uint32_t ip_lo;         // host byte order as in ip_range
+    uint32_t ip_hi;
+    uint32_t interval_ms;
+    uint32_t pass_ms;
+    uint32_t range_begin;   // index of its first port range
+    uint32_t range_num;
+    uint32_t serv;
+    uint32_t pad;
+};
+
+struct snapshot_check {
+    uint32_t serv;
+    uint32_t arg;
+    uint16_t kind;
+    uint16_t pad;
+    uint32_t timeout_ms;
+};
+
+// word at a time FNV style hash, catches truncated or corrupted files
+inline uint64_t snapshot_sum(const char *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; i < len; ++i) {
+        h = (h ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+inline bool is_snapshot(const char *path) {
+    char magic[8] = {'\0', };
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return false;
+    size_t len = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+    return len == sizeof(magic) && memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+}
+
+// A target snapshot mapped read only
+// Files are to be replaced by rename, which keeps the mapping of the old version valid, not rewritten in place.
+class TargetSnapshot {
+    public:
+        TargetSnapshot() : base(NULL), size(0), hdr(NULL), recs(NULL), serv_offs(NULL), strs(NULL) {}
+
+        ~TargetSnapshot() {
+            if (base) munmap(base, size);
+        }
+
+        // Map and check the file, return false with the reason logged if it can't be used
+        bool open(const char *path) {
+            int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                fprintf(stderr, "ERROR: Open snapshot %s failed, %s\n", path, strerror(errno));
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(snapshot_header)) {
+                fprintf(stderr, "ERROR: Snapshot %s is too short\n", path);
+                close(fd);
+                return false;
+            }
+            size = st.st_size;
+            void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (addr == MAP_FAILED) {
+                fprintf(stderr, "ERROR: Mmap snapshot %s failed, %s\n", path, strerror(errno));
+                return false;
+            }
+            base = (char*)addr;
+            madvise(base, size, MADV_WILLNEED);
+
+            const char *why = check();
+            if (why) {
+                fprintf(stderr, "ERROR: Snapshot %s is invalid, %s\n", path, why);
+                munmap(base, size);
+                base = NULL;
+                return false;
+            }
+            return true;
+        }
+
+        size_t records() const { return hdr->rec_num; }
+        const snapshot_rec& rec(size_t i) const { return recs[i]; }
+        size_t services() const { return hdr->serv_num; }
+
+        const char* service(uint32_t serv) const {
+            return serv < hdr->serv_num ? strs + serv_offs[serv] : "";
+        }
+
+        // rules are few, they are copied out
+        void get_rules(target_rules &out) const {
+            out.clear();
+            const snapshot_rule *rules = (const snapshot_rule*)(base + hdr->rule_off);
+            const port_range *ranges = (const port_range*)(base + hdr->range_off);
+            const ip_range *excludes = (const ip_range*)(base + hdr->exclude_off);
+            for (uint32_t i = 0; i < hdr->rule_num; ++i) {
+                target_rule r;
+                r.addrs.lo    = rules[i].ip_lo;
+                r.addrs.hi    = rules[i].ip_hi;
+                r.interval_ms = rules[i].interval_ms;
+                r.pass_ms     = rules[i].pass_ms;
+                r.service     = service(rules[i].serv);
+                r.ports.assign(ranges + rules[i].range_begin, ranges + rules[i].range_begin + rules[i].range_num);
+                out.rules.push_back(r);
+            }
+            out.excludes.assign(excludes, excludes + hdr->exclude_num);
+            const snapshot_check *checks = (const snapshot_check*)(base + hdr->check_off);
+            for (uint32_t i = 0; i < hdr->check_num; ++i) {
+                app_check c;
+                c.service    = service(checks[i].serv);
+                c.kind       = checks[i].kind;
+                c.timeout_ms = checks[i].timeout_ms;
+                c.arg        = service(checks[i].arg);
+                out.checks.push_back(c);
+            }
+        }
+
+    private:
+        // num items of len bytes at off, aligned like their widest field
+        bool section_ok(uint64_t off, uint64_t num, uint64_t len) const {
+            uint64_t align = (len >= 8) ? 8 : len;
+            return off % align == 0 && off >= sizeof(snapshot_header) && off <= size && num <= (size - off) / len;
+        }
+
+        const char* check() {
+            hdr = (const snapshot_header*)base;
+            if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0) return "bad magic";
+            if (hdr->version != SNAPSHOT_VERSION) return "unsupported version";
+            if (hdr->header_size != sizeof(snapshot_header) || hdr->file_size != size) return "size mismatch";
+            if (snapshot_sum(base + sizeof(snapshot_header), size - sizeof(snapshot_header)) != hdr->checksum) {
+                return "checksum mismatch";
+            }
+
+            if (!section_ok(hdr->rec_off, hdr->rec_num, sizeof(snapshot_rec))
+                || !section_ok(hdr->serv_off, (uint64_t)hdr->serv_num + 1, sizeof(uint32_t))
+                || !section_ok(hdr->serv_off + ((uint64_t)hdr->serv_num + 1) * sizeof(uint32_t), hdr->str_size, 1)
+                || !section_ok(hdr->rule_off, hdr->rule_num, sizeof(snapshot_rule))
+                || !section_ok(hdr->range_off, hdr->range_num, sizeof(port_range))
+                || !section_ok(hdr->exclude_off, hdr->exclude_num, sizeof(ip_range))
+                || !section_ok(hdr->check_off, hdr->check_num, sizeof(snapshot_check))) {
+                return "section out of file";
+            }
+            if (hdr->serv_num > 0x10000) return "too many services";
+
+            recs      = (const snapshot_rec*)(base + hdr->rec_off);
+            serv_offs = (const uint32_t*)(base + hdr->serv_off);
+            strs      = base + hdr->serv_off + ((uint64_t)hdr->serv_num + 1) * sizeof(uint32_t);
+            for (uint32_t i = 0; i < hdr->serv_num; ++i) {
+                if (serv_offs[i] >= serv_offs[i + 1] || serv_offs[i + 1] > hdr->str_size || strs[serv_offs[i + 1] - 1] != '\0') {
+                    return "bad service table";
+                }
+            }
+            const snapshot_rule *rules = (const snapshot_rule*)(base + hdr->rule_off);
+            for (uint32_t i = 0; i < hdr->rule_num; ++i) {
+                if (rules[i].range_num == 0 || rules[i].range_begin > hdr->range_num
+                    || rules[i].range_num > hdr->range_num - rules[i].range_begin || rules[i].ip_lo > rules[i].ip_hi) {
+                    return "bad rule";
+                }
+            }
+            const snapshot_check *checks = (const snapshot_check*)(base + hdr->check_off);
+            for (uint32_t i = 0; i < hdr->check_num; ++i) {
+                if (checks[i].kind > CHECK_MYSQL || checks[i].serv >= hdr->serv_num || checks[i].arg >= hdr->serv_num) {
+                    return "bad check";
+                }
+            }
+            return NULL;
+        }
+
+    private:
+        char                    *base;
+        size_t                   size;
+        const snapshot_header   *hdr;
+        const snapshot_rec      *recs;
+        const uint32_t          *serv_offs;
+        const char              *strs;
+};
+
+#endif
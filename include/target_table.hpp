@@ -0,0 +1,282 @@
+#ifndef __TARGET_TABLE_HPP__
+#define __TARGET_TABLE_HPP__
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "target_snapshot.hpp"
+
+#define INVALID_TARGET  0xffffffffu
+#define MAX_SERVICE_LEN 128
+
+// One parsed line of the target file, ip & port in network byte order
+struct target_line {
+    uint32_t ip;
+    uint16_t port;
+    uint32_t interval_ms;   // probe interval, 0 for the default one
+    char     service[MAX_SERVICE_LEN];
+};
+
+// Difference between two versions of the target file
+struct target_diff {
+    std::vector<target_line> added;     // new targets, or known ones whose service name or interval changed
+    std::vector<target_line> removed;
+    // added targets of a snapshot file, by record index, read in place from the mapping
+    std::shared_ptr<const TargetSnapshot> snap;
+    std::vector<uint32_t>    snap_added;
+
+    bool empty() const { return added.empty() && removed.empty() && snap_added.empty(); }
+    size_t added_size() const { return added.size() + snap_added.size(); }
+    void clear() {
+        added.clear();
+        removed.clear();
+        snap_added.clear();
+        snap.reset();
+    }
+    void swap(target_diff &other) {
+        added.swap(other.added);
+        removed.swap(other.removed);
+        snap.swap(other.snap);
+        snap_added.swap(other.snap_added);
+    }
+
+    // f(ip, port) for every added target
+    template<class F>
+    void for_each_added(F&& f) const {
+        for (const target_line &line : added) f(line.ip, line.port);
+        for (uint32_t i : snap_added) f(snap->rec(i).ip, snap->rec(i).port);
+    }
+};
+
+// Packed target record, ip & port in network byte order as they go into the probe
+struct target_rec {
+    uint32_t ip;
+    uint16_t port;
+    uint16_t serv;
+};
+
+// Persistent registry of probe targets
+// Every target keeps a stable integer id for its whole life, ids of removed targets are reused,
+// so per target state lives in plain arrays indexed by id. Service names are interned once.
+class TargetTable {
+    public:
+        // what happened to an id since the last clear_changes()
+        enum { CHANGE_NONE = 0, CHANGE_ADDED, CHANGE_REMOVED, CHANGE_UPDATED };
+
+        TargetTable(uint32_t max_num) : live(0), max_targets(max_num) {}
+
+        // return id of the new target, or INVALID_TARGET if the table is full
+        uint32_t add(uint32_t ip, uint16_t port, const char *service) {
+            return add(ip, port, intern(service));
+        }
+
+        void remove(uint32_t id) {
+            if (!alive(id)) return;
+            index.erase(key(recs[id].ip, recs[id].port));
+            alive_bits[id >> 6] &= ~(1ULL << (id & 63));
+            free_ids.push_back(id);
+            mark(id, CHANGE_REMOVED);
+            --live;
+        }
+
+        uint32_t find(uint32_t ip, uint16_t port) const {
+            std::unordered_map<uint64_t, uint32_t>::const_iterator it = index.find(key(ip, port));
+            return (it == index.end()) ? INVALID_TARGET : it->second;
+        }
+
+        // Apply only the added, removed and updated targets, unchanged targets keep their ids and state
+        // applying an entry twice has no effect, return number of targets added, removed or updated
+        size_t apply(const target_diff &diff) {
+            size_t old_changes = changed.size();
+            for (size_t i = 0; i < diff.removed.size(); ++i) {
+                uint32_t id = find(diff.removed[i].ip, diff.removed[i].port);
+                if (id != INVALID_TARGET) remove(id);
+            }
+            index.reserve(live + diff.added_size());
+
+            bool full = false;
+            for (size_t i = 0; i < diff.added.size() && !full; ++i) {
+                const target_line &line = diff.added[i];
+                full = !upsert(line.ip, line.port, line.service, line.interval_ms);
+            }
+
+            // service names of a snapshot are interned once per name, not once per record
+            std::vector<uint32_t> serv_map(diff.snap ? diff.snap->services() : 0, INVALID_TARGET);
+            for (size_t i = 0; i < diff.snap_added.size() && !full; ++i) {
+                const snapshot_rec &r = diff.snap->rec(diff.snap_added[i]);
+                if (r.serv < serv_map.size() && serv_map[r.serv] == INVALID_TARGET) {
+                    serv_map[r.serv] = intern(diff.snap->service(r.serv));
+                }
+                uint16_t serv = r.serv < serv_map.size() ? serv_map[r.serv] : intern("");
+                full = !upsert(r.ip, r.port, serv, r.interval_ms);
+            }
+            if (full) {
+                fprintf(stderr, "WARNING: Target table full with %u targets, skip the rest\n", max_targets);
+            }
+
+            return changed.size() - old_changes;
+        }
+
+        size_t capacity() const { return recs.size(); }
+        size_t size() const { return live; }
+        bool alive(uint32_t id) const {
+            return id < recs.size() && (alive_bits[id >> 6] & (1ULL << (id & 63)));
+        }
+
+        const target_rec& rec(uint32_t id) const { return recs[id]; }
+        const std::string& service(uint32_t id) const { return services[recs[id].serv]; }
+        uint32_t interval(uint32_t id) const { return intervals[id]; }
+
+        struct sockaddr_in sock_addr(uint32_t id) const {
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family      = AF_INET;
+            addr.sin_port        = recs[id].port;
+            addr.sin_addr.s_addr = recs[id].ip;
+            return addr;
+        }
+
+        // format "ip:port" into buf, len should be at least INET_ADDRSTRLEN + 6
+        const char* addr_str(uint32_t id, char *buf, size_t len) const {
+            char ip[INET_ADDRSTRLEN] = {'\0', };
+            inet_ntop(AF_INET, &recs[id].ip, ip, INET_ADDRSTRLEN);
+            snprintf(buf, len, "%s:%u", ip, ntohs(recs[id].port));
+            return buf;
+        }
+
+        // ids added, removed or updated since last clear_changes(), each once, check change_of() to tell them apart
+        // an updated target is a kept one whose service or interval changed, an id removed and reused is added
+        const std::vector<uint32_t>& changes() const { return changed; }
+        int change_of(uint32_t id) const { return id < change_kinds.size() ? change_kinds[id] : (int)CHANGE_NONE; }
+        void clear_changes() {
+            for (uint32_t id : changed) change_kinds[id] = CHANGE_NONE;
+            changed.clear();
+        }
+
+        template<class F>
+        void for_each(F&& f) const {
+            for (size_t w = 0; w < alive_bits.size(); ++w) {
+                for (uint64_t bits = alive_bits[w]; bits; bits &= bits - 1) {
+                    f((uint32_t)((w << 6) + __builtin_ctzll(bits)));
+                }
+            }
+        }
+
+    private:
+        static uint64_t key(uint32_t ip, uint16_t port) {
+            return ((uint64_t)ip << 16) | port;
+        }
+
+        void mark(uint32_t id, uint8_t kind) {
+            if (id >= change_kinds.size()) change_kinds.resize(recs.size(), CHANGE_NONE);
+            if (change_kinds[id] == CHANGE_NONE) {
+                changed.push_back(id);
+            } else if (kind == CHANGE_UPDATED) {
+                // a target added in the same batch stays added
+                return;
+            }
+            change_kinds[id] = kind;
+        }
+
+        uint32_t add(uint32_t ip, uint16_t port, uint16_t serv) {
+            uint32_t id = INVALID_TARGET;
+            if (!free_ids.empty()) {
+                id = free_ids.back();
+                free_ids.pop_back();
+            } else {
+                if (recs.size() >= max_targets) {
+                    return INVALID_TARGET;
+                }
+                id = recs.size();
+                recs.emplace_back();
+                intervals.push_back(0);
+                size_t words = (recs.size() + 63) / 64;
+                if (alive_bits.size() < words) {
+                    alive_bits.push_back(0);
+                }
+            }
+
+            recs[id].ip   = ip;
+            recs[id].port = port;
+            recs[id].serv = serv;
+            intervals[id] = 0;
+            alive_bits[id >> 6] |= (1ULL << (id & 63));
+            index[key(ip, port)] = id;
+            mark(id, CHANGE_ADDED);
+            ++live;
+            return id;
+        }
+
+        // add a target or update service and interval of a known one, return false if the table is full
+        bool upsert(uint32_t ip, uint16_t port, const char *service, uint32_t interval_ms) {
+            uint32_t id = find(ip, port);
+            if (id == INVALID_TARGET) {
+                id = add(ip, port, service);
+                if (id == INVALID_TARGET) return false;
+                intervals[id] = interval_ms;
+            } else if (strcmp(services[recs[id].serv].c_str(), service) != 0) {
+                update(id, intern(service), interval_ms);
+            } else {
+                update(id, recs[id].serv, interval_ms);
+            }
+            return true;
+        }
+
+        bool upsert(uint32_t ip, uint16_t port, uint16_t serv, uint32_t interval_ms) {
+            uint32_t id = find(ip, port);
+            if (id == INVALID_TARGET) {
+                id = add(ip, port, serv);
+                if (id == INVALID_TARGET) return false;
+                intervals[id] = interval_ms;
+            } else {
+                update(id, serv, interval_ms);
+            }
+            return true;
+        }
+
+        void update(uint32_t id, uint16_t serv, uint32_t interval_ms) {
+            if (recs[id].serv == serv && intervals[id] == interval_ms) return;
+            recs[id].serv = serv;
+            intervals[id] = interval_ms;
+            mark(id, CHANGE_UPDATED);
+        }
+
+        uint16_t intern(const char *service) {
+            std::unordered_map<std::string, uint16_t>::iterator it = serv_index.find(service);
+            if (it != serv_index.end()) {
+                return it->second;
+            }
+            if (services.size() > 0xffff) {
+                fprintf(stderr, "WARNING: Too many service names, %s shares the last one\n", service);
+                return 0xffff;
+            }
+            services.emplace_back(service);
+            serv_index[services.back()] = services.size() - 1;
+            return services.size() - 1;
+        }
+
+    private:
+        std::vector<target_rec>   recs;
+        std::vector<uint32_t>     intervals;
+        std::vector<uint64_t>     alive_bits;
+        std::vector<uint32_t>     free_ids;
+        std::vector<uint32_t>     changed;
+        std::vector<uint8_t>      change_kinds;     // CHANGE_* by id, for the ids in changed
+
+        std::unordered_map<uint64_t, uint32_t>      index;
+        std::vector<std::string>                    services;
+        std::unordered_map<std::string, uint16_t>   serv_index;
+
+        size_t     live;
+        uint32_t   max_targets;
+};
+
+#endif
@@ -0,0 +1,606 @@
+#ifndef __TARGET_WATCHER_HPP__
+#define __TARGET_WATCHER_HPP__
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "target_table.hpp"
+#include "target_rules.hpp"
+#include "target_shard.hpp"
+
+// without inotify events, stat the file this often to catch changes
+#define WATCH_FALLBACK_MS 5000
+#define WATCH_POLL_MS     1000
+
+// 解析 a.b.c.d 或 a.b.c.d/len 到主机序的地址区间，/30 以上的网段去掉网络地址和广播地址
+static bool parse_cidr(const char *str, ip_range &range) {
+    char _ip[INET_ADDRSTRLEN] = {'\0', };
+    unsigned int _len = 32;
+    char _tail = '\0';
+    int n = sscanf(str, "%15[0-9.]/%u%c", _ip, &_len, &_tail);
+    if (n < 1 || n > 2 || _len > 32) return false;
+    if (n == 1 && str[strlen(_ip)] != '\0') return false;
+
+    struct in_addr _addr;
+    if (inet_pton(AF_INET, _ip, &_addr) <= 0) return false;
+    uint32_t mask = _len ? 0xffffffffu << (32 - _len) : 0;
+    range.lo = ntohl(_addr.s_addr) & mask;
+    range.hi = range.lo | ~mask;
+    if (_len <= 30) {
+        ++range.lo;
+        --range.hi;
+    }
+    return true;
+}
+
+// 解析 80,443,8000-8010 形式的端口列表
+static bool parse_ports(const char *str, std::vector<port_range> &ports) {
+    ports.clear();
+    while (*str) {
+        unsigned int _lo = 0, _hi = 0;
+        int _used = 0;
+        int n = sscanf(str, "%u%n-%u%n", &_lo, &_used, &_hi, &_used);
+        if (n < 1) return false;
+        if (n == 1) _hi = _lo;
+        if (_lo < 1 || _hi > 65535 || _lo > _hi) return false;
+        port_range r = { (uint16_t)_lo, (uint16_t)_hi };
+        ports.push_back(r);
+        str += _used;
+        if (*str == ',') ++str;
+        else if (*str != '\0') return false;
+    }
+    return !ports.empty();
+}
+
+// 去掉服务名末尾的 interval=ms、sweep=ms 和 timeout=ms(timeout_ms 不为 NULL 时)选项
+static void take_options(char *service, unsigned int &interval_ms, unsigned int &pass_ms, unsigned int *timeout_ms = NULL) {
+    while (true) {
+        size_t len = strlen(service);
+        while (len > 0 && isspace(service[len - 1])) service[--len] = '\0';
+        char *opt = service + len;
+        while (opt > service && !isspace(opt[-1])) --opt;
+        if (opt == service) return;
+
+        unsigned int _ms = 0;
+        if (sscanf(opt, "interval=%u", &_ms) == 1) {
+            interval_ms = _ms;
+        } else if (sscanf(opt, "sweep=%u", &_ms) == 1) {
+            pass_ms = _ms;
+        } else if (timeout_ms && sscanf(opt, "timeout=%u", &_ms) == 1) {
+            *timeout_ms = _ms;
+        } else {
+            return;
+        }
+        *opt = '\0';
+    }
+}
+
+// 解析 http[:path]、redis 或 mysql 到检查类型和参数
+static bool parse_check(const char *spec, app_check &check) {
+    const char *colon = strchr(spec, ':');
+    std::string kind = colon ? std::string(spec, colon - spec) : std::string(spec);
+    check.arg.clear();
+    if (kind == "http") {
+        check.kind = CHECK_HTTP;
+        check.arg  = (colon && colon[1] == '/') ? std::string(colon + 1) : std::string(CHECK_HTTP_PATH);
+        return !colon || colon[1] == '/';
+    }
+    if (kind == "mysql") {
+        check.kind = CHECK_MYSQL;
+        if (colon) check.arg = std::string(colon + 1);
+        return !colon || (!check.arg.empty() && check.arg.size() <= CHECK_MYSQL_USER);
+    }
+    if (colon) return false;
+    if (kind == "redis") {
+        check.kind = CHECK_REDIS;
+    } else if (kind == "tcp") {
+        check.kind = CHECK_TCP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// 解析目标文件到 lines 和 rules，文件无法打开时返回 -1，否则返回 lines 和 rules 的条数之和
+// 每行格式为 addr:ports service [interval=ms] [sweep=ms]:
+//   addr 为单个 ip 时 ports 中的每个端口都是一个固定目标
+//   addr 为 ip/len 网段时整行是一条规则，不展开，探测时按 sweep 指定的周期(默认 SWEEP_PASS_MS)轮流扫描，
+//   有应答的地址才成为目标，rules 为 NULL 时忽略规则行
+// ports 为逗号分隔的端口或端口区间，如 80,443,8000-8010。另外支持以 @ 开头的指令行:
+//   @interval ms            未指定间隔的目标默认探测间隔
+//   @interval ms service    指定服务的探测间隔
+//   @exclude addr           规则扫描时跳过的 ip 或 ip/len 网段
+//   @check kind service [timeout=ms]
+//                           SYN-ACK 之后对指定服务的目标做应用层检查，kind 为 http[:path]、redis、mysql[:user] 或 tcp(不检查)，
+//                           mysql 指定无密码的用户时登录后发送 COM_QUIT 正常退出，否则每次检查都是服务端的一次连接错误
+int get_hosts(const char* f, std::vector<target_line> &lines, target_rules *rules = NULL) {
+    FILE* fp = fopen(f, "r");
+    if (!fp) return -1;
+
+    lines.clear();
+    if (rules) rules->clear();
+    uint32_t default_interval = 0;
+    std::unordered_map<std::string, uint32_t> serv_interval;
+
+    char buf[512];
+    target_line line;
+    std::vector<port_range> ports;
+    while (fgets(buf, sizeof(buf), fp)) {
+        unsigned int _ms = 0;
+        if (buf[0] == '@') {
+            char _service[MAX_SERVICE_LEN] = {'\0', };
+            char _spec[256] = {'\0', };
+            ip_range _range;
+            app_check _check;
+            int n = sscanf(buf, "@interval %u %127[^\r\n]", &_ms, _service);
+            if (n == 1) {
+                default_interval = _ms;
+            } else if (n == 2) {
+                serv_interval[_service] = _ms;
+            } else if (sscanf(buf, "@exclude %127s", _service) == 1 && parse_cidr(_service, _range)) {
+                if (rules) rules->excludes.push_back(_range);
+            } else if (sscanf(buf, "@check %255s %127[^\r\n]", _spec, _service) == 2 && parse_check(_spec, _check)) {
+                unsigned int _timeout = CHECK_TIMEOUT_MS, _unused = 0;
+                take_options(_service, _unused, _unused, &_timeout);
+                _check.service    = _service;
+                _check.timeout_ms = _timeout ? _timeout : CHECK_TIMEOUT_MS;
+                if (rules) rules->checks.push_back(_check);
+            } else {
+                fprintf(stderr, "WARNING: Invliad directive: %s", buf);
+            }
+            continue;
+        }
+
+        char _addr_str[32] = {'\0', };
+        char _port_str[256] = {'\0', };
+        if (sscanf(buf, "%31[0-9./]:%255[0-9,-] %127[^\r\n]", _addr_str, _port_str, line.service) != 3) {
+            continue;
+        }
+
+        ip_range _range;
+        if (!parse_cidr(_addr_str, _range) || !parse_ports(_port_str, ports)) {
+            fprintf(stderr, "WARNING: Invliad host rec, ip:%s, port:%s, srv: %s\n", _addr_str, _port_str, line.service);
+            continue;
+        }
+
+        // optional trailing interval=ms overrides the interval of the service, sweep=ms sets the pass of a rule
+        unsigned int _interval = 0, _pass = SWEEP_PASS_MS;
+        take_options(line.service, _interval, _pass);
+
+        if (strchr(_addr_str, '/')) {
+            if (!rules) continue;
+            target_rule rule;
+            rule.addrs       = _range;
+            rule.ports       = ports;
+            rule.interval_ms = _interval;
+            rule.pass_ms     = _pass ? _pass : SWEEP_PASS_MS;
+            rule.service     = line.service;
+            rules->rules.push_back(rule);
+            continue;
+        }
+
+        line.ip          = htonl(_range.lo);
+        line.interval_ms = _interval;
+        for (const port_range &r : ports) {
+            for (uint32_t port = r.lo; port <= r.hi; ++port) {
+                line.port = htons(port);
+                lines.push_back(line);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < lines.size(); ++i) {
+        if (lines[i].interval_ms) continue;
+        std::unordered_map<std::string, uint32_t>::iterator it = serv_interval.find(lines[i].service);
+        lines[i].interval_ms = (it == serv_interval.end()) ? default_interval : it->second;
+    }
+    size_t rule_cnt = 0;
+    if (rules) {
+        for (target_rule &r : rules->rules) {
+            if (r.interval_ms) continue;
+            std::unordered_map<std::string, uint32_t>::iterator it = serv_interval.find(r.service);
+            r.interval_ms = (it == serv_interval.end()) ? default_interval : it->second;
+        }
+        rule_cnt = rules->rules.size();
+    }
+
+    fclose(fp);
+    return (int)(lines.size() + rule_cnt);
+}
+
+// 目标文件中的顺序: 按 ip 再按端口排序，重复的 ip:port 保留第一行
+inline bool line_less(const target_line &a, const target_line &b) {
+    return a.ip != b.ip ? a.ip < b.ip : a.port < b.port;
+}
+
+inline bool line_equal(const target_line &a, const target_line &b) {
+    return a.ip == b.ip && a.port == b.port;
+}
+
+static size_t snapshot_align(size_t off) {
+    return (off + 7) & ~(size_t)7;
+}
+
+// 把文本格式的目标文件编译为快照(target_snapshot.hpp)，返回目标数，失败返回 -1
+// 先写临时文件再 rename 到 dst，正在监听 dst 的 nurse 只会看到完整的新版本
+int compile_hosts(const char *src, const char *dst) {
+    std::vector<target_line> lines;
+    target_rules rules;
+    if (get_hosts(src, lines, &rules) < 0) {
+        fprintf(stderr, "ERROR: Can't read file %s\n", src);
+        return -1;
+    }
+    std::stable_sort(lines.begin(), lines.end(), line_less);
+    lines.erase(std::unique(lines.begin(), lines.end(), line_equal), lines.end());
+
+    // service names in order of first use, beyond 65536 names the rest share the last one like in the target table
+    std::vector<std::string> names;
+    std::unordered_map<std::string, uint32_t> name_index;
+    auto serv_of = [&](const char *name) -> uint32_t {
+        std::unordered_map<std::string, uint32_t>::iterator it = name_index.find(name);
+        if (it != name_index.end()) return it->second;
+        if (names.size() > 0xffff) return 0xffff;
+        names.emplace_back(name);
+        name_index[names.back()] = names.size() - 1;
+        return names.size() - 1;
+    };
+
+    std::vector<snapshot_rec> recs(lines.size());
+    for (size_t i = 0; i < lines.size(); ++i) {
+        recs[i].ip          = lines[i].ip;
+        recs[i].port        = lines[i].port;
+        recs[i].serv        = (uint16_t)serv_of(lines[i].service);
+        recs[i].interval_ms = lines[i].interval_ms;
+    }
+    std::vector<snapshot_rule> rule_recs(rules.rules.size());
+    std::vector<port_range> ranges;
+    for (size_t i = 0; i < rules.rules.size(); ++i) {
+        const target_rule &r = rules.rules[i];
+        memset(&rule_recs[i], 0, sizeof(snapshot_rule));
+        rule_recs[i].ip_lo       = r.addrs.lo;
+        rule_recs[i].ip_hi       = r.addrs.hi;
+        rule_recs[i].interval_ms = r.interval_ms;
+        rule_recs[i].pass_ms     = r.pass_ms;
+        rule_recs[i].range_begin = ranges.size();
+        rule_recs[i].range_num   = r.ports.size();
+        rule_recs[i].serv        = serv_of(r.service.c_str());
+        ranges.insert(ranges.end(), r.ports.begin(), r.ports.end());
+    }
+    std::vector<snapshot_check> check_recs(rules.checks.size());
+    for (size_t i = 0; i < rules.checks.size(); ++i) {
+        memset(&check_recs[i], 0, sizeof(snapshot_check));
+        check_recs[i].serv       = serv_of(rules.checks[i].service.c_str());
+        check_recs[i].arg        = serv_of(rules.checks[i].arg.c_str());
+        check_recs[i].kind       = rules.checks[i].kind;
+        check_recs[i].timeout_ms = rules.checks[i].timeout_ms;
+    }
+    std::vector<uint32_t> offs(1, 0);
+    std::string strs;
+    for (const std::string &name : names) {
+        strs.append(name.c_str(), name.size() + 1);
+        offs.push_back(strs.size());
+    }
+
+    snapshot_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version     = SNAPSHOT_VERSION;
+    hdr.header_size = sizeof(snapshot_header);
+    hdr.rec_num     = recs.size();
+    hdr.serv_num    = names.size();
+    hdr.rule_num    = rule_recs.size();
+    hdr.range_num   = ranges.size();
+    hdr.exclude_num = rules.excludes.size();
+    hdr.check_num   = check_recs.size();
+    hdr.str_size    = strs.size();
+    hdr.rec_off     = snapshot_align(sizeof(snapshot_header));
+    hdr.serv_off    = snapshot_align(hdr.rec_off + recs.size() * sizeof(snapshot_rec));
+    hdr.rule_off    = snapshot_align(hdr.serv_off + offs.size() * sizeof(uint32_t) + strs.size());
+    hdr.range_off   = snapshot_align(hdr.rule_off + rule_recs.size() * sizeof(snapshot_rule));
+    hdr.exclude_off = snapshot_align(hdr.range_off + ranges.size() * sizeof(port_range));
+    hdr.check_off   = snapshot_align(hdr.exclude_off + rules.excludes.size() * sizeof(ip_range));
+    hdr.file_size   = snapshot_align(hdr.check_off + check_recs.size() * sizeof(snapshot_check));
+
+    std::vector<char> buf(hdr.file_size, 0);
+    if (!recs.empty()) memcpy(&buf[hdr.rec_off], recs.data(), recs.size() * sizeof(snapshot_rec));
+    memcpy(&buf[hdr.serv_off], offs.data(), offs.size() * sizeof(uint32_t));
+    if (!strs.empty()) memcpy(&buf[hdr.serv_off + offs.size() * sizeof(uint32_t)], strs.data(), strs.size());
+    if (!rule_recs.empty()) memcpy(&buf[hdr.rule_off], rule_recs.data(), rule_recs.size() * sizeof(snapshot_rule));
+    if (!ranges.empty()) memcpy(&buf[hdr.range_off], ranges.data(), ranges.size() * sizeof(port_range));
+    if (!rules.excludes.empty()) memcpy(&buf[hdr.exclude_off], rules.excludes.data(), rules.excludes.size() * sizeof(ip_range));
+    if (!check_recs.empty()) memcpy(&buf[hdr.check_off], check_recs.data(), check_recs.size() * sizeof(snapshot_check));
+    hdr.checksum = snapshot_sum(&buf[sizeof(snapshot_header)], buf.size() - sizeof(snapshot_header));
+    memcpy(&buf[0], &hdr, sizeof(hdr));
+
+    std::string tmp = std::string(dst) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp) {
+        fprintf(stderr, "ERROR: Can't write file %s, %s\n", tmp.c_str(), strerror(errno));
+        return -1;
+    }
+    bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size() && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), dst) != 0) {
+        fprintf(stderr, "ERROR: Write snapshot %s failed, %s\n", dst, strerror(errno));
+        unlink(tmp.c_str());
+        return -1;
+    }
+    return (int)recs.size();
+}
+
+// Watch the target file and turn every new version into a diff against the version the prober applied
+// Parsing and diffing run on the watcher thread, the prober only picks up the ready diff without blocking
+// The file is either text or a compiled snapshot, a snapshot is mapped and diffed in place record by record
+// Targets out of the shard of this instance are left out of the diff, rules are taken as they are
+class TargetWatcher {
+    public:
+        TargetWatcher(const std::string &f, const TargetShard &s = TargetShard()) : path(f), shard(s), inotify_fd(-1), watch_wd(-1),
+            has_pending(false), pending_taken(false), has_rules(false), stop(false) {
+            memset(&last_st, 0, sizeof(last_st));
+
+            size_t pos = path.rfind('/');
+            dir  = (pos == std::string::npos) ? "." : (pos == 0 ? "/" : path.substr(0, pos));
+            name = (pos == std::string::npos) ? path : path.substr(pos + 1);
+
+            // watch the directory, so files replaced by rename(e.g. from naming service or crontab) are seen too
+            inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotify_fd >= 0) {
+                watch_wd = inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+            }
+            if (watch_wd < 0) {
+                fprintf(stderr, "WARNING: Watch %s with inotify failed, %s, check file by stat every %d ms\n",
+                    dir.c_str(), strerror(errno), WATCH_FALLBACK_MS);
+            }
+        }
+
+        ~TargetWatcher() {
+            stop = true;
+            if (worker.joinable()) worker.join();
+            if (inotify_fd >= 0) close(inotify_fd);
+        }
+
+        // Load the file once in the calling thread, then keep watching it in background
+        int start() {
+            int cnt = load();
+            worker = std::thread([this] { this->run(); });
+            return cnt;
+        }
+
+        // Load the file once in the calling thread without watching it, the result is taken as after start()
+        int load() { return reload(); }
+
+        // Take the pending diff if there is one, never waits for the watcher thread
+        bool take(target_diff &diff) {
+            std::unique_lock<std::mutex> lock(mtx, std::try_to_lock);
+            if (!lock.owns_lock() || !has_pending) {
+                return false;
+            }
+            diff.clear();
+            diff.swap(pending);
+            has_pending   = false;
+            pending_taken = true;
+            return true;
+        }
+
+        // Take the rules if they changed since last taken, never waits for the watcher thread
+        bool take_rules(target_rules &rules) {
+            std::unique_lock<std::mutex> lock(mtx, std::try_to_lock);
+            if (!lock.owns_lock() || !has_rules) {
+                return false;
+            }
+            rules = pending_rules;
+            has_rules = false;
+            return true;
+        }
+
+    private:
+        // accessors of the two kinds of sorted versions, parsed lines or a mapped snapshot
+        static size_t entries(const std::vector<target_line> &v) { return v.size(); }
+        static size_t entries(const TargetSnapshot &v) { return v.records(); }
+        static uint64_t entry_key(const std::vector<target_line> &v, size_t i) { return ((uint64_t)v[i].ip << 16) | v[i].port; }
+        static uint64_t entry_key(const TargetSnapshot &v, size_t i) { return ((uint64_t)v.rec(i).ip << 16) | v.rec(i).port; }
+        static const char* entry_service(const std::vector<target_line> &v, size_t i) { return v[i].service; }
+        static const char* entry_service(const TargetSnapshot &v, size_t i) { return v.service(v.rec(i).serv); }
+        static uint32_t entry_interval(const std::vector<target_line> &v, size_t i) { return v[i].interval_ms; }
+        static uint32_t entry_interval(const TargetSnapshot &v, size_t i) { return v.rec(i).interval_ms; }
+
+        void add_removed(const std::vector<target_line> &v, size_t i) { pending.removed.push_back(v[i]); }
+        void add_removed(const TargetSnapshot &v, size_t i) {
+            target_line line;
+            line.ip   = v.rec(i).ip;
+            line.port = v.rec(i).port;
+            pending.removed.push_back(line);
+        }
+        void add_added(const std::vector<target_line> &v, size_t i) { pending.added.push_back(v[i]); }
+        void add_added(const TargetSnapshot &, size_t i) { pending.snap_added.push_back(i); }
+
+        bool owned(uint64_t key) const { return shard.owns((uint32_t)(key >> 16), (uint16_t)key); }
+
+        // merge the two sorted versions into pending
+        template<class A, class B>
+        void merge(const A &old_v, const B &new_v) {
+            size_t i = 0, j = 0;
+            size_t old_num = entries(old_v), new_num = entries(new_v);
+            while (i < old_num || j < new_num) {
+                if (j == new_num || (i < old_num && entry_key(old_v, i) < entry_key(new_v, j))) {
+                    if (owned(entry_key(old_v, i))) add_removed(old_v, i);
+                    ++i;
+                } else if (i == old_num || entry_key(new_v, j) < entry_key(old_v, i)) {
+                    if (owned(entry_key(new_v, j))) add_added(new_v, j);
+                    ++j;
+                } else {
+                    if (owned(entry_key(new_v, j)) && (strcmp(entry_service(old_v, i), entry_service(new_v, j)) != 0
+                        || entry_interval(old_v, i) != entry_interval(new_v, j))) {
+                        add_added(new_v, j);
+                    }
+                    ++i;
+                    ++j;
+                }
+            }
+        }
+
+        bool file_changed() {
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0) return false;
+            bool changed = st.st_ino != last_st.st_ino || st.st_size != last_st.st_size
+                || st.st_mtim.tv_sec != last_st.st_mtim.tv_sec || st.st_mtim.tv_nsec != last_st.st_mtim.tv_nsec;
+            return changed;
+        }
+
+        // return true if an event about the target file arrived
+        bool drain_events() {
+            char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+            bool hit = false;
+            while (true) {
+                ssize_t len = read(inotify_fd, buf, sizeof(buf));
+                if (len <= 0) break;
+                for (char *ptr = buf; ptr < buf + len; ) {
+                    struct inotify_event *event = (struct inotify_event *)ptr;
+                    if (event->len && name == event->name) hit = true;
+                    ptr += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            return hit;
+        }
+
+        void run() {
+            long int last_check_ms = get_ms();
+            while (!stop) {
+                bool hit = false;
+                if (watch_wd >= 0) {
+                    struct pollfd pfd;
+                    pfd.fd      = inotify_fd;
+                    pfd.events  = POLLIN;
+                    pfd.revents = 0;
+                    if (poll(&pfd, 1, WATCH_POLL_MS) > 0) {
+                        hit = drain_events();
+                    }
+                } else {
+                    usleep(WATCH_POLL_MS * 1000);
+                }
+
+                // stat fallback in case events are lost or inotify is not available
+                if (!hit && get_ms() - last_check_ms >= WATCH_FALLBACK_MS) {
+                    last_check_ms = get_ms();
+                    hit = file_changed();
+                }
+                if (hit && file_changed()) {
+                    reload();
+                }
+            }
+        }
+
+        // Parse the file and publish the diff against the version the prober has
+        int reload() {
+            long int begin_ms = get_ms();
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0) {
+                return -1;
+            }
+
+            std::shared_ptr<TargetSnapshot> snap;
+            int cnt = 0;
+            if (is_snapshot(path.c_str())) {
+                snap.reset(new TargetSnapshot());
+                if (!snap->open(path.c_str())) {
+                    return -1;
+                }
+                snap->get_rules(parsed_rules);
+                parsed.clear();
+                cnt = (int)(snap->records() + parsed_rules.rules.size());
+            } else {
+                cnt = get_hosts(path.c_str(), parsed, &parsed_rules);
+                if (cnt < 0) {
+                    return -1;
+                }
+                // keep the first line of a duplicated ip:port
+                std::stable_sort(parsed.begin(), parsed.end(), line_less);
+                parsed.erase(std::unique(parsed.begin(), parsed.end(), line_equal), parsed.end());
+            }
+            last_st = st;
+
+            std::lock_guard<std::mutex> lock(mtx);
+            if (pending_taken) {
+                base.swap(latest);
+                base_snap = latest_snap;
+                pending_taken = false;
+            }
+
+            pending.clear();
+            if (base_snap) {
+                if (snap) merge(*base_snap, *snap);
+                else merge(*base_snap, parsed);
+            } else {
+                if (snap) merge(base, *snap);
+                else merge(base, parsed);
+            }
+            pending.snap = snap;
+            has_pending = !pending.empty();
+            latest.swap(parsed);
+            latest_snap = snap;
+
+            bool rules_changed = parsed_rules != pending_rules;
+            if (rules_changed) {
+                pending_rules = parsed_rules;
+                has_rules = true;
+            }
+
+            char slice[32] = {'\0', };
+            if (shard.sharded()) snprintf(slice, sizeof(slice), " for shard %u/%u", shard.get_index(), shard.get_count());
+            fprintf(stderr, "NOTICE: Load %s%s with %d lines%s, %zu added, %zu removed, %zu rules%s, cost %ld ms\n",
+                snap ? "snapshot " : "", path.c_str(), cnt, slice, pending.added_size(), pending.removed.size(), pending_rules.rules.size(),
+                rules_changed ? " changed" : "", get_ms() - begin_ms);
+            return cnt;
+        }
+
+        static long int get_ms() {
+            struct timespec _cur_ts;
+            clock_gettime(CLOCK_MONOTONIC_RAW, &_cur_ts);
+            return _cur_ts.tv_sec*1000 + _cur_ts.tv_nsec/1000000;
+        }
+
+    private:
+        std::string   path;
+        TargetShard   shard;
+        std::string   dir;
+        std::string   name;
+        int           inotify_fd;
+        int           watch_wd;
+        struct stat   last_st;
+
+        // versions of the file: base is what the prober has, latest is the newest parsed one,
+        // each one either lines of a text file or a mapped snapshot
+        std::vector<target_line>   base;
+        std::vector<target_line>   latest;
+        std::vector<target_line>   parsed;
+        std::shared_ptr<TargetSnapshot>  base_snap;
+        std::shared_ptr<TargetSnapshot>  latest_snap;
+        target_rules               parsed_rules;
+
+        std::mutex          mtx;
+        target_diff         pending;
+        bool                has_pending;
+        bool                pending_taken;
+        target_rules        pending_rules;  // latest rules, taken as a whole since the sweep has no per address state
+        bool                has_rules;
+
+        std::atomic<bool>   stop;
+        std::thread         worker;
+};
+
+#endif
@@ -2,87 +2,244 @@
 #define __THREAD_POOL_H__
 
 #include <vector>
-#include <queue>
 #include <memory>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
-#include <future>
 #include <functional>
 #include <stdexcept>
+#include <atomic>
+
+// capacity of the task queue of each worker, must be a power of two
+#define POOL_QUEUE_SIZE 4096
+// rounds a worker looks for tasks before it goes to sleep
+#define POOL_SPIN_ROUNDS 64
+
+/*
+ * Ref: http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ * Bounded multi-producer multi-consumer queue, every cell carries a sequence number telling
+ * whether it is ready for the next push or the next pop, so both ends only need one CAS.
+ */
+template<class T>
+class TaskQueue {
+    private:
+        struct cell {
+            std::atomic<size_t> seq;
+            T                   data;
+        };
+
+        std::unique_ptr<cell[]>  cells;
+        size_t                   mask;
+        // producers and consumers work on different cache lines
+        std::atomic<size_t>      enq_pos;
+        char                     pad[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t>      deq_pos;
+
+    public:
+        TaskQueue(size_t size) : cells(new cell[size]), mask(size - 1), enq_pos(0), deq_pos(0) {
+            for (size_t i = 0; i < size; ++i) {
+                cells[i].seq.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        // return false if the queue is full
+        bool push(T &&data) {
+            size_t pos = enq_pos.load(std::memory_order_relaxed);
+            cell *c = NULL;
+            while (true) {
+                c = &cells[pos & mask];
+                size_t seq = c->seq.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                if (diff == 0) {
+                    if (enq_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = enq_pos.load(std::memory_order_relaxed);
+                }
+            }
+            c->data = std::move(data);
+            c->seq.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        // return false if the queue is empty
+        bool pop(T &data) {
+            size_t pos = deq_pos.load(std::memory_order_relaxed);
+            cell *c = NULL;
+            while (true) {
+                c = &cells[pos & mask];
+                size_t seq = c->seq.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+                if (diff == 0) {
+                    if (deq_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = deq_pos.load(std::memory_order_relaxed);
+                }
+            }
+            data = std::move(c->data);
+            c->seq.store(pos + mask + 1, std::memory_order_release);
+            return true;
+        }
+};
 
+// Thread pool with one lock-free task queue per worker
+// Tasks are spread over the queues round robin, a worker drains its own queue first and then steals
+// from the others. The mutex and condition variable are only touched to put idle workers to sleep
+// and to wake them up, never on the path of a busy pool.
 class ThreadPool {
     private:
+        typedef std::function<void()> task_type;
+
         std::vector< std::thread > workers;
-        std::queue< std::function<void()> > tasks;
+        std::vector< std::unique_ptr< TaskQueue<task_type> > > queues;
 
-        std::mutex queue_mutex;
+        std::atomic<size_t> next_queue;
+        std::atomic<size_t> queued;
+        std::atomic<size_t> sleeping;
+
+        std::mutex sleep_mutex;
         std::condition_variable condition;
-        bool stop;
+        std::atomic<bool> stop;
+
+        bool try_pop(size_t self, task_type &task);
+        void worker_loop(size_t self);
 
     public:
         ThreadPool(size_t);
-        template<class F, class... Args>
-        auto enqueue(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>;
         ~ThreadPool();
+
+        // fire and forget, no future and no shared state, tasks must not throw
+        template<class F>
+        void submit(F&& f);
+
+        // Bulk submission: call f(begin, end) over [0, num) in chunks of at most chunk items,
+        // the workers and the calling thread take chunks from a shared cursor, return when every chunk is done
+        template<class F>
+        void run_range(size_t num, size_t chunk, F&& f);
+
+        size_t size() const { return workers.size(); }
+
+        // tasks waiting for a worker, readable without any lock
+        size_t queue_size() const { return queued.load(std::memory_order_relaxed); }
 };
 
 // the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(size_t threads) : stop(false) {
+inline ThreadPool::ThreadPool(size_t threads) : next_queue(0), queued(0), sleeping(0), stop(false) {
+    if (threads == 0) threads = 1;
     for (size_t i = 0; i < threads; ++i) {
-        workers.emplace_back (
-            [this] {
-                while (true) {
-                    std::function<void()> task;
-
-                    {
-                        std::unique_lock<std::mutex> lock(this->queue_mutex);
-                        this->condition.wait(lock, [this] {
-                            return this->stop || !this->tasks.empty();
-                        });
-                        if (this->stop && this->tasks.empty()) {
-                            return;
-                        }
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
-                    }
-
-                    task();
-                }
-            }
-        );
+        queues.emplace_back(new TaskQueue<task_type>(POOL_QUEUE_SIZE));
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([this, i] { this->worker_loop(i); });
     }
 }
 
-// add new work item to the pool
-template<class F, class... Args>
-auto ThreadPool::enqueue(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type> {
-    if(stop) {
-        throw std::runtime_error("enqueue on stopped ThreadPool");
+inline bool ThreadPool::try_pop(size_t self, task_type &task) {
+    for (size_t i = 0; i < queues.size(); ++i) {
+        if (queues[(self + i) % queues.size()]->pop(task)) {
+            --queued;
+            return true;
+        }
     }
+    return false;
+}
 
-    using return_type = typename std::result_of<F(Args...)>::type;
+inline void ThreadPool::worker_loop(size_t self) {
+    task_type task;
+    while (true) {
+        bool found = false;
+        for (int round = 0; round < POOL_SPIN_ROUNDS && !found; ++round) {
+            found = try_pop(self, task);
+            if (!found) std::this_thread::yield();
+        }
+        if (found) {
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        // announce the sleep before checking for work again, so a submit either sees the sleeper or the sleeper sees the task
+        std::unique_lock<std::mutex> lock(this->sleep_mutex);
+        ++sleeping;
+        this->condition.wait(lock, [this] {
+            return this->stop || this->queued.load() > 0;
+        });
+        --sleeping;
+        if (this->stop && this->queued.load() == 0) {
+            return;
+        }
+    }
+}
 
-    auto task = std::make_shared< std::packaged_task<return_type()> > (
-        std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-    );
+// add new work item to the pool, run it in place if every queue is full
+template<class F>
+void ThreadPool::submit(F&& f) {
+    if (stop) {
+        throw std::runtime_error("submit on stopped ThreadPool");
+    }
 
-    std::future<return_type> res = task->get_future();
+    // count the task before it becomes visible, so a worker never takes it below zero
+    task_type task(std::forward<F>(f));
+    ++queued;
+    size_t start = next_queue.fetch_add(1, std::memory_order_relaxed);
+    bool pushed = false;
+    for (size_t i = 0; i < queues.size() && !pushed; ++i) {
+        pushed = queues[(start + i) % queues.size()]->push(std::move(task));
+    }
+    if (!pushed) {
+        --queued;
+        task();
+        return;
+    }
 
-    {
-        std::lock_guard<std::mutex> lock(queue_mutex);
-        tasks.emplace([task](){ (*task)(); });
+    if (sleeping.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        condition.notify_one();
     }
+}
 
-    condition.notify_one();
+template<class F>
+void ThreadPool::run_range(size_t num, size_t chunk, F&& f) {
+    if (num == 0) return;
+    if (chunk == 0) chunk = 1;
 
-    return res;
+    size_t chunks = (num + chunk - 1) / chunk;
+    size_t helpers = (chunks - 1 < workers.size()) ? chunks - 1 : workers.size();
+    if (helpers == 0) {
+        f((size_t)0, num);
+        return;
+    }
+
+    // the shared state lives on this stack frame, so wait for every helper before returning
+    std::atomic<size_t> cursor(0);
+    std::atomic<size_t> finished(0);
+    auto work = [&cursor, &f, num, chunk]() {
+        while (true) {
+            size_t begin = cursor.fetch_add(chunk);
+            if (begin >= num) break;
+            f(begin, (begin + chunk < num) ? begin + chunk : num);
+        }
+    };
+
+    for (size_t i = 0; i < helpers; ++i) {
+        submit([&work, &finished]() {
+            work();
+            ++finished;
+        });
+    }
+    work();
+    while (finished.load() < helpers) {
+        std::this_thread::yield();
+    }
 }
 
-// the destructor joins all threads
+// the destructor lets the workers drain their queues, then joins them
 inline ThreadPool::~ThreadPool() {
     {
-        std::lock_guard<std::mutex> lock(queue_mutex);
+        std::lock_guard<std::mutex> lock(sleep_mutex);
         stop = true;
     }
     condition.notify_all();
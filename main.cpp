@@ -1,6 +1,16 @@
-#include "health_state.hpp"
-#include "thread_pool.hpp"
+#include "health_table.hpp"
+#include "host_groups.hpp"
+#include "notifier.hpp"
+#include "alert_coalescer.hpp"
 #include "host_prob.hpp"
+#include "target_table.hpp"
+#include "target_watcher.hpp"
+#include "target_shard.hpp"
+#include "health_store.hpp"
+#include "app_prob.hpp"
+#include "probe_scheduler.hpp"
+#include "latency_histogram.hpp"
+#include "metrics.hpp"
 
 #include <cstring>
 #include <unordered_map>
@@ -10,37 +20,14 @@
 #include <curl/curl.h>
 #include <exception>
 
-#define MAX_MESG_THREAD 2
 #define MAX_EVENTS 10
-
-int get_hosts(const char* f, std::vector<struct host_addr> &hosts, std::unordered_map<std::string, std::string> &serv_dict) {
-    FILE* fp = fopen(f, "r");
-    if (!fp) return 0;
-
-    int cnt = 0;
-    while (!feof(fp)) {
-        char _ip[INET_ADDRSTRLEN] = {'\0', };
-        int  _port = 0;
-        char _service[128] = {'\0', };
-        if (fscanf(fp, "%16[0-9.]:%d %[^\r\n]%*c", _ip, &_port, _service) != 3) {
-            continue;
-        }
-
-        host_addr _host(_ip, _port);
-
-        if (!_host.valid || _port < 1 || _port > 65535) {
-            fprintf(stderr, "WARNING: Invliad host rec:%s, ip:%s, port:%d, srv: %s\n", _host.to_str().c_str(), _host.ip, _host.port, _service);
-            continue;
-        }
-
-        hosts.emplace_back(_host);
-        serv_dict[_host.to_str()] = std::string(_service);
-        ++cnt;
-    }
-
-    fclose(fp);
-    return cnt;
-}
+#define REPORT_PERIOD_MS 1000
+#define LATENCY_MIN_SAMPLES 10
+// 连续收到这么多次 RST 或 ICMP 不可达即判定失败
+#define REFUSE_FAIL_CNT 2
+// 有规则时循环最长等待这么久，扫描探测均匀发出; 每轮最多发出的扫描探测数
+#define SWEEP_TICK_MS 10
+#define SWEEP_BATCH_MAX 4096
 
 inline long int get_cur_ms() {
     struct timespec _cur_ts;
@@ -48,38 +35,76 @@ inline long int get_cur_ms() {
     return _cur_ts.tv_sec*1000 + _cur_ts.tv_nsec/1000000;
 }
 
-int http_post(const std::string &url, const std::string &body, long timeout_ms) {
-    CURL* curl = curl_easy_init();
-    if (!curl) return -1;
-
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json;charset=utf-8");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+inline long int get_cur_us() {
+    struct timespec _cur_ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &_cur_ts);
+    return _cur_ts.tv_sec*1000000 + _cur_ts.tv_nsec/1000;
+}
 
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
-    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, timeout_ms);
-    curl_easy_setopt(curl, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4);
+// 健康状态判定窗口(探测轮数): 默认 1 秒间隔时最近 5 轮中失败 3 轮判定为失活
+// 间隔更短时窗口至少覆盖 5 秒，最多 HEALTH_MAX_WINDOW 轮
+inline uint32_t fail_window_cycles(uint32_t interval_ms) {
+    uint32_t cycles = (interval_ms >= 1000) ? 5 : (5000 + interval_ms - 1) / interval_ms;
+    return cycles > HEALTH_MAX_WINDOW ? HEALTH_MAX_WINDOW : cycles;
+}
 
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        fprintf(stderr, "%s\n", curl_easy_strerror(res));
+// JSON 字符串转义，服务名和换行都会进入消息正文
+std::string json_escape(const std::string &in) {
+    std::string out;
+    out.reserve(in.size() + 16);
+    for (char ch : in) {
+        switch (ch) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)ch < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)ch);
+                    out += buf;
+                } else {
+                    out += ch;
+                }
+        }
     }
+    return out;
+}
 
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
-    fprintf(stderr, "DEBUG: Curl post success\n");
-
-    return res;
+// 钉钉机器人 markdown 消息体
+std::string robot_body(const std::string &title, const std::string &text) {
+    return "{\"msgtype\": \"markdown\",\"markdown\": {\"title\":\""+title+"\",\"text\":\""+json_escape(text)+"\"},\"at\":{\"atMobiles\":[\"13811626017\"], \"isAtAll\": false}}";
 }
 
 int main(int argc, char* argv[]) {
+    // nurse compile <文本目标文件> <快照文件>: 编译为二进制快照，-f 指定快照时启动和重载时直接映射使用
+    if (argc >= 2 && strcmp(argv[1], "compile") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: %s compile <target file> <snapshot file>\n", argv[0]);
+            exit(1);
+        }
+        long int begin_ms = get_cur_ms();
+        int cnt = compile_hosts(argv[2], argv[3]);
+        if (cnt < 0) {
+            exit(1);
+        }
+        fprintf(stderr, "NOTICE: Compile %s into %s with %d targets, cost %ld ms\n", argv[2], argv[3], cnt, get_cur_ms() - begin_ms);
+        exit(0);
+    }
+
     // 解析选项
-    std::string data_file = "", dingding_robot = "";
+    std::string data_file = "", dingding_robot = "", metrics_addr = "", state_file = "";
+    bool batch_send = true;
+    int capture_mode = CAPTURE_RING;
+    int capture_threads = 1;
+    uint32_t max_pps = 0;
+    uint32_t p99_alert_ms = 0;
+    long int alert_window_ms = ALERT_WINDOW_MS;
+    uint32_t max_interval_ms = 0;
+    TargetShard shard;
+    uint16_t port_lo = 0, port_hi = 0;
     int opt = 0;
-    while ((opt = getopt(argc, argv, "f:r:h")) != -1) {
+    while ((opt = getopt(argc, argv, "f:r:s:c:t:p:b:l:m:w:k:n:P:h")) != -1) {
         switch(opt) {
             case 'f':
                 data_file = optarg;
@@ -87,12 +112,72 @@ int main(int argc, char* argv[]) {
             case 'r':
                 dingding_robot = optarg;
                 break;
+            case 's':
+                batch_send = (strcmp(optarg, "single") != 0);
+                break;
+            case 'c':
+                capture_mode = (strcmp(optarg, "recv") == 0) ? CAPTURE_RECV : CAPTURE_RING;
+                break;
+            case 't':
+                capture_threads = atoi(optarg);
+                break;
+            case 'p':
+                max_pps = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                max_interval_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                p99_alert_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                metrics_addr = optarg;
+                break;
+            case 'w':
+                alert_window_ms = strtol(optarg, NULL, 10);
+                break;
+            case 'k':
+                state_file = optarg;
+                break;
+            case 'P': {
+                unsigned int lo = 0, hi = 0;
+                int n = sscanf(optarg, "%u-%u", &lo, &hi);
+                if (n == 1) hi = lo;
+                if (n < 1 || lo == 0 || hi < lo || hi > 65535) {
+                    fprintf(stderr, "Error: bad source port range %s, expect lo-hi\n", optarg);
+                    exit(1);
+                }
+                port_lo = (uint16_t)lo;
+                port_hi = (uint16_t)hi;
+                break;
+            }
+            case 'n':
+                if (!shard.parse(optarg)) {
+                    fprintf(stderr, "Error: bad shard %s, expect index/count with index below count and count up to %d\n", optarg, SHARD_MAX);
+                    exit(1);
+                }
+                break;
             case 'h':
             case '?':
             default:
-                fprintf(stderr, "Usage: %s -[frh]\n",argv[0]);
+                fprintf(stderr, "Usage: %s -[frsctpblmwknPh]\n       %s compile <target file> <snapshot file>\n", argv[0], argv[0]);
                 fprintf(stderr, "\t-f\tfile contains detect target with format:[ip:port\\tserv_name], ie.: 192.168.0.1:80\ttest\n");
+                fprintf(stderr, "\t  \toptional per target interval: [ip:port\\tserv_name interval=ms], per service or default: [@interval ms [serv_name]]\n");
+                fprintf(stderr, "\t  \tport lists and cidr rules swept for open ports: [10.1.0.0/16:80,443,8000-8010\\tserv_name sweep=ms], [@exclude ip[/len]]\n");
+                fprintf(stderr, "\t  \tapplication check of a service after its SYN-ACK: [@check http[:/path]|redis|mysql[:user]|tcp serv_name [timeout=ms]]\n");
+                fprintf(stderr, "\t  \tor a binary snapshot made by compile, mapped in place\n");
                 fprintf(stderr, "\t-r\tdingding robot url\n");
+                fprintf(stderr, "\t-s\tsend mode, batch: prebuilt datagrams sent with sendmmsg(default), single: one sendto per target\n");
+                fprintf(stderr, "\t-c\tcapture mode, ring: mmap TPACKET_V3 rx ring(default), recv: one recvfrom per reply\n");
+                fprintf(stderr, "\t-t\tcapture threads, more than 1 spreads replies over a PACKET_FANOUT group of sockets, 1 by default\n");
+                fprintf(stderr, "\t-p\tmax packets per second to send, 0 for unlimited(default)\n");
+                fprintf(stderr, "\t-b\tback off targets answering steadily up to this probe interval in ms, 0 keeps their interval(default)\n");
+                fprintf(stderr, "\t-l\talert when p99 connect latency of a target exceeds this many ms, 0 for no alert(default)\n");
+                fprintf(stderr, "\t-m\tserve prometheus metrics on [ip:]port(ip defaults to 127.0.0.1) or unix:/path, disabled by default\n");
+                fprintf(stderr, "\t-w\talert coalescing window in ms, state changes within it go out as one message, %d by default\n", ALERT_WINDOW_MS);
+                fprintf(stderr, "\t-k\tkeep health states in this file, a restart picks up which targets are down, disabled by default\n");
+                fprintf(stderr, "\t-n\tprobe shard index/count of the targets, count instances reading the same file split them by consistent hash, 0/1 by default\n");
+                fprintf(stderr, "\t-P\tsource port range lo-hi of probes, rotated per probe and captured as a whole, %d(+ shard index) by default\n", LOCAL_PORT);
                 fprintf(stderr, "\t-h\tprint these help info\n");
                 fprintf(stderr, "For any questions pls feel free to contact frostmourn716@gmail.com\n");
                 exit(0);
@@ -111,10 +196,20 @@ int main(int argc, char* argv[]) {
     // 全局初始化 curl
     curl_global_init(CURL_GLOBAL_ALL);
 
+    // 分片运行时每个实例使用独立的抓包端口和 cookie 命名空间，同一台机器上的实例互不接收对方的应答
+    // 指定了源端口区间时各实例的区间由使用者分开
+    if (port_lo == 0) {
+        port_lo = port_hi = LOCAL_PORT + shard.get_index();
+    }
+    if (shard.sharded()) {
+        fprintf(stderr, "NOTICE: Probe shard %u/%u, source ports %u-%u\n", shard.get_index(), shard.get_count(), port_lo, port_hi);
+    }
+
     // 创建探测对象
     host_prob *prob = nullptr;
     try {
-        prob = new host_prob();
+        prob = new host_prob(MAX_SEND_THERAD, port_lo, capture_mode, capture_threads,
+            shard.sharded() ? (int)(shard.get_index() % (1u << COOKIE_NS_BITS)) : -1, port_hi - port_lo + 1);
     } catch (std::exception &e) {
         fprintf(stderr, "ERROR: Init host prob failed, %s\n", e.what());
         exit(1);
@@ -135,129 +230,531 @@ int main(int argc, char* argv[]) {
         exit(3);
     }
 
-    // 定义发送消息的线程池
-    ThreadPool mesg_pool(MAX_MESG_THREAD);
+    // 应用层检查用非阻塞连接，全部挂在一个 epoll 上，这个 epoll 再加入探测循环的 epoll
+    AppProber app(get_cur_ms());
+    if (!app.start()) {
+        exit(1);
+    }
+    event.events  = EPOLLIN;
+    event.data.fd = app.get_fd();
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event)) {
+        fprintf(stderr, "ERROR: Faild to add file descriptor to epollfd\n");
+        exit(3);
+    }
+
+    // 告警消息交给独立线程异步投递，探测循环只负责入队
+    Notifier notifier(dingding_robot);
+    if (!notifier.start()) {
+        exit(1);
+    }
+
+    // 指标服务在独立线程中响应抓取，探测路径只做线程本地的原子累加
+    MetricsServer metrics_server(metrics_addr);
+    if (!metrics_addr.empty()) {
+        if (!metrics_server.start()) {
+            exit(1);
+        }
+        fprintf(stderr, "NOTICE: Serve metrics on %s\n", metrics_addr.c_str());
+    }
 
     // 定义健康检查的数据存储结构
-    std::unordered_map<std::string, HealthState> health_states;
+    // 目标以稳定的整数 id 存放在目标表中，健康状态按 id 存放在数组中
+    // 最后一个 cookie 索引留给规则扫描的探测
+    TargetTable targets(probe_cookie::sweep_index);
+    target_diff diff;
+    // 网段和端口区间规则不展开，按各自的扫描周期轮流探测，有应答的地址才加入目标表(discovered)
+    RangeSweeper sweeper;
+    target_rules rules;
+    target_rules taken_rules;
+    target_diff found;
+    std::vector<sweep_addr> sweep_addrs;
+    std::vector<uint8_t> discovered;
+    HealthTable health(3, REFUSE_FAIL_CNT);
+    std::vector<health_change> health_changes;
+    // 状态变化先在窗口内合并，按服务和网段分组后再交给通知线程，抖动的目标暂停通知
+    AlertCoalescer alerts(alert_window_ms);
+    alerts.set_cause_text(REPLY_CLOSED, "端口拒绝连接");
+    alerts.set_cause_text(REPLY_UNREACH, "目标不可达");
+    alerts.set_cause_text(REPLY_APP_FAILED, "应用检查失败");
+    alerts.set_cause_text(REPLY_APP_TIMEOUT, "应用无响应");
+    // 按服务配置的应用层检查，check_of 为每个目标的检查序号加 1，0 表示只看 SYN-ACK
+    std::unordered_map<std::string, uint16_t> check_index;
+    std::vector<uint16_t> check_of;
+    int app_ok_cnt = 0;
+    int app_fail_cnt = 0;
+    std::string alert_text;
+    // 健康状态写入 mmap 的状态文件，重启后按 ip:port 找回，仍处于故障的目标保持故障并在恢复时通知
+    HealthStore store;
+    if (!state_file.empty()) {
+        if (!store.open(state_file)) {
+            exit(1);
+        }
+        fprintf(stderr, "NOTICE: Keep health states in %s, %zu saved by the last run\n", state_file.c_str(), store.restorable());
+    }
+    // 按 IP 分组: 一台主机的所有端口都无响应时只探测一个端口，其余端口暂停探测，直到主机再次响应
+    HostGroups hosts;
+    std::vector<uint32_t> park_ids;
+    std::vector<uint32_t> wake_ids;
+    std::vector<LatencyHistogram> rtt_hists;
+    char str_host[INET_ADDRSTRLEN + 8];
     int report_interval = 60;
     int counter = 0;
 
+    // 目标文件由后台线程监听(inotify)并解析，探测循环只应用解析好的增量
+    TargetWatcher watcher(data_file, shard);
+    if (watcher.start() < 0) {
+        fprintf(stderr, "Error: can't load file %s\n", data_file.c_str());
+        exit(1);
+    }
+
+    // 探测调度: 时间轮把每个目标的探测均匀分散在它的探测间隔内，令牌桶限制全局发包速率
+    // 每个目标在收到回复或超时后，按上次发送时间加探测间隔安排下一次探测
+    // 稳定的目标逐步拉长探测间隔(-b)，丢失回复或被拒绝的目标立即以短间隔追加探测，直到确认失败或恢复正常
+    ProbeScheduler scheduler(get_cur_ms(), max_pps);
+    scheduler.set_max_interval(max_interval_ms);
+    std::vector<uint32_t> suspect_ids;
+    std::vector<uint32_t> send_ids;
+    send_stat &stat = prob->get_send_stat();
+    long int period_start_ms = get_cur_ms();
+    int recv_cnt = 0;
+    int refuse_cnt = 0;
+    int timeout_cnt = 0;
+
+    // 探测结果先记录到健康表的位图中，每轮循环统一判定一次，状态变化的目标再生成通知
+    auto on_fail = [&](uint32_t id) {
+        health.on_fail(id);
+        targets.addr_str(id, str_host, sizeof(str_host));
+        fprintf(stderr, "DEBUG: On Fail Host %s\n", str_host);
+    };
+
+    // 端口被拒绝或目标不可达时立即判定本次探测失败，不必等到超时
+    auto on_refused = [&](uint32_t id, int kind) {
+        health.on_refused(id, (uint8_t)kind);
+        targets.addr_str(id, str_host, sizeof(str_host));
+        fprintf(stderr, "DEBUG: On Refused Host %s (%s)\n", str_host, kind == REPLY_CLOSED ? "closed" :
+            (kind == REPLY_UNREACH ? "unreachable" : (kind == REPLY_APP_FAILED ? "app check failed" : "app check timeout")));
+    };
+
+    // 只在状态有变化时写入，写入的是共享映射的内存，由状态文件的后台线程定期刷盘
+    health_record saved;
+    auto save_state = [&](uint32_t id) {
+        if (!store.active() || !targets.alive(id)) return;
+        health.save(id, saved);
+        store.save(id, targets.rec(id).ip, targets.rec(id).port, saved, alerts.alerted_healthy(id));
+    };
+
+    auto on_change = [&](const health_change &c, long int now_ms) {
+        alerts.add(c.id, c.healthy, c.cause, now_ms);
+        scheduler.set_pace(c.id, c.healthy ? ProbeScheduler::PACE_NORMAL : ProbeScheduler::PACE_DOWN);
+        targets.addr_str(c.id, str_host, sizeof(str_host));
+        fprintf(stderr, "DEBUG: %s Host %s -> ", c.healthy ? "On Sccess" : "Down", str_host);
+        health.print(c.id);
+    };
+
+    auto on_silent = [&](uint32_t id) {
+        if (hosts.on_silent(id, park_ids)) {
+            targets.addr_str(id, str_host, sizeof(str_host));
+            fprintf(stderr, "NOTICE: Host of %s silent on all %zu ports, probe only this one\n", str_host, hosts.ports(id));
+        }
+    };
+
+    // 应用目标增量，by_rule 为 true 时是规则扫描发现的目标，返回新发现的目标数
+    auto apply_diff = [&](const target_diff &d, bool by_rule) {
+        targets.apply(d);
+        scheduler.resize(targets.capacity());
+        discovered.resize(targets.capacity(), 0);
+        size_t new_cnt = 0;
+        d.for_each_added([&](uint32_t ip, uint16_t port) {
+            uint32_t id = targets.find(ip, port);
+            if (id == INVALID_TARGET || id >= targets.capacity()) return;
+            scheduler.set_interval(id, targets.interval(id));
+            if (by_rule && !discovered[id]) {
+                ++new_cnt;
+                targets.addr_str(id, str_host, sizeof(str_host));
+                fprintf(stderr, "NOTICE: Found %s by rule sweep, probe it as service %s\n", str_host, targets.service(id).c_str());
+            }
+            // 目标文件中明确列出的目标不随规则删除
+            discovered[id] = by_rule ? 1 : 0;
+        });
+        return new_cnt;
+    };
+
+    auto assign_check = [&](uint32_t id) {
+        std::unordered_map<std::string, uint16_t>::const_iterator it = check_index.find(targets.service(id));
+        check_of[id] = (it == check_index.end() || rules.checks[it->second].kind == CHECK_TCP) ? 0 : it->second + 1;
+    };
+
+    auto describe = [&](uint32_t id, alert_entry &e) {
+        e.ip      = targets.rec(id).ip;
+        e.port    = targets.rec(id).port;
+        e.service = targets.service(id);
+    };
+
+    // 发出通知的目标记下已通知的状态
+    auto describe_sent = [&](uint32_t id, alert_entry &e) {
+        describe(id, e);
+        save_state(id);
+    };
+
     // 开始探测循环
     struct epoll_event recv_events[MAX_EVENTS];
+    bool loaded = false;        // 目标文件已加载过，只有规则的文件不产生目标增量
+    long int swept_ms = 0;      // 规则都扫描完一遍的时刻
     while (true) {
-        long int start_ms = get_cur_ms();
-
-        std::vector<struct host_addr> host_vec;
-        std::unordered_map<std::string, std::string> detect_flag;
-        int rec_cnt = get_hosts(data_file.c_str(), host_vec, detect_flag);
-
-        fprintf(stderr, "\nNOTICE: Read %d hosts, start to send detect datagram...\n", rec_cnt);
-
-        // 扔进探测队列探测
-        // 对于每次探测，先将所有目标标记为失败，再将收到回复的标记为成功
-        // 那些请求未发送成功和未在指定时间收到回复的，就自然标记为失败
-        for (size_t i = 0; i < host_vec.size(); ++i) {
-            std::string str_host = host_vec[i].to_str();
-            if (health_states.find(str_host) == health_states.end()) {
-                health_states.insert({str_host, {3, 5}});
-            }
+        long int now_ms = get_cur_ms();
+        long int phase_us = get_cur_us();
 
-            prob->detect(host_vec[i]);
+        // 只对新增和删除的目标重建报文模板、健康状态和调度，未变化的目标保留 id 和历史
+        if (watcher.take(diff)) {
+            apply_diff(diff, false);
+            loaded = true;
         }
-        long int detect_cost_ms = get_cur_ms() - start_ms;
-        fprintf(stderr, "NOTICE: Detect finish. cost: %ld ms\n", detect_cost_ms);
-
-        std::vector<std::string> recover_hosts;
-        std::vector<std::string> down_hosts;
-        std::vector<std::string> need_report;
-
-        // 在限定时间范围内接收返回结果，对于收到结果的 target，判断是否恢复
-        int recv_cnt = 0;
-        while (true) {
-            int event_cnt = epoll_wait(epoll_fd, recv_events, MAX_EVENTS, 100);
-            if (event_cnt < 0) {
-                fprintf(stderr, "ERROR: Epoll failed with errno: %d\n", errno);
-                exit(3);
+        // 规则变化后从头扫描，已发现的目标按新规则更新服务名和间隔，不再被覆盖的移除
+        bool sweep_changed = false;
+        if (watcher.take_rules(taken_rules)) {
+            sweep_changed = !taken_rules.same_sweep(rules);
+            rules = taken_rules;
+            loaded = true;
+            // 应用层检查按服务名重新匹配所有目标，同一服务配置多次时以最后一条为准
+            check_index.clear();
+            for (size_t i = 0; i < rules.checks.size(); ++i) {
+                check_index[rules.checks[i].service] = (uint16_t)i;
+                if (rules.checks[i].kind == CHECK_MYSQL && rules.checks[i].arg.empty()) {
+                    fprintf(stderr, "WARNING: Mysql check of %s has no user, each check is a connect error to the server, "
+                        "which blocks this host after max_connect_errors of them\n", rules.checks[i].service.c_str());
+                }
             }
-            for (int i = 0; i < event_cnt; ++i) {
-                while (true) {
-                    std::string str_host = prob->capture();
-                    if (str_host.empty()) {
-                        break;
-                    }
-
-                    if (health_states[str_host].st_change_on_success()) {
-                        std::string content = std::string("服务: ") + detect_flag[str_host] + "  地址: " + str_host + "\n";
-                        recover_hosts.emplace_back(content);
-                        fprintf(stderr, "DEBUG: On Sccess Host %s -> ", str_host.c_str());
-                        health_states[str_host].print();
+            check_of.resize(targets.capacity(), 0);
+            targets.for_each(assign_check);
+            if (!rules.checks.empty()) {
+                fprintf(stderr, "NOTICE: App checks for %zu services\n", check_index.size());
+            }
+        }
+        if (sweep_changed) {
+            sweeper.load(rules, now_ms);
+            diff.clear();
+            targets.for_each([&](uint32_t id) {
+                if (id >= discovered.size() || !discovered[id]) return;
+                target_line line;
+                line.ip   = targets.rec(id).ip;
+                line.port = targets.rec(id).port;
+                const target_rule *r = sweeper.find(line.ip, line.port);
+                if (!r) {
+                    diff.removed.push_back(line);
+                } else if (r->service != targets.service(id) || r->interval_ms != targets.interval(id)) {
+                    line.interval_ms = r->interval_ms;
+                    snprintf(line.service, sizeof(line.service), "%s", r->service.c_str());
+                    diff.added.push_back(line);
+                }
+            });
+            apply_diff(diff, true);
+            metrics().set(G_RULES, sweeper.size());
+            fprintf(stderr, "NOTICE: Sweep %zu rules over %lu addresses, %zu found targets dropped\n",
+                sweeper.size(), (unsigned long)sweeper.addresses(), diff.removed.size());
+        }
+        if (!targets.changes().empty()) {
+            health.resize(targets.capacity());
+            alerts.resize(targets.capacity());
+            hosts.resize(targets.capacity());
+            rtt_hists.resize(targets.capacity());
+            scheduler.resize(targets.capacity());
+            discovered.resize(targets.capacity(), 0);
+            check_of.resize(targets.capacity(), 0);
+            app.resize(targets.capacity());
+            for (uint32_t id : targets.changes()) {
+                // 已有目标只换了服务或间隔：重新选应用检查，按新间隔调整失败窗口，探测历史和告警状态保留
+                // 主机分组按地址，地址不变无需调整
+                if (targets.change_of(id) == TargetTable::CHANGE_UPDATED) {
+                    app.cancel(id);
+                    assign_check(id);
+                    health.set_window(id, fail_window_cycles(scheduler.get_interval(id)));
+                    continue;
+                }
+                scheduler.remove(id);
+                rtt_hists[id].release();
+                alerts.reset(id);
+                app.cancel(id);
+                check_of[id] = 0;
+                if (targets.alive(id)) {
+                    assign_check(id);
+                    scheduler.add(id, targets.interval(id), now_ms);
+                    health.reset(id, fail_window_cycles(scheduler.get_interval(id)));
+                    hosts.add(id, targets.rec(id).ip, wake_ids);
+                    bool was_alerted = true;
+                    if (store.find(targets.rec(id).ip, targets.rec(id).port, saved, was_alerted)) {
+                        health.load(id, saved);
+                        alerts.restore(id, saved.healthy, was_alerted, saved.cause, now_ms);
+                        if (!saved.healthy) {
+                            scheduler.set_pace(id, ProbeScheduler::PACE_DOWN);
+                            targets.addr_str(id, str_host, sizeof(str_host));
+                            fprintf(stderr, "NOTICE: Host %s still down as before restart\n", str_host);
+                        }
                     }
-
-                    detect_flag.erase(str_host);
-                    ++recv_cnt;
+                    save_state(id);
+                } else {
+                    hosts.remove(id, wake_ids);
+                    discovered[id] = 0;
+                    store.drop(id);
                 }
             }
-            if (get_cur_ms() - start_ms >= 900) break;
+            prob->load_targets(targets);
+            targets.clear_changes();
+            metrics().set(G_TARGETS, targets.size());
+            metrics().observe(T_PHASE_RELOAD, get_cur_us() - phase_us);
         }
-        fprintf(stderr, "DEBUG: Totally recv ack %d\n", recv_cnt);
 
-        // 超出时间范围仍然没有收到结果的，判定为失败
-        for (auto _pair : detect_flag) {
-            if (health_states[_pair.first].st_change_on_fail()) {
-                std::string content = std::string("服务: ") + _pair.second + "  地址: " + _pair.first;
-                down_hosts.emplace_back(content);
+        // 到期的目标进入待发送队列，按令牌桶允许的数量批量发送
+        // 重传超时到期的探测重新进入待发送队列，重传次数用完或超过截止时间仍然没有收到回复的探测，判定为失败
+        phase_us = get_cur_us();
+        scheduler.advance(now_ms, [&](uint32_t id) {
+            ++timeout_cnt;
+            on_fail(id);
+            on_silent(id);
+        });
+        for (uint32_t id : park_ids) {
+            scheduler.remove(id);
+        }
+        park_ids.clear();
+        if (scheduler.pop_ready(phase_us, send_ids) > 0) {
+            if (batch_send) {
+                prob->detect_batch(send_ids.data(), send_ids.size());
+            } else {
+                for (uint32_t id : send_ids) {
+                    prob->detect(id);
+                }
             }
-            if (!health_states[_pair.first].healthy()) {
-                std::string content = std::string("服务: ") + _pair.second + "  地址: " + _pair.first;
-                need_report.emplace_back(content);
+            for (uint32_t id : send_ids) {
+                prob->set_tries(id, scheduler.on_sent(id, now_ms));
             }
-            fprintf(stderr, "DEBUG: On Fail Host %s -> ", _pair.first.c_str());
-            health_states[_pair.first].print();
+            metrics().observe(T_PHASE_SEND, get_cur_us() - phase_us);
+        }
+        // 目标用剩的发包配额留给规则扫描，已是目标的地址和属于其它分片的地址不再扫描
+        if (!sweeper.empty()) {
+            size_t budget = scheduler.take_budget(phase_us, SWEEP_BATCH_MAX);
+            size_t sweep_cnt = sweeper.take(now_ms, budget, [&](uint32_t ip, uint16_t port) {
+                return !shard.owns(ip, port) || targets.find(ip, port) != INVALID_TARGET;
+            }, sweep_addrs);
+            scheduler.return_budget(budget - sweep_cnt);
+            prob->detect_sweep(sweep_addrs.data(), sweep_cnt);
         }
 
-        // 对产生变化的 hosts 发送消息通知
-        if (!recover_hosts.empty() || !down_hosts.empty()) {
-            mesg_pool.enqueue([&recover_hosts, &down_hosts, &dingding_robot]() {
-                std::string text = "### 探活状态变动\n";
-                if (!recover_hosts.empty()) {
-                    text += "##### 恢复正常\n";
-                    for (auto item : recover_hosts) {
-                        text += "> " + item + "  \n";
-                    }
+        // 等待回包直到下一个有定时任务的时刻，收到回复的 target 判断是否恢复
+        long int wait_ms = app.idle_ms(scheduler.idle_ms(sweeper.empty() ? 100 : SWEEP_TICK_MS));
+        phase_us = get_cur_us();
+        int event_cnt = epoll_wait(epoll_fd, recv_events, MAX_EVENTS, wait_ms > 1 ? wait_ms : 1);
+        if (event_cnt < 0 && errno != EINTR) {
+            fprintf(stderr, "ERROR: Epoll failed with errno: %d\n", errno);
+            exit(3);
+        }
+        long int reply_ms = get_cur_ms();
+        metrics().observe(T_PHASE_WAIT, get_cur_us() - phase_us);
+        phase_us = get_cur_us();
+        for (int i = 0; i < event_cnt; ++i) {
+            if (recv_events[i].data.fd == app.get_fd()) {
+                continue;
+            }
+            prob->capture_all([&](uint32_t id, uint32_t rtt_us, int kind) {
+                // 重复或过期的回复不计入，路由器回复的 ICMP 不代表到目标的往返时间
+                if (!scheduler.on_reply(id, reply_ms, kind == REPLY_UNREACH ? 0 : rtt_us, kind == REPLY_OPEN)) {
+                    return;
                 }
-                if (!down_hosts.empty()) {
-                    text += "##### 探活失败\n";
-                    for (auto item : down_hosts) {
-                        text += "> " + item + "  \n";
+                // 路径上的 ICMP 不可达不能说明主机存活
+                if (kind == REPLY_UNREACH) {
+                    on_silent(id);
+                } else if (hosts.on_reply(id, wake_ids)) {
+                    targets.addr_str(id, str_host, sizeof(str_host));
+                    fprintf(stderr, "NOTICE: Host of %s answers again, probe all %zu ports\n", str_host, hosts.ports(id));
+                }
+                if (kind == REPLY_OPEN) {
+                    ++recv_cnt;
+                    // 重传过的探测不知道回复对应哪一次发送，不计入延迟
+                    if (rtt_us > 0) {
+                        rtt_hists[id].record(rtt_us);
                     }
+                    // 配置了应用层检查的目标等检查有结论再记录结果，检查无法启动时按 SYN-ACK 计为成功
+                    if (check_of[id] == 0) {
+                        health.on_success(id);
+                    } else if (!app.check(id, targets.sock_addr(id), rules.checks[check_of[id] - 1], reply_ms)) {
+                        metrics().add(M_APP_SKIPPED);
+                        health.on_success(id);
+                    }
+                } else {
+                    ++refuse_cnt;
+                    on_refused(id, kind);
                 }
-                std::string body = "{\"msgtype\": \"markdown\",\"markdown\": {\"title\":\"探活状态变动\",\"text\":\""+text+"\"},\"at\":{\"atMobiles\":[\"13811626017\"], \"isAtAll\": false}}";
-                http_post(dingding_robot, body, 1000);
+            }, [&](uint32_t ip, uint16_t port, int kind) {
+                // 规则扫描到开放的端口，按规则的服务名和探测间隔加入目标表
+                if (kind != REPLY_OPEN || targets.find(ip, port) != INVALID_TARGET) return;
+                const target_rule *r = sweeper.find(ip, port);
+                if (!r) return;
+                target_line line;
+                line.ip          = ip;
+                line.port        = port;
+                line.interval_ms = r->interval_ms;
+                snprintf(line.service, sizeof(line.service), "%s", r->service.c_str());
+                found.added.push_back(line);
             });
         }
+        if (!found.empty()) {
+            metrics().add(M_SWEEP_FOUND, apply_diff(found, true));
+            found.clear();
+        }
+        // 上次运行保存的状态保留到它的目标都有机会重新出现：目标文件已加载，规则各扫描完一遍，
+        // 并且最后一批扫描的回复也已收到，之后才切换到本次运行的状态，再新增的目标不再恢复
+        if (store.pending() && loaded && sweeper.swept()) {
+            if (swept_ms == 0) {
+                swept_ms = reply_ms;
+            } else if (reply_ms - swept_ms >= PROBE_TIMEOUT_MS) {
+                store.commit();
+                fprintf(stderr, "NOTICE: Health states of all targets saved, states of the last run dropped\n");
+            }
+        } else {
+            swept_ms = 0;
+        }
+        // 应用层检查的结论和超时，无响应和失败都按拒绝处理，连续若干次后判定失败
+        app.poll(reply_ms, [&](uint32_t id, int result) {
+            if (!targets.alive(id)) return;
+            if (result == APP_OK) {
+                ++app_ok_cnt;
+                health.on_success(id);
+                return;
+            }
+            ++app_fail_cnt;
+            on_refused(id, result == APP_TIMEOUT ? REPLY_APP_TIMEOUT : REPLY_APP_FAILED);
+        });
+        if (event_cnt > 0) {
+            metrics().observe(T_PHASE_CAPTURE, get_cur_us() - phase_us);
+        }
+
+        // 主机无响应时暂停其余端口，恢复响应后重新加入调度
+        for (uint32_t id : park_ids) {
+            scheduler.remove(id);
+        }
+        park_ids.clear();
+        for (uint32_t id : wake_ids) {
+            if (id != HOST_NIL && targets.alive(id)) scheduler.resume(id, reply_ms);
+        }
+        wake_ids.clear();
+
+        // 本轮的成功、超时和拒绝一次性应用到健康表
+        if (health.apply(health_changes) > 0) {
+            for (const health_change &c : health_changes) {
+                on_change(c, reply_ms);
+            }
+            health_changes.clear();
+        }
+        for (uint32_t id : health.stepped()) {
+            save_state(id);
+        }
+
+        // 可疑目标在确认失败(已转为 PACE_DOWN)或窗口内不再有失败后恢复正常探测间隔
+        scheduler.take_suspects(suspect_ids);
+        if (!suspect_ids.empty()) {
+            size_t kept = 0;
+            for (uint32_t id : suspect_ids) {
+                if (!targets.alive(id) || scheduler.get_pace(id) != ProbeScheduler::PACE_SUSPECT) continue;
+                if (health.clean(id)) {
+                    scheduler.set_pace(id, ProbeScheduler::PACE_NORMAL);
+                    continue;
+                }
+                suspect_ids[kept++] = id;
+            }
+            suspect_ids.resize(kept);
+        }
+
+        if (reply_ms - period_start_ms < REPORT_PERIOD_MS) {
+            continue;
+        }
+        period_start_ms = reply_ms;
+        phase_us = get_cur_us();
+
+        size_t retry_cnt = scheduler.take_retries();
+        fprintf(stderr, "\nNOTICE: Probe stat. targets: %zu, parked: %zu, suspects: %zu, replies: %d, refused: %d, retransmits: %zu, timeouts: %d, backlog: %zu\n",
+            targets.size(), hosts.parked(), suspect_ids.size(), recv_cnt, refuse_cnt, retry_cnt, timeout_cnt, scheduler.backlog());
+        fprintf(stderr, "NOTICE: Send stat. mode: %s, sent: %zu, errors: %zu, syscalls: %zu, span: %ld us, pps: %.0f\n",
+            batch_send ? "batch" : "single", stat.packets.load(), stat.errors.load(), stat.syscalls.load(), stat.span_us(), stat.pps());
+        if (!rules.checks.empty() || app.running() > 0) {
+            fprintf(stderr, "NOTICE: App stat. running: %zu, ok: %d, failed: %d\n", app.running(), app_ok_cnt, app_fail_cnt);
+        }
+        capture_stat cap_stat;
+        memset(&cap_stat, 0, sizeof(cap_stat));
+        if (prob->get_capture_stat(cap_stat)) {
+            fprintf(stderr, "NOTICE: Capture stat. mode: %s, packets: %lu, drops: %lu, freezes: %lu\n",
+                capture_mode == CAPTURE_RING ? "ring" : "recv", cap_stat.packets, cap_stat.drops, cap_stat.freezes);
+        }
+        metrics().add(M_PROBE_TIMEOUTS, timeout_cnt);
+        metrics().add(M_PROBE_RETRIES, retry_cnt);
+        metrics().set(G_PARKED, hosts.parked());
+        metrics().set(G_BACKLOG, scheduler.backlog());
+        metrics().set(G_SEND_QUEUE, prob->get_send_queue());
+        metrics().set(G_ALERT_QUEUE, notifier.depth());
+        metrics().set(G_KERNEL_PACKETS, cap_stat.packets);
+        metrics().set(G_KERNEL_DROPS, cap_stat.drops);
+        metrics().set(G_KERNEL_FREEZES, cap_stat.freezes);
+        stat.reset();
+        recv_cnt = 0;
+        refuse_cnt = 0;
+        timeout_cnt = 0;
+        app_ok_cnt = 0;
+        app_fail_cnt = 0;
+
+        // 合并窗口结束后，对产生变化的 hosts 发送一条消息通知
+        if (alerts.flush(reply_ms, describe_sent, alert_text)) {
+            notifier.post(robot_body("探活状态变动", alert_text));
+        }
 
-        // 固定间隔汇报处于探活失败状态的机器
+        // 固定间隔汇报处于探活失败状态的机器，以及这段时间内每个 target 和每个服务的连接延迟
         if (++counter == report_interval) {
             counter = 0;
-            if (!need_report.empty()) {
-                mesg_pool.enqueue([need_report, &dingding_robot]() {
-                    std::string text = "### 失活机器汇总\n";
-                    for (auto item : need_report) {
-                        text += "> " + item + "  \n";
-                    }
-                    std::string body = "{\"msgtype\": \"markdown\",\"markdown\": {\"title\":\"失活机器汇总\",\"text\":\""+text+"\"},\"at\":{\"atMobiles\":[\"13811626017\"], \"isAtAll\": false}}";
-                    http_post(dingding_robot, body, 1000);
-                });
+            std::vector<std::string> slow_hosts;
+            std::unordered_map<std::string, LatencySummary> serv_rtt;
+            targets.for_each([&](uint32_t id) {
+                LatencyHistogram &hist = rtt_hists[id];
+                if (hist.count() == 0) return;
+                serv_rtt[targets.service(id)].merge(hist);
+                targets.addr_str(id, str_host, sizeof(str_host));
+                uint32_t p99_us = hist.percentile(0.99);
+                fprintf(stderr, "DEBUG: Latency host %s, samples: %u, p50: %.3f ms, p99: %.3f ms, max: %.3f ms, srtt: %.3f ms, rto: %u ms\n",
+                    str_host, hist.count(), hist.percentile(0.5) / 1000.0, p99_us / 1000.0, hist.max() / 1000.0,
+                    scheduler.get_srtt_us(id) / 1000.0, scheduler.get_rto(id));
+                if (p99_alert_ms > 0 && hist.count() >= LATENCY_MIN_SAMPLES && p99_us > p99_alert_ms * 1000) {
+                    char p99_str[32];
+                    snprintf(p99_str, sizeof(p99_str), "%.1f ms", p99_us / 1000.0);
+                    slow_hosts.emplace_back(std::string("服务: ") + targets.service(id) + "  地址: " + str_host + "  p99: " + p99_str);
+                }
+                hist.reset();
+            });
+            for (auto &item : serv_rtt) {
+                fprintf(stderr, "NOTICE: Latency service %s, samples: %lu, p50: %.3f ms, p99: %.3f ms, max: %.3f ms\n",
+                    item.first.c_str(), (unsigned long)item.second.count(), item.second.percentile(0.5) / 1000.0,
+                    item.second.percentile(0.99) / 1000.0, item.second.max() / 1000.0);
+            }
+            if (!slow_hosts.empty()) {
+                std::string text = "### 连接延迟告警\n##### p99 超过 " + std::to_string(p99_alert_ms) + " ms\n";
+                for (auto &item : slow_hosts) {
+                    text += "> " + item + "  \n";
+                }
+                notifier.post(robot_body("连接延迟告警", text));
             }
-        }
 
-        // 如果还有时间，等待
-        long int rest_time = 1000 - (get_cur_ms() - start_ms);
-        fprintf(stderr, "NOTICE: Recv finish. will sleep: %ld ms\n", rest_time);
-        if (rest_time > 0) {
-            usleep(rest_time * 1000);
+            std::vector<alert_entry> need_report;
+            targets.for_each([&](uint32_t id) {
+                if (health.healthy(id)) return;
+                alert_entry e;
+                e.id      = id;
+                e.section = ALERT_DOWN;
+                e.cause   = 0;
+                describe(id, e);
+                need_report.push_back(e);
+            });
+            if (!need_report.empty()) {
+                static const char *titles[ALERT_SECTION_NUM] = { "失活机器", "", "" };
+                std::string text = "### 失活机器汇总\n";
+                alerts.render(need_report, titles, text);
+                notifier.post(robot_body("失活机器汇总", text));
+            }
         }
+        metrics().observe(T_PHASE_REPORT, get_cur_us() - phase_us);
     }
 
     curl_global_cleanup();